@@ -0,0 +1,477 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "async_frame_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define FPV_HAVE_IO_URING 1
+#else
+#define FPV_HAVE_IO_URING 0
+#endif
+
+namespace fpvc {
+
+#if FPV_HAVE_IO_URING
+
+// Minimal io_uring interface using the raw system calls, so that no liburing
+// dependency is needed. Only used from a single thread.
+class AsyncFrameReader::IoUring {
+ public:
+  ~IoUring() {
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_) munmap(sq_ptr_, sq_size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool Init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    // Not supported by the kernel or not permitted in this environment.
+    if (fd_ < 0) return false;
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+    sq_ptr_ = Map(sq_size_, IORING_OFF_SQ_RING);
+    if (!sq_ptr_) return false;
+    cq_ptr_ = single_mmap ? sq_ptr_ : Map(cq_size_, IORING_OFF_CQ_RING);
+    if (!cq_ptr_) return false;
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe*>(
+        Map(sqes_size_, IORING_OFF_SQES));
+    if (!sqes_) return false;
+
+    uint8_t* sq = static_cast<uint8_t*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_entries_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    uint8_t* cq = static_cast<uint8_t*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+    // Kernels before 5.6 have io_uring but reject IORING_OP_READ, those use
+    // the thread pool too.
+    return SupportsRead();
+  }
+
+  // Queues a read, returns false if the submission queue is full.
+  bool PrepareRead(int fd, void* buffer, unsigned size, uint64_t offset,
+                   uint64_t user_data) {
+    struct io_uring_sqe* sqe = NextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    Commit();
+    return true;
+  }
+
+  // Queues a one-shot wait for the file descriptor to become readable.
+  bool PreparePoll(int fd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = NextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = user_data;
+    Commit();
+    return true;
+  }
+
+  // Submits all queued operations and waits until at least min_complete
+  // operations are complete.
+  bool Enter(unsigned min_complete) {
+    for (;;) {
+      int ret = syscall(__NR_io_uring_enter, fd_, to_submit_, min_complete,
+                        IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret >= 0) {
+        to_submit_ -= std::min<unsigned>(ret, to_submit_);
+        return true;
+      }
+      if (errno != EINTR) return false;
+    }
+  }
+
+  bool PopCompletion(uint64_t* user_data, int32_t* res) {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+    const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+    *user_data = cqe.user_data;
+    *res = cqe.res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  // Returns whether the kernel supports IORING_OP_READ. The probe appeared
+  // together with it, so failing to probe means that it isn't supported.
+  bool SupportsRead() {
+    std::vector<uint8_t> buffer(sizeof(struct io_uring_probe) +
+                                256 * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe =
+        reinterpret_cast<struct io_uring_probe*>(buffer.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                256) < 0) {
+      return false;
+    }
+    return IORING_OP_READ <= probe->last_op &&
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  void* Map(size_t size, off_t offset) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  struct io_uring_sqe* NextSqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_tail_local_ - head >= sq_entries_) return nullptr;
+    struct io_uring_sqe* sqe = &sqes_[sq_tail_local_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  void Commit() {
+    unsigned index = sq_tail_local_ & sq_mask_;
+    sq_array_[index] = index;
+    sq_tail_local_++;
+    __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+    to_submit_++;
+  }
+
+  int fd_ = -1;
+  void* sq_ptr_ = nullptr;
+  void* cq_ptr_ = nullptr;
+  size_t sq_size_ = 0;
+  size_t cq_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sq_tail_local_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  unsigned to_submit_ = 0;
+};
+
+#else  // FPV_HAVE_IO_URING
+
+class AsyncFrameReader::IoUring {
+ public:
+  bool Init(unsigned entries) { return false; }
+  bool PrepareRead(int fd, void* buffer, unsigned size, uint64_t offset,
+                   uint64_t user_data) { return false; }
+  bool PreparePoll(int fd, uint64_t user_data) { return false; }
+  bool Enter(unsigned min_complete) { return false; }
+  bool PopCompletion(uint64_t* user_data, int32_t* res) { return false; }
+};
+
+#endif  // FPV_HAVE_IO_URING
+
+AsyncFrameReader::AsyncFrameReader(size_t num_decode_threads,
+                                   size_t queue_depth, bool use_io_uring)
+    : queue_depth_(std::max<size_t>(queue_depth, 1)) {
+  if (use_io_uring) {
+    ring_.reset(new IoUring());
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    // The ring has one extra entry for the wakeup poll.
+    if (wakeup_fd_ < 0 || !ring_->Init(queue_depth_ + 1)) ring_.reset();
+  }
+
+  if (ring_) {
+    io_threads_.emplace_back(&AsyncFrameReader::RunIoUringThread, this);
+  } else {
+    StartReadThreads(&io_threads_);
+  }
+  num_decode_threads = std::max<size_t>(num_decode_threads, 1);
+  for (size_t i = 0; i < num_decode_threads; i++) {
+    decode_threads_.emplace_back(&AsyncFrameReader::RunDecodeThread, this);
+  }
+}
+
+AsyncFrameReader::~AsyncFrameReader() {
+  {
+    std::unique_lock<std::mutex> l(m_);
+    finish_ = true;
+  }
+  cv_read_.notify_all();
+  cv_decode_.notify_all();
+  if (ring_) {
+    uint64_t one = 1;
+    if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+      // Can only fail on counter overflow, a wakeup is pending then anyway.
+    }
+  }
+  // The io_uring thread is joined first, it may still start fallback threads.
+  for (std::thread& thread : io_threads_) thread.join();
+  for (std::thread& thread : fallback_threads_) thread.join();
+  for (std::thread& thread : decode_threads_) thread.join();
+
+  for (Request* request : read_queue_) delete request;
+  for (Request* request : decode_queue_) delete request;
+  for (std::unique_ptr<File>& file : files_) close(file->fd);
+  ring_.reset();
+  if (wakeup_fd_ >= 0) close(wakeup_fd_);
+}
+
+bool AsyncFrameReader::AddFile(const std::string& path, size_t* file) {
+  std::unique_ptr<File> f(new File());
+  f->decoder.reset(new RandomAccessDecoder());
+  // The mapping of the decoder only gets its header and footer paged in, the
+  // frames themselves are read through fd.
+  if (!f->decoder->OpenFile(path)) return false;
+  f->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (f->fd < 0) return false;
+  *file = files_.size();
+  files_.push_back(std::move(f));
+  return true;
+}
+
+bool AsyncFrameReader::Submit(size_t file, size_t index, void* payload) {
+  if (file >= files_.size()) return false;
+  size_t offset, size;
+  if (!files_[file]->decoder->FrameRange(index, &offset, &size)) return false;
+
+  Request* request = new Request();
+  request->file = file;
+  request->index = index;
+  request->payload = payload;
+  request->offset = offset;
+  request->size = size;
+  bool use_ring;
+  {
+    std::unique_lock<std::mutex> l(m_);
+    read_queue_.push_back(request);
+    pending_++;
+    use_ring = ring_ && !ring_failed_;
+  }
+  if (use_ring) {
+    uint64_t one = 1;
+    if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+      // Can only fail on counter overflow, a wakeup is pending then anyway.
+    }
+  } else {
+    cv_read_.notify_one();
+  }
+  return true;
+}
+
+bool AsyncFrameReader::WaitResult(Result* result) {
+  std::unique_lock<std::mutex> l(m_);
+  if (pending_ == 0) return false;
+  cv_result_.wait(l, [this]{ return !results_.empty(); });
+  *result = std::move(results_.front());
+  results_.pop_front();
+  pending_--;
+  return true;
+}
+
+bool AsyncFrameReader::PollResult(Result* result) {
+  std::unique_lock<std::mutex> l(m_);
+  if (results_.empty()) return false;
+  *result = std::move(results_.front());
+  results_.pop_front();
+  pending_--;
+  return true;
+}
+
+void AsyncFrameReader::StartReadThreads(std::vector<std::thread>* threads) {
+  size_t num_read_threads = std::min<size_t>(queue_depth_, 16);
+  for (size_t i = 0; i < num_read_threads; i++) {
+    threads->emplace_back(&AsyncFrameReader::RunReadThread, this);
+  }
+}
+
+void AsyncFrameReader::RunIoUringThread() {
+  // user_data 0 is the wakeup poll, all others are Request pointers.
+  ring_->PreparePoll(wakeup_fd_, 0);
+  // Requests whose reads are submitted to the ring.
+  std::vector<Request*> in_flight;
+  // Requests with a buffer that wait to be submitted: new ones, and reads
+  // that were cut short and must continue where they ended.
+  std::deque<Request*> to_read;
+  for (;;) {
+    std::vector<Request*> issued;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      if (finish_ && in_flight.empty()) break;
+      size_t busy = in_flight.size() + to_read.size();
+      while (!finish_ && busy + issued.size() < queue_depth_ &&
+             !read_queue_.empty()) {
+        issued.push_back(read_queue_.front());
+        read_queue_.pop_front();
+      }
+    }
+    // Allocating only here bounds the buffers by the queue depth rather than
+    // by the amount of submitted frames.
+    for (Request* request : issued) {
+      request->buffer.resize(request->size);
+      to_read.push_back(request);
+    }
+    while (!to_read.empty() && in_flight.size() < queue_depth_) {
+      Request* request = to_read.front();
+      if (!ring_->PrepareRead(files_[request->file]->fd,
+                              request->buffer.data() + request->done,
+                              request->buffer.size() - request->done,
+                              request->offset + request->done,
+                              reinterpret_cast<uint64_t>(request))) {
+        break;
+      }
+      to_read.pop_front();
+      in_flight.push_back(request);
+    }
+
+    if (!ring_->Enter(1)) {
+      // The ring is unusable. The reads in flight fail, the others and all
+      // later ones are done by a pool of threads with blocking reads.
+      {
+        std::unique_lock<std::mutex> l(m_);
+        ring_failed_ = true;
+        read_queue_.insert(read_queue_.begin(), to_read.begin(),
+                           to_read.end());
+        to_read.clear();
+        if (!finish_) StartReadThreads(&fallback_threads_);
+      }
+      cv_read_.notify_all();
+      for (Request* request : in_flight) {
+        request->ok = false;
+        FinishRead(request);
+      }
+      return;
+    }
+
+    uint64_t user_data;
+    int32_t res;
+    while (ring_->PopCompletion(&user_data, &res)) {
+      if (user_data == 0) {
+        uint64_t count;
+        if (read(wakeup_fd_, &count, sizeof(count)) < 0) {
+          // Nothing to consume, another completion already drained it.
+        }
+        ring_->PreparePoll(wakeup_fd_, 0);
+        continue;
+      }
+      Request* request = reinterpret_cast<Request*>(user_data);
+      in_flight.erase(std::find(in_flight.begin(), in_flight.end(), request));
+      if (res < 0) {
+        request->ok = false;
+        FinishRead(request);
+      } else {
+        request->done += res;
+        if (res == 0 || request->done == request->buffer.size()) {
+          FinishRead(request);
+        } else {
+          to_read.push_back(request);
+        }
+      }
+    }
+  }
+  for (Request* request : to_read) delete request;
+}
+
+void AsyncFrameReader::RunReadThread() {
+  for (;;) {
+    Request* request;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      cv_read_.wait(l, [this]{ return finish_ || !read_queue_.empty(); });
+      if (finish_) return;
+      request = read_queue_.front();
+      read_queue_.pop_front();
+    }
+    // Continues where the ring left off if it failed during the read.
+    request->buffer.resize(request->size);
+    size_t done = request->done;
+    if (ReadFully(files_[request->file]->fd, request->offset + done,
+                  request->buffer.size() - done,
+                  request->buffer.data() + done)) {
+      request->done = request->buffer.size();
+    } else {
+      request->ok = false;
+    }
+    FinishRead(request);
+  }
+}
+
+void AsyncFrameReader::FinishRead(Request* request) {
+  {
+    std::unique_lock<std::mutex> l(m_);
+    decode_queue_.push_back(request);
+  }
+  cv_decode_.notify_one();
+}
+
+void AsyncFrameReader::RunDecodeThread() {
+  DecodeContext context;
+  context.worker = true;
+  for (;;) {
+    std::unique_ptr<Request> request;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      cv_decode_.wait(l, [this]{ return finish_ || !decode_queue_.empty(); });
+      if (finish_) return;
+      request.reset(decode_queue_.front());
+      decode_queue_.pop_front();
+    }
+
+    const RandomAccessDecoder& decoder = *files_[request->file]->decoder;
+    Result result;
+    result.file = request->file;
+    result.index = request->index;
+    result.payload = request->payload;
+    result.xsize = decoder.xsize();
+    result.ysize = decoder.ysize();
+    result.frame.resize(result.xsize * result.ysize);
+    result.ok = request->ok && decoder.DecodeFrameChunk(
+        request->buffer.data(), request->done, result.frame.data(), &context);
+
+    {
+      std::unique_lock<std::mutex> l(m_);
+      results_.push_back(std::move(result));
+    }
+    cv_result_.notify_one();
+  }
+}
+
+}  // namespace fpvc
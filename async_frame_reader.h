@@ -0,0 +1,137 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FPV_ASYNC_FRAME_READER_H_
+#define FPV_ASYNC_FRAME_READER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fusion_power_video.h"
+
+namespace fpvc {
+
+/* Reads and decodes frames scattered over one or more files asynchronously.
+Only the bytes of the requested frames are read, located through the frame
+index of each file. Reads are batched through io_uring where the kernel
+supports it, with a fallback to a pool of threads doing blocking reads. The
+fetched frames are decoded by a pool of decode workers and handed back through
+a completion queue, in the order in which they complete. */
+class AsyncFrameReader {
+ public:
+  struct Result {
+    size_t file = 0;
+    size_t index = 0;
+    bool ok = false;
+    size_t xsize = 0;
+    size_t ysize = 0;
+    std::vector<uint16_t> frame;
+    void* payload = nullptr;
+  };
+
+  // Uses num_decode_threads (at least 1) threads to decode frames, and keeps
+  // up to queue_depth reads in flight at the same time. With use_io_uring
+  // false, reads always go through the thread pool.
+  AsyncFrameReader(size_t num_decode_threads = 4, size_t queue_depth = 64,
+                   bool use_io_uring = true);
+  ~AsyncFrameReader();
+
+  AsyncFrameReader(const AsyncFrameReader&) = delete;
+  AsyncFrameReader& operator=(const AsyncFrameReader&) = delete;
+
+  // Opens a file and parses its header and frame index. Outputs the id to use
+  // for it in Submit.
+  bool AddFile(const std::string& path, size_t* file);
+
+  // Returns the decoder of an added file, e.g. to query its numframes.
+  const RandomAccessDecoder& decoder(size_t file) const {
+    return *files_[file]->decoder;
+  }
+
+  /* Queues the frame with the given index of the given file for reading and
+  decoding. Returns immediately; the result is delivered through WaitResult or
+  PollResult with the payload attached. Files must not be added anymore once
+  frames are submitted. */
+  bool Submit(size_t file, size_t index, void* payload = nullptr);
+
+  // Blocks until the next frame is done. Returns false if nothing is pending.
+  bool WaitResult(Result* result);
+
+  // Like WaitResult but returns false rather than blocking if no frame is done
+  // yet.
+  bool PollResult(Result* result);
+
+  // Returns whether reads go through io_uring rather than the thread pool.
+  bool UsesIoUring() const { return ring_ != nullptr && !ring_failed_; }
+
+ private:
+  struct File {
+    std::unique_ptr<RandomAccessDecoder> decoder;
+    int fd = -1;
+  };
+
+  struct Request {
+    size_t file;
+    size_t index;
+    void* payload;
+    uint64_t offset;
+    size_t size;
+    // Only allocated when the read is issued.
+    std::vector<uint8_t> buffer;
+    size_t done = 0;  // Amount of bytes read so far.
+    bool ok = true;
+  };
+
+  class IoUring;
+
+  void StartReadThreads(std::vector<std::thread>* threads);
+  void RunIoUringThread();
+  void RunReadThread();
+  void RunDecodeThread();
+  void FinishRead(Request* request);
+
+  std::vector<std::unique_ptr<File>> files_;
+
+  std::unique_ptr<IoUring> ring_;
+  size_t queue_depth_;
+  std::vector<std::thread> io_threads_;
+  // Started by the io_uring thread when the ring fails, guarded by m_.
+  std::vector<std::thread> fallback_threads_;
+  std::vector<std::thread> decode_threads_;
+
+  std::mutex m_;
+  std::condition_variable cv_read_;    // for the read queue
+  std::condition_variable cv_decode_;  // for the decode queue
+  std::condition_variable cv_result_;  // for the completion queue
+  std::deque<Request*> read_queue_;
+  std::deque<Request*> decode_queue_;
+  std::deque<Result> results_;
+  size_t pending_ = 0;  // Submitted frames whose result is not yet taken.
+  bool finish_ = false;
+  // Set when the ring fails, after which reads are done without it.
+  std::atomic<bool> ring_failed_{false};
+  int wakeup_fd_ = -1;  // Interrupts the io_uring thread waiting for reads.
+};
+
+}  // namespace fpvc
+
+#endif  // FPV_ASYNC_FRAME_READER_H_
@@ -1,4 +1,5 @@
 #include "camera_format_handler.h"
+#include "simd_kernels.h"
 #include <cstring>
 #include <iostream>
 #include <algorithm>
@@ -92,40 +93,8 @@ CameraFrame CameraFormatHandler::ConvertToCameraFrame(const uint16_t* frame_data
   const size_t total_pixels = xsize * ysize;
   frame.data.resize(total_pixels);
   
-  // Use aligned loads/stores when possible for better memory performance
-  #if defined(__AVX2__)
-    // AVX2 implementation would go here for processing 16 or 32 pixels at once
-    // This is a placeholder for actual SIMD implementation
-  #else
-    // Fallback to optimized scalar implementation with loop unrolling
-    const size_t chunk_size = 16;
-    size_t i = 0;
-    
-    // Process in chunks for better cache performance and instruction pipelining
-    for (; i + chunk_size <= total_pixels; i += chunk_size) {
-      frame.data[i]      = (frame_data[i]      >> 8) & 0xFF;
-      frame.data[i + 1]  = (frame_data[i + 1]  >> 8) & 0xFF;
-      frame.data[i + 2]  = (frame_data[i + 2]  >> 8) & 0xFF;
-      frame.data[i + 3]  = (frame_data[i + 3]  >> 8) & 0xFF;
-      frame.data[i + 4]  = (frame_data[i + 4]  >> 8) & 0xFF;
-      frame.data[i + 5]  = (frame_data[i + 5]  >> 8) & 0xFF;
-      frame.data[i + 6]  = (frame_data[i + 6]  >> 8) & 0xFF;
-      frame.data[i + 7]  = (frame_data[i + 7]  >> 8) & 0xFF;
-      frame.data[i + 8]  = (frame_data[i + 8]  >> 8) & 0xFF;
-      frame.data[i + 9]  = (frame_data[i + 9]  >> 8) & 0xFF;
-      frame.data[i + 10] = (frame_data[i + 10] >> 8) & 0xFF;
-      frame.data[i + 11] = (frame_data[i + 11] >> 8) & 0xFF;
-      frame.data[i + 12] = (frame_data[i + 12] >> 8) & 0xFF;
-      frame.data[i + 13] = (frame_data[i + 13] >> 8) & 0xFF;
-      frame.data[i + 14] = (frame_data[i + 14] >> 8) & 0xFF;
-      frame.data[i + 15] = (frame_data[i + 15] >> 8) & 0xFF;
-    }
-    
-    // Process remaining items
-    for (; i < total_pixels; ++i) {
-      frame.data[i] = (frame_data[i] >> 8) & 0xFF;
-    }
-  #endif
+  // Vectorized for the instruction set of the CPU
+  HighBytes16(frame_data, total_pixels, frame.data.data());
   
   return frame;
 }
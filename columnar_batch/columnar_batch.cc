@@ -1,5 +1,4 @@
 #include "columnar_batch.h"
-#include <algorithm>
 
 namespace fpvc::columnarbatch {
 
@@ -15,6 +14,15 @@ namespace fpvc::columnarbatch {
         size_t encoded_preview_size = 0;
         
         delta_frame_ = uncompressed_delta_frame;
+        if (delta_frame_.state() != FrameState::EMPTY) {
+            const std::vector<uint8_t> &high = delta_frame_.high();
+            const std::vector<uint8_t> &low = delta_frame_.low();
+            delta_pixels_.resize(xsize * ysize);
+            for (size_t i = 0; i < delta_pixels_.size(); ++i) {
+                // frames without low bytes don't store them
+                delta_pixels_[i] = (high[i] << 8) | (low.empty() ? 0 : low[i]);
+            }
+        }
 
         uncompressed_delta_frame.CompressPredicted(&encoded_high_size, compressed_delta_frame_high_plane_.data(), 
                 &encoded_low_size, compressed_delta_frame_low_plane_.data(),
@@ -28,6 +36,15 @@ namespace fpvc::columnarbatch {
 
     }
 
+    void Image::Reset(int64_t timestamp, size_t xsize, size_t ysize, uint8_t bpp, Type type) {
+        timestamp_ = timestamp;
+        xsize_ = xsize;
+        ysize_ = ysize;
+        bpp_ = bpp;
+        type_ = type;
+        data_.resize(xsize * ysize * (bpp > 8 ? 2 : 1));
+    }
+
     Batch::Batch(size_t batch_size, SchemaPtr schema) :
                 schema_(schema), batch_size_(batch_size), length_(0), 
                 previews_capacity_((Frame::MaxCompressedPreviewSize(schema->xsize(), schema->ysize()) + 63) & 0x7ffffffc0) ,
@@ -87,38 +104,60 @@ namespace fpvc::columnarbatch {
     }
 
     Image Batch::ExtractImage(size_t index, Image::Type type) {
-        std::vector<uint8_t> high;
-        std::vector<uint8_t> low;
-        std::vector<uint8_t> preview;
-        uint8_t flags = flags_[index];
-        uint8_t state = FrameState::COMPRESSED | FrameState::DELTA_PREDICTED | FrameState::CG_PREDICTED;
+        Image image;
+        DecodeScratch scratch;
+        if (!ExtractImage(index, type, &image, &scratch)) {
+            return Image();
+        }
+        return image;
+    }
 
+    size_t Batch::ImageSize(Image::Type type) {
         if (type == Image::Type::PREVIEW) {
-            preview.assign(preview_ + preview_offsets_[index], preview_ + preview_offsets_[index + 1]);
-        } else {
-            high.assign(high_plane_ + high_plane_offsets_[index], high_plane_ + high_plane_offsets_[index + 1]);
-            if (type == Image::Type::FULL) {
-                low.assign(low_plane_ + low_plane_offsets_[index], low_plane_ + low_plane_offsets_[index + 1]);
-            } else {
-                flags |= FrameFlags::NO_LOW_BYTES;
-            }
+            return (schema_->xsize() / 4) * (schema_->ysize() / 4);
         }
+        size_t numpixels = schema_->xsize() * schema_->ysize();
+        return type == Image::Type::FULL ? 2 * numpixels : numpixels;
+    }
 
-        if (!preview.empty()) state |= FrameState::PREVIEW_GENERATED;
-
-        Frame frame(schema_->xsize(), schema_->ysize(), flags, state, std::move(high), std::move(low), std::move(preview), timestamps_[index]);
-        frame.Uncompress(schema_->delta_frame());
-
+    bool Batch::ExtractImage(size_t index, Image::Type type, Image* image, DecodeScratch* scratch) {
+        size_t xsize = schema_->xsize();
+        size_t ysize = schema_->ysize();
         if (type == Image::Type::PREVIEW) {
-            return Image(frame.timestamp(), frame.xsize()/4, frame.ysize()/4, 8, type, frame.MoveOutPreview());
+            image->Reset(timestamps_[index], xsize / 4, ysize / 4, 8, type);
         } else if (type == Image::Type::MSB8) {
-            return Image(frame.timestamp(), frame.xsize(), frame.ysize(), 8, type, frame.MoveOutHigh());
+            image->Reset(timestamps_[index], xsize, ysize, 8, type);
         } else {
-            std::vector<uint8_t> data(2 * frame.xsize() * frame.ysize());
-            std::transform(frame.low().begin(), frame.low().end(), frame.high().begin(), reinterpret_cast<uint16_t*>(data.data()),
-                    [](int l, int h) { return l | (h<<8); });
-            return Image(frame.timestamp(), frame.xsize(), frame.ysize(), 16 - schema_->shiftedLeft(), type, std::move(data));
+            image->Reset(timestamps_[index], xsize, ysize, 16 - schema_->shiftedLeft(), type);
+        }
+        return ExtractImage(index, type, image->data8(), scratch);
+    }
+
+    bool Batch::ExtractImage(size_t index, Image::Type type, uint8_t* out, DecodeScratch* scratch) {
+        if (index >= length_) {
+            return false;
+        }
+        size_t xsize = schema_->xsize();
+        size_t ysize = schema_->ysize();
+        uint8_t flags = flags_[index];
+
+        DecodeTarget target;
+        target.data = out;
+        if (type != Image::Type::FULL) {
+            // 8 bit images are the high bytes
+            target.type = DecodeTarget::UINT8;
+            target.shift = 8;
+        }
+        if (type == Image::Type::PREVIEW) {
+            // the preview is not delta predicted
+            return DecompressPlanes(nullptr, flags & ~FrameFlags::USE_DELTA,
+                    preview_ + preview_offsets_[index], preview_offsets_[index + 1] - preview_offsets_[index],
+                    nullptr, 0, xsize / 4, ysize / 4, true, target, scratch);
         }
+        return DecompressPlanes(schema_->deltaPixels(), flags,
+                high_plane_ + high_plane_offsets_[index], high_plane_offsets_[index + 1] - high_plane_offsets_[index],
+                low_plane_ + low_plane_offsets_[index], low_plane_offsets_[index + 1] - low_plane_offsets_[index],
+                xsize, ysize, type == Image::Type::MSB8, target, scratch);
     }
 
 }
\ No newline at end of file
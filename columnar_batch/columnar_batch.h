@@ -13,6 +13,8 @@ namespace fpvc::columnarbatch {
         const size_t ysize() { return ysize_; }
         const size_t shiftedLeft() { return shifted_left_; }
         Frame &delta_frame() { return delta_frame_; }
+        /// Pixels of the delta frame, for decoding the delta predicted frames; nullptr without delta frame
+        const uint16_t* deltaPixels() { return delta_pixels_.empty() ? nullptr : delta_pixels_.data(); }
 
         /// Delta Frame is _not_ CG predicted
         const std::vector<uint8_t> &compressedDeltaFrameHighPlane() { return compressed_delta_frame_high_plane_; }
@@ -28,6 +30,7 @@ namespace fpvc::columnarbatch {
         std::vector<uint8_t> compressed_delta_frame_high_plane_;
         std::vector<uint8_t> compressed_delta_frame_low_plane_;
         Frame delta_frame_;
+        std::vector<uint16_t> delta_pixels_;
     };
 
     typedef std::shared_ptr<BatchSchema> SchemaPtr;
@@ -45,6 +48,9 @@ namespace fpvc::columnarbatch {
         Image(int64_t timestamp = -1, size_t xsize = 0, size_t ysize = 0, uint8_t bpp = 0,
             Type type = Type::FULL, std::vector<uint8_t> &&data = std::vector<uint8_t>());
 
+        /// Sets new properties for reusing the image, keeping the buffer if it is large enough.
+        void Reset(int64_t timestamp, size_t xsize, size_t ysize, uint8_t bpp, Type type);
+
         size_t const timestamp() { return timestamp_; }
         size_t const xsize() { return xsize_; }
         size_t const ysize() { return ysize_; }
@@ -78,6 +84,16 @@ namespace fpvc::columnarbatch {
         size_t length() { return length_; }
         Image ExtractImage(size_t index, Image::Type type);
 
+        /// Bytes of an extracted image of the type, 16 bits per pixel for FULL, 8 for MSB8 and PREVIEW
+        size_t ImageSize(Image::Type type);
+
+        /// Decompresses a frame straight from the backing buffer into out, which must have ImageSize(type)
+        /// bytes. The scratch keeps the planes between calls, so that extracting doesn't allocate; it may
+        /// only be used by one thread at a time. Returns false if the frame is corrupt.
+        bool ExtractImage(size_t index, Image::Type type, uint8_t* out, DecodeScratch* scratch);
+        /// Same, into the buffer of image, which is only reallocated if it is too small.
+        bool ExtractImage(size_t index, Image::Type type, Image* image, DecodeScratch* scratch);
+
         SchemaPtr const schema() { return schema_; };
 
     private:
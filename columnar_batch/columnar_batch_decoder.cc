@@ -1,19 +1,37 @@
 #include "columnar_batch_decoder.h"
-#include <algorithm>
+#include "../simd_kernels.h"
 
 namespace fpvc::columnarbatch {
 
-    ColumnarBatchDecoder::ColumnarBatchDecoder(Image::Type type, bool unshift, ImageProcessor image_processor) :
+    ColumnarBatchDecoder::ColumnarBatchDecoder(Image::Type type, bool unshift, ImageProcessor image_processor,
+        int parallelism, bool in_order) :
          image_processor_(image_processor), type_(type), unshift_(unshift),
          promised_closing_timestamp_(std::promise<int64_t>()), closing_timestamp_future_(promised_closing_timestamp_.get_future()),
-         decoder_thread_(std::thread(&ColumnarBatchDecoder::DecoderTask, this)), batch_queue_(), closing_(false), schema_(nullptr)
+         in_order_(in_order), workers_(), current_job_(nullptr), job_generation_(0), stopping_(false),
+         batch_queue_(), closing_(false), schema_(nullptr), latest_provided_timestamp(-1)
          {
-
+        if (parallelism <= 0) {
+            parallelism = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < parallelism; i++) {
+            workers_.emplace_back(&ColumnarBatchDecoder::WorkerTask, this);
+        }
+        // started last, as it uses the queue members declared after it
+        decoder_thread_ = std::thread(&ColumnarBatchDecoder::DecoderTask, this);
     }
 
     ColumnarBatchDecoder::~ColumnarBatchDecoder() {
         Close();
         decoder_thread_.join();
+
+        {
+            std::unique_lock<std::mutex> lock(job_mutex_);
+            stopping_ = true;
+        }
+        job_condition_.notify_all();
+        for (std::thread &worker : workers_) {
+            worker.join();
+        }
     }
 
 
@@ -41,6 +59,9 @@ namespace fpvc::columnarbatch {
     std::shared_future<int64_t> ColumnarBatchDecoder::Close() {
         {
             std::unique_lock<std::mutex> lock(queue_mutex_);
+            if (closing_) {
+                return closing_timestamp_future_;
+            }
             closing_ = true;
             PromisedBatch promised_batch;
             promised_batch.Done();
@@ -76,15 +97,26 @@ namespace fpvc::columnarbatch {
                     delta_frame_.Uncompress();
                 }
 
-                for (size_t i = 0; i < batch->length(); i++) {
-                    Image img = batch->ExtractImage(i, type_);
-        		    size_t shifted_left = schema_->shiftedLeft();
-                    if (unshift_ && shifted_left > 0 && img.bpp() > 8) {
-                        std::transform(img.data16(), img.data16() + img.xsize() * img.ysize(), img.data16(),
-                                [shifted_left](uint16_t v){ return v >> shifted_left; });
+                // hand the frames to the workers, they are independent of each other
+                auto job = std::make_shared<BatchJob>(batch, in_order_);
+                {
+                    std::unique_lock<std::mutex> lock(job_mutex_);
+                    current_job_ = job;
+                    job_generation_++;
+                }
+                job_condition_.notify_all();
+
+                if (in_order_) {
+                    for (size_t i = 0; i < batch->length(); i++) {
+                        image_processor_(job->WaitForImage(i));
                     }
+                } else {
+                    job->WaitForAll();
+                }
 
-                    image_processor_(std::move(img));
+                {
+                    std::unique_lock<std::mutex> lock(job_mutex_);
+                    current_job_ = nullptr;
                 }
                 latest_provided_timestamp = batch->LatestTimestamp();
 
@@ -93,6 +125,86 @@ namespace fpvc::columnarbatch {
         }
         promised_closing_timestamp_.set_value(latest_provided_timestamp);
     }
+
+    void ColumnarBatchDecoder::ReturnImage(Image image) {
+        std::unique_lock<std::mutex> lock(image_pool_mutex_);
+        image_pool_.push_back(std::move(image));
+    }
+
+    Image ColumnarBatchDecoder::PooledImage() {
+        std::unique_lock<std::mutex> lock(image_pool_mutex_);
+        if (image_pool_.empty()) {
+            return Image();
+        }
+        Image image = std::move(image_pool_.front());
+        image_pool_.pop_front();
+        return image;
+    }
+
+    void ColumnarBatchDecoder::WorkerTask() {
+        DecodeScratch scratch;
+        uint64_t seen_generation = 0;
+        while (true) {
+            std::shared_ptr<BatchJob> job;
+
+            {
+                std::unique_lock<std::mutex> lock(job_mutex_);
+                job_condition_.wait(lock, [&]{ return stopping_ || job_generation_ != seen_generation; });
+                if (stopping_) {
+                    return;
+                }
+                seen_generation = job_generation_;
+                job = current_job_;
+            }
+
+            if (job) {
+                ExtractImages(*job, &scratch);
+            }
+        }
+    }
+
+    void ColumnarBatchDecoder::ExtractImages(BatchJob &job, DecodeScratch* scratch) {
+        BatchPtr batch = job.batch();
+        size_t shifted_left = schema_->shiftedLeft();
+        for (size_t i = job.NextIndex(); i < batch->length(); i = job.NextIndex()) {
+            Image img = PooledImage();
+            if (!batch->ExtractImage(i, type_, &img, scratch)) {
+                img = Image();
+            } else if (unshift_ && shifted_left > 0 && img.bpp() > 8) {
+                ShiftRight16(img.data16(), img.xsize() * img.ysize(), shifted_left, img.data16());
+            }
+
+            if (in_order_) {
+                job.Finish(i, std::move(img));
+            } else {
+                image_processor_(std::move(img));
+                job.Finish(i, Image());
+            }
+        }
+    }
+
+    void ColumnarBatchDecoder::BatchJob::Finish(size_t index, Image image) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!images_.empty()) {
+                images_[index] = std::move(image);
+                ready_[index] = true;
+            }
+            finished_++;
+        }
+        condition_.notify_all();
+    }
+
+    Image ColumnarBatchDecoder::BatchJob::WaitForImage(size_t index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [&]{ return ready_[index]; });
+        return std::move(images_[index]);
+    }
+
+    void ColumnarBatchDecoder::BatchJob::WaitForAll() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [&]{ return finished_ == batch_->length(); });
+    }
 }
 
 
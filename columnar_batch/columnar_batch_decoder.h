@@ -1,10 +1,14 @@
 #ifndef FPV_COLUMNAR_BATCH_DECODER_H_
 #define FPV_COLUMNAR_BATCH_DECODER_H_
 
+#include <algorithm>
+#include <atomic>
 #include <future>
 #include <list>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <vector>
 #include "columnar_batch.h"
 #include "../fusion_power_video.h"
 
@@ -12,16 +16,31 @@ namespace fpvc::columnarbatch {
     class ColumnarBatchDecoder {
         public:
 
-        ColumnarBatchDecoder(Image::Type type, bool unshift, ImageProcessor image_processor);
+        /// Frames of a batch are extracted by parallelism worker threads, 0 uses one per core.
+        /// With in_order, images are passed to the image_processor in the order of the frames from
+        /// a single thread. Otherwise each image is passed as soon as it is extracted, from the
+        /// worker threads concurrently, so the image_processor must be thread-safe.
+        ColumnarBatchDecoder(Image::Type type, bool unshift, ImageProcessor image_processor,
+            int parallelism = 0, bool in_order = true);
         ~ColumnarBatchDecoder();
 
+        /// The future completes once all images of the batch have been processed. Frames that fail to
+        /// decompress are passed as empty images.
         std::future<BatchPtr> PushBatch(BatchPtr batch);
 
+        /// Gives back a processed image, whose buffer is then reused for extracting a later image.
+        void ReturnImage(Image image);
+
         std::shared_future<int64_t> Close();
 
         private:
 
         void DecoderTask();
+        void WorkerTask();
+
+        class BatchJob;
+        void ExtractImages(BatchJob &job, DecodeScratch* scratch);
+        Image PooledImage();
 
         ImageProcessor image_processor_;
         Image::Type type_;
@@ -47,6 +66,42 @@ namespace fpvc::columnarbatch {
             std::promise<BatchPtr> promise_;
         };
 
+        /// Frames of the batch being decoded, shared between the decoder thread and the workers.
+        class BatchJob {
+        public:
+            BatchJob(BatchPtr batch, bool in_order) : batch_(batch), next_index_(0), finished_(0),
+                images_(in_order ? batch->length() : 0), ready_(in_order ? batch->length() : 0, false) {}
+
+            BatchPtr const batch() { return batch_; }
+
+            /// Returns the index of the next frame to extract, or the batch length when none are left.
+            size_t NextIndex() { return std::min(next_index_++, batch_->length()); }
+            /// Stores the image for in order delivery, if the job was created in_order.
+            void Finish(size_t index, Image image);
+            Image WaitForImage(size_t index);
+            void WaitForAll();
+
+        private:
+            BatchPtr batch_;
+            std::atomic<size_t> next_index_;
+            size_t finished_;
+            std::vector<Image> images_;
+            std::vector<bool> ready_;
+            std::mutex mutex_;
+            std::condition_variable condition_;
+        };
+
+        bool in_order_;
+        std::vector<std::thread> workers_;
+        std::shared_ptr<BatchJob> current_job_;
+        uint64_t job_generation_;
+        std::mutex job_mutex_;
+        std::condition_variable job_condition_;
+        bool stopping_;
+
+        std::list<Image> image_pool_;
+        std::mutex image_pool_mutex_;
+
         std::thread decoder_thread_;
         std::list<PromisedBatch> batch_queue_;
         std::mutex queue_mutex_;
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include "columnar_batch_encoder.h"
 #include "columnar_batch_decoder.h"
 
@@ -24,6 +26,71 @@ void compareImage(fpvc::columnarbatch::Image image) {
             std::cout << "Bad Pixel " << i << " (" << image.data16()[i] << " != " << (i*ii) << ")" << std::endl;
     }
     ii++;
+    decoder->ReturnImage(std::move(image));
+}
+
+/// Decodes batches of several frames with parallel workers, and checks that every frame arrives exactly once, in
+/// order if asked, and that the future of a batch completes only after its last image was processed.
+bool testBatches(bool in_order, int parallelism) {
+    const size_t xsize = 64, ysize = 48, batch_size = 5, num_frames = 13;
+    std::vector<std::vector<uint16_t>> images(num_frames, std::vector<uint16_t>(xsize * ysize));
+    for (size_t t = 0; t < num_frames; t++) {
+        for (size_t i = 0; i < xsize * ysize; i++) images[t][i] = (i % xsize) * 40 + (i / xsize) * 20 + t * 300;
+    }
+    fpvc::Frame delta(xsize, ysize, images[0].data(), 0, false, 0);
+    auto schema = std::make_shared<fpvc::columnarbatch::BatchSchema>(xsize, ysize, 0, delta);
+    std::vector<fpvc::columnarbatch::BatchPtr> batches;
+    for (size_t t = 0; t < num_frames; t++) {
+        if (t % batch_size == 0) batches.push_back(std::make_shared<fpvc::columnarbatch::Batch>(batch_size, schema));
+        fpvc::Frame frame(xsize, ysize, images[t].data(), 0, false, t);
+        frame.Predict(schema->delta_frame());
+        batches.back()->AppendPredicted(frame);
+    }
+
+    std::mutex mutex;
+    std::vector<size_t> received(num_frames, 0);
+    std::vector<int64_t> order;
+    bool ok = true;
+    fpvc::columnarbatch::ColumnarBatchDecoder batch_decoder(fpvc::columnarbatch::Image::Type::FULL, false,
+        [&](fpvc::columnarbatch::Image image) {
+            std::lock_guard<std::mutex> lock(mutex);
+            int64_t t = image.timestamp();
+            if (t < 0 || t >= (int64_t)num_frames || !std::equal(images[t].begin(), images[t].end(), image.data16())) {
+                std::cout << "Bad image " << t << std::endl;
+                ok = false;
+                return;
+            }
+            received[t]++;
+            order.push_back(t);
+        }, parallelism, in_order);
+
+    std::vector<std::future<fpvc::columnarbatch::BatchPtr>> futures;
+    for (auto &batch : batches) futures.push_back(batch_decoder.PushBatch(batch));
+    for (size_t b = 0; b < batches.size(); b++) {
+        if (futures[b].get() != batches[b]) ok = false;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t t = b * batch_size; t < std::min((b + 1) * batch_size, num_frames); t++) {
+            if (received[t] != 1) {
+                std::cout << "Batch " << b << " done before image " << t << std::endl;
+                ok = false;
+            }
+        }
+    }
+    batch_decoder.Close().get();
+
+    for (size_t t = 0; t < num_frames; t++) {
+        if (received[t] != 1) {
+            std::cout << "Image " << t << " received " << received[t] << " times" << std::endl;
+            ok = false;
+        }
+    }
+    if (in_order && !std::is_sorted(order.begin(), order.end())) {
+        std::cout << "Images out of order" << std::endl;
+        ok = false;
+    }
+    std::cout << "Batches in_order " << in_order << " parallelism " << parallelism << (ok ? " ok" : " FAILED")
+              << std::endl;
+    return ok;
 }
 
 int main() {
@@ -53,4 +120,8 @@ int main() {
 
     auto dend = decoder->Close().get();
     std::cout << "Closed Decoder - " << dend << "." << std::endl;
+
+    bool ok = testBatches(true, 3);
+    ok &= testBatches(false, 3);
+    return ok ? 0 : 1;
 }
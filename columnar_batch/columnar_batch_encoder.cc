@@ -11,8 +11,8 @@ namespace fpvc::columnarbatch {
             promised_closing_timestamp_(std::promise<int64_t>()), closing_timestamp_future_(promised_closing_timestamp_.get_future()),
             promised_schema_(std::promise<SchemaPtr>()),
             frame_queue_(), closing_(false), delta_frame_(EMPTY),
-            latest_stored_timestamp(-1), encoder_thread_(std::thread(&ColumnarBatchEncoder::EncoderTask, this, std::move(promised_schema_.get_future()))),
-            current_batch_(nullptr),empty_batches_()
+            latest_stored_timestamp(-1), current_batch_(nullptr),empty_batches_(),
+            encoder_thread_(std::thread(&ColumnarBatchEncoder::EncoderTask, this, std::move(promised_schema_.get_future())))
             {
     }
 
@@ -46,7 +46,6 @@ namespace fpvc::columnarbatch {
         
         std::promise<SchemaPtr> promised_schema_;
         
-        std::thread encoder_thread_;
         std::list<std::shared_future<Frame>> frame_queue_;
         std::mutex queue_mutex_;
         std::condition_variable queue_condition_;
@@ -57,6 +56,8 @@ namespace fpvc::columnarbatch {
         std::shared_ptr<Batch> current_batch_;
         std::list<BatchPtr> empty_batches_;
 
+        /// Last, so that the thread starts once the queue and the other members are initialized.
+        std::thread encoder_thread_;
     };
 }
 
@@ -15,6 +15,7 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include "fusion_power_video.h"
 
@@ -62,11 +63,17 @@ int main(int argc, char* argv[]) {
 
   size_t count = 0;
 
-  fpvc::StreamingDecoder decoder;
+  // Frames get decoded by worker threads, this thread only reads the input and
+  // writes the frames in order.
+  fpvc::StreamingDecoder decoder(std::thread::hardware_concurrency());
+  // The frames are decoded directly in the raw file format.
+  fpvc::DecodeTarget format;
+  format.shift = shift;
+  format.big_endian = big_endian;
+  decoder.SetOutputFormat(format);
 
   size_t block_size = (1 << 20);
   std::vector<uint8_t> buffer(block_size);
-  std::vector<uint8_t> raw(xsize * ysize * 2);
 
   while (std::cin) {
     size_t pos = 0;
@@ -76,20 +83,22 @@ int main(int argc, char* argv[]) {
       if (!buffer_size) break;
     }
 
-    decoder.Decode(
+    // Frames are borrowed from the decoder's frame pool and handed back once
+    // written, so that no memory is allocated per frame.
+    decoder.DecodeBorrowed(
         buffer.data(), buffer_size,
-        [shift, big_endian, &count, &raw](bool ok, const uint16_t* image,
-                                          size_t xsize, size_t ysize,
-                                          void* payload) {
+        [&count, &decoder](bool ok, uint16_t* image, size_t xsize,
+                           size_t ysize, void* payload) {
           if (!ok) {
             std::cerr << "decompressing frame failed" << std::endl;
             std::exit(1);
           }
-          fpvc::UnextractFrame(image, xsize, ysize, shift, big_endian,
-                               raw.data());
-          fwrite(raw.data(), 1, raw.size(), stdout);
+          fwrite(image, 1, xsize * ysize * 2, stdout);
+          decoder.ReturnFrame(image);
           std::cerr << "extracted frame " << (count++) << std::endl;
         },
         nullptr);
   }
+  // Deliver the frames that are still being decoded.
+  decoder.Flush();
 }
@@ -29,12 +29,20 @@ size_t ParseInt(const std::string& s) {
 int main(int argc, char* argv[]) {
   if (argc < 5) {
     std::cerr << "Usage: " << argv[0]
-              << " xsize ysize shift big_endian < infile > outfile\n"
+              << " xsize ysize shift big_endian [num_threads] [flags]"
+              << " < infile > outfile\n"
               << "    xsize, ysize: frame size in pixels\n"
               << "    big_endian: endianness of the raw input data, 0 or 1\n"
               << "    shift: how many bits to shift left to match MSBs, to"
               << " ensure the leftmost bits of uint16 are used for 12-bit data:"
               << " xxxxxxxxxxxx0000\n"
+              << "    num_threads: optional, 4 by default\n"
+              << "    --checkpoints=N: write an index checkpoint every N"
+              << " frames, for the recover tool\n"
+              << "    --preview_track: write the previews of all frames"
+              << " together before the footer\n"
+              << "    --checksums: write a checksum after every frame, for the"
+              << " verify tool\n"
               << std::endl;
     return 1;
   }
@@ -43,8 +51,20 @@ int main(int argc, char* argv[]) {
   size_t big_endian = ParseInt(argv[3]);
   size_t shift = ParseInt(argv[4]);
   size_t num_threads = 4;
-  if (argc > 5) {
-    num_threads = ParseInt(argv[5]);
+  size_t checkpoint_interval = 0;
+  bool preview_track = false;
+  bool checksums = false;
+  for (int i = 5; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--preview_track") {
+      preview_track = true;
+    } else if (arg == "--checksums") {
+      checksums = true;
+    } else if (arg.compare(0, 14, "--checkpoints=") == 0) {
+      checkpoint_interval = ParseInt(arg.substr(14));
+    } else {
+      num_threads = ParseInt(arg);
+    }
   }
 
   // There is no theoretical size limit, but this guards against invalid input
@@ -61,6 +81,11 @@ int main(int argc, char* argv[]) {
   size_t framesize = xsize * ysize * 2;
 
   fpvc::Encoder encoder(num_threads, shift, big_endian);
+  encoder.SetCheckpointInterval(checkpoint_interval);
+  // Allows loading all previews, e.g. for a timeline, with one read.
+  encoder.SetPreviewTrack(preview_track);
+  // Allows verifying archives with the verify tool without decoding them.
+  encoder.SetFrameChecksums(checksums);
 
   bool initialized = false;
 
@@ -120,7 +120,8 @@ int encodeCameraFile()
         first_frame = false;
       } else {
         // 压缩每一帧
-        encoder.CompressFrame(buffer_16bit.data(), write_callback, nullptr);
+        encoder.CompressFrame(buffer_16bit.data(), current_frame.timestamp,
+                              write_callback, nullptr);
       }
       frames_processed++;
     } catch (const std::exception& e) {
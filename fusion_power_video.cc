@@ -14,19 +14,30 @@
 
 #include "fusion_power_video.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <poll.h>
 #include <string.h>  // memcpy
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <numeric>
 
 #include <functional>
 #include <algorithm>
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <thread>
 #include <future>
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 
+#include "simd_kernels.h"
+
 /*
 Description of the file format:
 
@@ -44,7 +55,8 @@ define a stream, culminating in the full file format.
 full file format:
 -header: see header format below
 -encoded delta frame: see delta frame format below
--one or more times: encoded frame: see frame format below
+-one or more times: encoded frame: see frame format below, optionally with
+ auxiliary chunks in between, see auxiliary chunk format below
 -footer: see footer format (frame index) below
 Note: the encoder can only choose a single delta frame which can be used for
 prediction of all the frames (so frames don't depend on each other, only on
@@ -81,6 +93,8 @@ frame format:
 image format, given an xsize, ysize and an optional delta frame of the same
  dimensions:
 -1 byte: image flags, see below
+-4 bytes: only if flags & 8, the size of the brotli compressed low bytes below
+ (little endian 32-bit integer)
 -variable amount of bytes: brotli compressed low bytes, or empty if not present
  (see flags)
 -variable amount of bytes: brotli compressed high bytes
@@ -92,14 +106,119 @@ footer format (frame index):
 -4 bytes: size of this entire footer, including these 4 bytes (little
  endian 32-bit integer)
 -1 byte: chunk flags, must have value 2
+-one or more times: footer section, see footer section format below. The
+ frame index section must be present.
+-8 bytes: amount of frames (little endian 64-bit integer)
+-8 bytes: size of this entire footer again (little endian 64-bit integer)
+-4 bytes: the characters 'F', 'P', 'V', '2'
+Note: if the full file is available, the decoder can compute the start of the
+footer by parsing the last 20 bytes, rather than jumping frame by frame through
+the entire file from the front, in case one wants to decode only a particular
+frame.
+Note: files written by older encoders have the following footer instead, which
+decoders still support. It can be told apart by its last 4 bytes, which are the
+most significant bytes of the amount of frames and so can never be 'FPV2':
+-4 bytes: size of this entire footer, including these 4 bytes (little
+ endian 32-bit integer)
+-1 byte: chunk flags, must have value 2
 -per frame:
 --8 bytes: offset from the start of the file to the start of this frame (little
   endian 64-bit integer)
 -8 bytes: amount of frames
-Note: if the full file is available, the decoder can compute the start of the
-footer by parsing the last 8 bytes, rather than jumping frame by frame through
-the entire file from the front, in case one wants to decode only a particular
-frame.
+
+footer section format:
+-1 byte: section type, see below
+-8 bytes: size of the section content (little endian 64-bit integer)
+-section content
+Note: decoders skip sections of a type they do not know.
+
+frame index section (footer section type 1), a two-level index that can be
+queried without decoding it as a whole:
+-4 bytes: amount of frames per block B (little endian 32-bit integer)
+-per block of B frames, the last block may have less than B frames:
+--8 bytes: offset from the start of the file to the start of the first frame of
+  the block (little endian 64-bit integer)
+--4 bytes: position of the sizes of the block in the sizes below, relative to
+  the start of the sizes (little endian 32-bit integer)
+-sizes: per block, per frame except the first frame of the block: the
+ difference between its offset and the offset of the previous frame, as varint
+ (LEB128: 7 bits per byte starting with the least significant bits, with the
+ high bit of a byte set if more bytes follow)
+
+preview track section (footer section type 2), optional, locates the preview
+track written in preview track chunks (see below):
+-8 bytes: amount of previews N, equal to the amount of frames (little endian
+ 64-bit integer)
+-N + 1 times: offset from the start of the file to the start of a compressed
+ preview, and finally to the end of the last one (little endian 64-bit integer)
+
+frame statistics section (footer section type 3), optional, pixel statistics
+computed by the encoder to search frames without decoding them:
+-4 bytes: size R of a record, at least 22 (little endian 32-bit integer)
+-per frame, a record of R bytes of which decoders skip the bytes after the
+ following, all little endian and about the left aligned pixel values:
+--2 bytes: minimum pixel value
+--2 bytes: maximum pixel value
+--8 bytes: sum of the pixel values
+--4 bytes: amount of saturated pixels, with all bits of the data set
+--2 bytes: estimated entropy of the high bytes after prediction, in 1/1024 bits
+  per pixel
+--4 bytes: size of the frame chunk
+
+timestamps section (footer section type 4), optional, the timestamps given to
+the encoder per frame, in a two-level index like the frame index section:
+-4 bytes: amount of frames per block B (little endian 32-bit integer)
+-per block of B frames, the last block may have less than B frames:
+--8 bytes: timestamp of the first frame of the block (little endian 64-bit
+  signed integer)
+--4 bytes: position of the deltas of the block in the deltas below, relative to
+  the start of the deltas (little endian 32-bit integer)
+-deltas: per block, per frame except the first frame of the block: the
+ difference between the delta of its timestamp to the previous timestamp and
+ the previous such delta (taken as 0 for the second frame of the block), as
+ zigzag varint (the signed value v stored as the varint 2 * v if v >= 0, or
+ -2 * v - 1 if v < 0)
+
+auxiliary chunk format:
+-4 bytes: size of this entire chunk, including these 4 bytes (little endian
+ 32-bit integer)
+-1 byte: chunk flags, must have value 4
+-1 byte: auxiliary chunk type, see below
+-remaining bytes: content depending on the type
+Note: decoders skip auxiliary chunks they have no use for, they do not count as
+frames. Decoders that predate auxiliary chunks, such as the StreamingDecoder of
+older versions, reject them, which is why the encoder only writes them when an
+option that needs them is enabled.
+
+index checkpoint (auxiliary chunk type 1), optionally written by the encoder
+every so many frames such that the frame index of a file that was never finished, for example
+because the encoding process was killed, can be rebuilt without reading all
+frames:
+-4 bytes: the characters 'f', 'p', 'v', 'i', to locate checkpoints when
+ scanning backwards from the end of a truncated file
+-8 bytes: offset from the start of the file to the start of this chunk (little
+ endian 64-bit integer)
+-8 bytes: offset from the start of the file to the previous index checkpoint, or
+ 0 if this is the first one (little endian 64-bit integer)
+-8 bytes: index of the first frame listed in this checkpoint (little endian
+ 64-bit integer)
+-4 bytes: amount of frames listed (little endian 32-bit integer)
+-per frame listed, these are all frames since the previous checkpoint:
+--8 bytes: offset from the start of the file to the start of this frame (little
+  endian 64-bit integer)
+
+preview track (auxiliary chunk type 2), optionally written by the encoder after
+the last frame, holding a copy of the previews of all frames packed together so
+that they can be read with one sequential read rather than from every frame:
+-per preview: the preview image in the image format, as in its frame. A preview
+ is never split over two chunks, a large track uses multiple chunks in a row.
+
+frame checksum (auxiliary chunk type 3), optionally written by the encoder
+directly after every frame, to verify files without decoding them:
+-4 bytes: CRC-32C (Castagnoli) of the entire frame chunk before this chunk
+ (little endian 32-bit integer)
+-4 bytes: CRC-32C of the decoded frame, as little endian 16-bit pixel values
+ (little endian 32-bit integer)
 
 chunk flags meanings:
 -flags & 1: this must be true for the delta frame immediately after the header,
@@ -107,6 +226,7 @@ chunk flags meanings:
  but the delta frame that all other frames can use as base for prediction.
 -flags & 2: this must be true for the footer (frame index), and must be false
  for all frames.
+-flags & 4: this must be true for auxiliary chunks, and false for all frames.
 
 image flags meanings:
 -flags & 1: if true, delta frame prediction is enabled. This must be false if
@@ -114,6 +234,22 @@ image flags meanings:
 -flags & 2: if true, clamped gradient prediction is enabled
 -flags & 4: if true, the compressed low bytes brotli stream is not present, all
  lower bytes are taken to be 0. Note: this can be used for the preview image.
+-flags & 8: if true, the size of the compressed low bytes is given. This allows
+ decoding the high bytes without the low bytes, or both at the same time. Must
+ be false if flags & 4 is true. Note: decoders written before this flag was
+ added can't read images that have it, encoders only set it when asked to.
+-flags & 16: only for preview images: the high bytes stream is followed by a
+ preview pyramid, see below. Decoders that only need the 1/4 scale preview can
+ ignore it.
+
+preview pyramid, optional, at the end of the preview image of a frame. Level k
+ of the pyramid has the xsize and ysize of the frame divided by 2^(k + 1),
+ rounded down, level 1 being the preview image itself:
+-per stored level other than 1, in increasing level order: the preview of that
+ level in the image format, 8-bit like the preview image.
+-per stored level other than 1, in the same order: the size of its image (little
+ endian 32-bit integer)
+-1 byte: levels mask, bit k is set if level k is stored. Bit 1 must be set.
 
 procedure to decode an image:
 -Note: given the xsize and ysize, a frame has xsize columns and ysize rows.
@@ -123,9 +259,10 @@ procedure to decode an image:
 -brotli decompress the high bytes. These correspond to the MSB's of the 16-bit
  image.
 -Note: the brotli format is specified in RFC 7932
--Note: the format has two concatenated brotli streams in a row, their individual
- sizes are not encoded in this file format, but they are implicitely present
- in the brotli stream, and the brotli decoder knows where the first stream ends.
+-Note: the format has two concatenated brotli streams in a row, unless flags & 8
+ is set their individual sizes are not encoded in this file format, but they
+ are implicitely present in the brotli stream, and the brotli decoder knows
+ where the first stream ends.
  The second stream must end at the last byte of this encoded frame, if not the
  file is invalid.
 -Note: each brotli-decoded byte stream has xsize * ysize bytes, if not the file
@@ -155,6 +292,49 @@ procedure to decode an image:
 */
 
 namespace fpvc {
+
+uint32_t ReadUint32LE(const uint8_t* data) {
+  return (uint32_t)data[0] + ((uint32_t)data[1] << 8) +
+      ((uint32_t)data[2] << 16) + ((uint32_t)data[3] << 24);
+}
+
+void WriteUint32LE(uint32_t value, uint8_t* data) {
+  data[0] = value & 255;
+  data[1] = (value >> 8) & 255;
+  data[2] = (value >> 16) & 255;
+  data[3] = (value >> 24) & 255;
+}
+
+uint64_t ReadUint64LE(const uint8_t* data) {
+  return (uint64_t)data[0] + ((uint64_t)data[1] << 8) +
+      ((uint64_t)data[2] << 16) + ((uint64_t)data[3] << 24) +
+      ((uint64_t)data[4] << 32) + ((uint64_t)data[5] << 40) +
+      ((uint64_t)data[6] << 48) + ((uint64_t)data[7] << 56);
+}
+
+void WriteUint64LE(uint64_t value, uint8_t* data) {
+  data[0] = value & 255;
+  data[1] = (value >> 8) & 255;
+  data[2] = (value >> 16) & 255;
+  data[3] = (value >> 24) & 255;
+  data[4] = (value >> 32) & 255;
+  data[5] = (value >> 40) & 255;
+  data[6] = (value >> 48) & 255;
+  data[7] = (value >> 56) & 255;
+}
+
+bool ReadFully(int fd, size_t offset, size_t size, uint8_t* out) {
+  while (size > 0) {
+    ssize_t n = pread(fd, out, size, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    out += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
 namespace {
 
 // Enable this to print line number and message on decoding errors.
@@ -213,6 +393,50 @@ bool BrotliDecompress(const uint8_t* in, size_t size, size_t* pos,
   return true;
 }
 
+// Decompresses the brotli stream at *pos, but only keeps the decompressed bytes
+// in the range [begin, end), which are output to out. If to_end, the entire
+// stream is decompressed and *pos is set to where it ended, as for
+// BrotliDecompress, and the total decompressed size is output to total.
+// Otherwise decompression stops as soon as the bytes up to end are available,
+// and *pos and total are not set.
+bool BrotliDecompressRange(const uint8_t* in, size_t size, size_t* pos,
+                           size_t begin, size_t end, bool to_end,
+                           uint8_t* out, size_t* total) {
+  std::unique_ptr<BrotliDecoderState, std::function<void(BrotliDecoderState*)>>
+      decoder(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr),
+              &BrotliDecoderDestroyInstance);
+  if (!decoder) return FAILURE("couldn't init brotli decoder");
+
+  size_t avail_in = size - *pos;
+  const uint8_t* next_in = in + *pos;
+  size_t produced = 0;
+  BrotliDecoderResult result;
+  for (;;) {
+    size_t avail_out = 0;
+    result = BrotliDecoderDecompressStream(decoder.get(), &avail_in, &next_in,
+                                           &avail_out, nullptr, nullptr);
+    // Take the output in bounded pieces, so that a stop is noticed early.
+    while (BrotliDecoderHasMoreOutput(decoder.get())) {
+      size_t out_size = 1 << 16;
+      const uint8_t* out_buf = BrotliDecoderTakeOutput(decoder.get(),
+                                                       &out_size);
+      size_t a = std::max(begin, produced);
+      size_t b = std::min(end, produced + out_size);
+      if (a < b) memcpy(out + (a - begin), out_buf + (a - produced), b - a);
+      produced += out_size;
+      if (!to_end && produced >= end) return true;
+    }
+    if (result != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) break;
+  }
+  if (result != BROTLI_DECODER_RESULT_SUCCESS) {
+    return FAILURE("brotli decompression failed");
+  }
+  if (produced < end) return FAILURE("brotli stream too short");
+  *pos = size - avail_in;
+  if (total) *total = produced;
+  return true;
+}
+
 template<typename T> T approxLog2(T v) {
   #if defined(__GNUC__) || defined(__clang__)
 		return (unsigned) (8*sizeof(unsigned long long) - __builtin_clzll(v) - 1);
@@ -237,12 +461,40 @@ size_t EstimateEntropy(const std::vector<size_t>& v) {
   if (sum == 0) return 0;
   
   size_t log2sum = approxLog2(sum);
+  // Empty bins add nothing, and approxLog2 is undefined for them.
   size_t sumOfLogs = std::accumulate(v.begin(), v.end(), 0, 
-        [log2sum] (size_t acc, size_t v) { return acc -  v * (approxLog2(v) - log2sum); });
+        [log2sum] (size_t acc, size_t v) {
+          return v ? acc - v * (approxLog2(v) - log2sum) : acc; });
   
   return 1024 * sumOfLogs / sum;
 }
 
+// Accumulates the pixel statistics of FrameStats while a frame is split into
+// its byte planes.
+struct StatsAccumulator {
+  explicit StatsAccumulator(uint16_t saturation) : saturation(saturation) {}
+
+  void Add(uint16_t value) {
+    min = std::min(min, value);
+    max = std::max(max, value);
+    sum += value;
+    saturated += value == saturation;
+  }
+
+  void Output(FrameStats* stats) const {
+    stats->min = max ? min : 0;
+    stats->max = max;
+    stats->sum = sum;
+    stats->saturated = saturated;
+  }
+
+  uint16_t saturation;
+  uint16_t min = 0xffff;
+  uint16_t max = 0;
+  uint64_t sum = 0;
+  uint32_t saturated = 0;
+};
+
 // clamped gradient predictor
 uint8_t ClampedGradient(uint8_t n, uint8_t w, uint8_t nw) {
   const uint8_t i = std::min(n, w), a = std::max(n, w);
@@ -251,16 +503,13 @@ uint8_t ClampedGradient(uint8_t n, uint8_t w, uint8_t nw) {
   return (nw > a) ? i : clamped;
 }
 
-uint32_t ReadUint32LE(const uint8_t* data) {
-  return (uint32_t)data[0] + ((uint32_t)data[1] << 8) +
-      ((uint32_t)data[2] << 16) + ((uint32_t)data[3] << 24);
+uint16_t ReadUint16LE(const uint8_t* data) {
+  return (uint16_t)data[0] + ((uint16_t)data[1] << 8);
 }
 
-void WriteUint32LE(uint32_t value, uint8_t* data) {
-  data[0] = value & 255;
-  data[1] = (value >> 8) & 255;
-  data[2] = (value >> 16) & 255;
-  data[3] = (value >> 24) & 255;
+void PushBackUint16LE(uint16_t value, std::vector<uint8_t> *out) {
+  out->push_back(value & 0xff);
+  out->push_back((value >> 8) & 0xff);
 }
 
 void PushBackUint32LE(uint32_t value, std::vector<uint8_t> *out) {
@@ -270,196 +519,975 @@ void PushBackUint32LE(uint32_t value, std::vector<uint8_t> *out) {
   out->push_back((value >> 24) & 0xff);
 }
 
-uint64_t ReadUint64LE(const uint8_t* data) {
-  return (uint64_t)data[0] + ((uint64_t)data[1] << 8) +
-      ((uint64_t)data[2] << 16) + ((uint64_t)data[3] << 24) +
-      ((uint64_t)data[4] << 32) + ((uint64_t)data[5] << 40) +
-      ((uint64_t)data[6] << 48) + ((uint64_t)data[7] << 56);
-}
-
-void WriteUint64LE(uint64_t value, uint8_t* data) {
-  data[0] = value & 255;
-  data[1] = (value >> 8) & 255;
-  data[2] = (value >> 16) & 255;
-  data[3] = (value >> 24) & 255;
-  data[4] = (value >> 32) & 255;
-  data[5] = (value >> 40) & 255;
-  data[6] = (value >> 48) & 255;
-  data[7] = (value >> 56) & 255;
-}
-
 // Returns whether pos + width > size, taking overflow into account.
 bool OutOfBounds(size_t pos, size_t width, size_t size) {
   return (pos > size) || (size - pos < width);
 }
 
-bool DecompressImage(const uint16_t* delta_frame,
-                     const uint8_t* in, size_t size,
-                     size_t xsize, size_t ysize, uint16_t* img) {
-  size_t pos = 0;
-  if (pos >= size) return FAILURE("out of bounds");
-
-  uint8_t flags = in[pos];
-  bool use_delta = flags & 1;
-  bool use_clamped_gradient = flags & 2;
-  bool zero_low = flags & 4;
-  (pos)++;
-  if (!xsize || !ysize) return FAILURE("invalid image dimensions");
-  size_t numpixels = xsize * ysize;
-  // Error: want to use inter-frame delta but delta_frame frame not supplied.
-  if (use_delta && !delta_frame) return FAILURE("delta frame not given");
+// Maximum size of a preview track chunk, larger tracks use multiple chunks.
+#define MAX_PREVIEW_TRACK_CHUNK (1u << 30)
 
-  std::vector<uint8_t> low;
-  if (zero_low) {
-    low.resize(numpixels, 0);
-  } else {
-    if (!BrotliDecompress(in, size, &pos, &low)) return FAILURE();
-  }
+// Size of an index checkpoint chunk without its list of frame offsets.
+#define CHECKPOINT_HEADER_SIZE 38
 
-  std::vector<uint8_t> high;
-  if (!BrotliDecompress(in, size, &pos, &high)) return FAILURE();
+// Footer section types
+#define FOOTER_FRAME_INDEX 1
+#define FOOTER_PREVIEW_TRACK 2
+#define FOOTER_FRAME_STATS 3
+#define FOOTER_TIMESTAMPS 4
 
-  // Error: sizes don't match image size
-  if (low.size() != numpixels) return FAILURE("wrong decompressed plane size");
-  if (high.size() != numpixels) return FAILURE("wrong decompressed plane size");
+// Size of a record of the frame statistics section written by this version.
+#define FRAME_STATS_RECORD_SIZE 22
 
-  if (use_clamped_gradient) {
-    for (size_t i = xsize + 1; i < numpixels; i++) {
-      uint8_t n = high[i - xsize];
-      uint8_t w = high[i - 1];
-      uint8_t nw = high[i - xsize - 1];
-      high[i] = high[i] + ClampedGradient(n, w, nw);
-    }
-  }
+// Frames per block of the frame index section.
+#define FRAME_INDEX_BLOCK_SIZE 64
 
-  if (use_delta) {
-    for (size_t i = 0; i < numpixels; i++) {
-      img[i] = ((high[i] + (delta_frame[i] >> 8)) << 8) 
-            | ((low[i] + (delta_frame[i] & 0xff)) & 0xff);
-    }
-  } else {
-    for (size_t i = 0; i < numpixels; i++) {
-      img[i] = (high[i] << 8) | low[i];
-    }
-  }
+// Frames per block of the timestamps section.
+#define TIMESTAMP_BLOCK_SIZE 64
 
-  return true;
+void PushBackUint64LE(uint64_t value, std::vector<uint8_t> *out) {
+  for (size_t i = 0; i < 8; i++) out->push_back((value >> (i * 8)) & 0xff);
 }
 
-}  // namespace
-
-////////////////////////////////////////////////////////////////////////////////
+void PushBackVarint(uint64_t value, std::vector<uint8_t> *out) {
+  while (value >= 128) {
+    out->push_back((value & 127) | 128);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
 
-Frame Frame::EMPTY(0, 0);
+// Reads a varint at *pos, which must be smaller than size.
+bool ReadVarint(const uint8_t* data, size_t size, size_t* pos,
+                uint64_t* value) {
+  *value = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (*pos >= size) return false;
+    uint8_t byte = data[(*pos)++];
+    *value |= (uint64_t)(byte & 127) << shift;
+    if (!(byte & 128)) return true;
+  }
+  return false;
+}
 
-size_t Frame::MaxCompressedPlaneSize(size_t xsize, size_t ysize) { 
-  return BrotliEncoderMaxCompressedSize(xsize * ysize); 
+// Maps signed values to unsigned ones with small magnitudes first, for varints.
+uint64_t ZigzagEncode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ (value < 0 ? ~0ull : 0ull);
 }
 
-size_t Frame::MaxCompressedPreviewSize(size_t xsize, size_t ysize) {
-   return BrotliEncoderMaxCompressedSize(xsize * ysize / 16); 
+int64_t ZigzagDecode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
 }
 
-// std::endian doc explicitly says that std::endian::native may be neither 
-// std::endian::little nor std::endian::big (on mixed endian systems).
-// Therefore this determines the endianess of uint16_t at initialization time
-static const uint16_t SYSTEM_UINT16_ENDIAN_TEST = 0x0100;
-static const bool SYSTEM_UINT16_BIG_ENDIAN = 
-      1 == reinterpret_cast<const uint8_t*>(&SYSTEM_UINT16_ENDIAN_TEST)[0];
+// Locations of the content parsed from the footer.
+struct Footer {
+  size_t num_frames = 0;
+  size_t offset = 0;  // Offset of the footer chunk in the file.
+  // Footer revision 1: list of 8-byte frame offsets.
+  const uint8_t* frame_offsets = nullptr;
+  // Footer revision 2: frame index section.
+  const uint8_t* frame_index = nullptr;
+  size_t frame_index_size = 0;
+  // Optional sections, nullptr if not present.
+  const uint8_t* preview_track = nullptr;
+  size_t preview_track_size = 0;
+  const uint8_t* frame_stats = nullptr;
+  size_t frame_stats_size = 0;
+  const uint8_t* timestamps = nullptr;
+  size_t timestamps_size = 0;
+};
+
+// Locates the footer at the end of the data and the sections in it, without
+// reading the section contents. Does not print failures since this is also
+// used to test whether a file is complete.
+bool ParseFooter(const uint8_t* data, size_t size, Footer* footer) {
+  if (size < 20) return false;
+  if (memcmp(data + size - 4, "FPV2", 4) != 0) {
+    // Revision 1 footer.
+    size_t n = ReadUint64LE(data + size - 8);
+    // Prevent num_frames overflow, the entire file needs at least 16 bytes per
+    // frame for its frame index listing and the frame's own header.
+    if (n > size / 16) return false;
+    size_t footer_size = 5 + 8 * n + 8;
+    if (footer_size > size) return false;
+    size_t pos = size - footer_size;
+    if (ReadUint32LE(data + pos) != footer_size) return false;
+    // Flag must be 2 to indicate frame index.
+    if (data[pos + 4] != CHUNK_FRAME_INDEX) return false;
+    footer->num_frames = n;
+    footer->offset = pos;
+    footer->frame_offsets = data + pos + 5;
+    return true;
+  }
 
-Frame::Frame(size_t xsize, size_t ysize, const uint16_t* image,
-             int shift_to_left_align, bool big_endian, int64_t timestamp) {
-  xsize_ = xsize;
-  ysize_ = ysize;
-  size_ = xsize_ * ysize_;
-  state_ = FrameState::EMPTY;
-  flags_ = FrameFlags::NONE;
-  timestamp_ = timestamp;
+  size_t n = ReadUint64LE(data + size - 20);
+  size_t footer_size = ReadUint64LE(data + size - 12);
+  if (footer_size > size || footer_size < 25) return false;
+  // Frames need at least their 9-byte chunk header.
+  if (n > size / 9) return false;
+  size_t pos = size - footer_size;
+  if (ReadUint32LE(data + pos) != footer_size) return false;
+  if (data[pos + 4] != CHUNK_FRAME_INDEX) return false;
+  footer->num_frames = n;
+  footer->offset = pos;
+
+  size_t end = size - 20;
+  pos += 5;
+  while (pos < end) {
+    if (OutOfBounds(pos, 9, end)) return false;
+    uint8_t type = data[pos];
+    size_t section_size = ReadUint64LE(data + pos + 1);
+    pos += 9;
+    if (OutOfBounds(pos, section_size, end)) return false;
+    if (type == FOOTER_FRAME_INDEX) {
+      footer->frame_index = data + pos;
+      footer->frame_index_size = section_size;
+    } else if (type == FOOTER_PREVIEW_TRACK) {
+      footer->preview_track = data + pos;
+      footer->preview_track_size = section_size;
+    } else if (type == FOOTER_FRAME_STATS) {
+      footer->frame_stats = data + pos;
+      footer->frame_stats_size = section_size;
+    } else if (type == FOOTER_TIMESTAMPS) {
+      footer->timestamps = data + pos;
+      footer->timestamps_size = section_size;
+    }
+    pos += section_size;
+  }
+  if (!footer->frame_index || footer->frame_index_size < 4) return false;
+  size_t block_size = ReadUint32LE(footer->frame_index);
+  if (block_size == 0) return false;
+  size_t num_blocks = (n + block_size - 1) / block_size;
+  if (num_blocks > (footer->frame_index_size - 4) / 12) return false;
+  return true;
+}
 
-  bool switch_endian = big_endian != SYSTEM_UINT16_BIG_ENDIAN;
-  
-  uint8_t non_zero_low = 0;
+// Appends the start of the footer, returns its position for EndFooter.
+size_t BeginFooter(std::vector<uint8_t>* out) {
+  size_t begin = out->size();
+  PushBackUint32LE(0, out);  // Footer size, filled in by EndFooter.
+  out->push_back(CHUNK_FRAME_INDEX);
+  return begin;
+}
 
-  if (image) {
-    state_ = FrameState::RAW;
-    high_.reserve(size_);
-    low_.reserve(size_);
+void AppendFooterSection(uint8_t type, const std::vector<uint8_t>& content,
+                         std::vector<uint8_t>* out) {
+  out->push_back(type);
+  PushBackUint64LE(content.size(), out);
+  out->insert(out->end(), content.begin(), content.end());
+}
 
-    if (switch_endian) {
-      if (shift_to_left_align == 0) {
+void AppendFrameStatsSection(const std::vector<FrameStats>& frame_stats,
+                             std::vector<uint8_t>* out) {
+  std::vector<uint8_t> content;
+  PushBackUint32LE(FRAME_STATS_RECORD_SIZE, &content);
+  for (const FrameStats& stats : frame_stats) {
+    PushBackUint16LE(stats.min, &content);
+    PushBackUint16LE(stats.max, &content);
+    PushBackUint64LE(stats.sum, &content);
+    PushBackUint32LE(stats.saturated, &content);
+    PushBackUint16LE(std::min<int>(lroundf(stats.entropy * 1024), 65535),
+                     &content);
+    PushBackUint32LE(stats.compressed_size, &content);
+  }
+  AppendFooterSection(FOOTER_FRAME_STATS, content, out);
+}
 
-        for (size_t i = 0; i < size_; ++i) {
-          uint16_t pixel = image[i];
-          high_.push_back(pixel & 0xff);
-          pixel = (pixel >> 8) & 0xff;
-          low_.push_back(pixel);
-          non_zero_low |= pixel;
-        }
+/* Appends the timestamps section. Within a block, the timestamps are coded as
+the differences between consecutive deltas, which are zero for frames at a
+constant rate, so that only jitter and dropped frames cost more than a byte. */
+void AppendTimestampsSection(const std::vector<int64_t>& timestamps,
+                             std::vector<uint8_t>* out) {
+  size_t num_blocks = (timestamps.size() + TIMESTAMP_BLOCK_SIZE - 1) /
+      TIMESTAMP_BLOCK_SIZE;
+  std::vector<uint8_t> content;
+  std::vector<uint8_t> deltas;
+  PushBackUint32LE(TIMESTAMP_BLOCK_SIZE, &content);
+  for (size_t b = 0; b < num_blocks; b++) {
+    size_t first = b * TIMESTAMP_BLOCK_SIZE;
+    size_t last = std::min(first + TIMESTAMP_BLOCK_SIZE, timestamps.size());
+    PushBackUint64LE(timestamps[first], &content);
+    PushBackUint32LE(deltas.size(), &content);
+    int64_t delta = 0;
+    for (size_t i = first + 1; i < last; i++) {
+      int64_t next = timestamps[i] - timestamps[i - 1];
+      PushBackVarint(ZigzagEncode(next - delta), &deltas);
+      delta = next;
+    }
+  }
+  content.insert(content.end(), deltas.begin(), deltas.end());
+  AppendFooterSection(FOOTER_TIMESTAMPS, content, out);
+}
 
-      } else if (shift_to_left_align == 8) {
+// Appends the frame index section listing the given frame offsets.
+void AppendFrameIndexSection(const std::vector<size_t>& frame_offsets,
+                             std::vector<uint8_t>* out) {
+  size_t num_blocks = (frame_offsets.size() + FRAME_INDEX_BLOCK_SIZE - 1) /
+      FRAME_INDEX_BLOCK_SIZE;
+  std::vector<uint8_t> content;
+  std::vector<uint8_t> sizes;
+  PushBackUint32LE(FRAME_INDEX_BLOCK_SIZE, &content);
+  for (size_t b = 0; b < num_blocks; b++) {
+    size_t first = b * FRAME_INDEX_BLOCK_SIZE;
+    size_t last = std::min(first + FRAME_INDEX_BLOCK_SIZE,
+                           frame_offsets.size());
+    PushBackUint64LE(frame_offsets[first], &content);
+    PushBackUint32LE(sizes.size(), &content);
+    for (size_t i = first + 1; i < last; i++) {
+      PushBackVarint(frame_offsets[i] - frame_offsets[i - 1], &sizes);
+    }
+  }
+  content.insert(content.end(), sizes.begin(), sizes.end());
+  AppendFooterSection(FOOTER_FRAME_INDEX, content, out);
+}
 
-        for (size_t i = 0; i < size_; ++i) {
-          high_.push_back((image[i] >> 8) & 0xff);
-        }
+void EndFooter(size_t begin, size_t num_frames, std::vector<uint8_t>* out) {
+  size_t footer_size = out->size() - begin + 20;
+  PushBackUint64LE(num_frames, out);
+  PushBackUint64LE(footer_size, out);
+  out->insert(out->end(), {'F', 'P', 'V', '2'});
+  WriteUint32LE(footer_size, out->data() + begin);
+}
 
-      } else {
+// Appends a footer with only a frame index listing the given frame offsets.
+void AppendFrameIndex(const std::vector<size_t>& frame_offsets,
+                      std::vector<uint8_t>* out) {
+  size_t begin = BeginFooter(out);
+  AppendFrameIndexSection(frame_offsets, out);
+  EndFooter(begin, frame_offsets.size(), out);
+}
 
-        int low_shift = 8 - shift_to_left_align;
-        int low_shift_high = 16 - shift_to_left_align;
-        for (size_t i = 0; i < size_; ++i) {
-          uint16_t pixel = image[i];
-          high_.push_back(((pixel << shift_to_left_align) | (pixel >> low_shift_high)) & 0xff);
-          pixel = (pixel >>  low_shift) & 0xff;
-          low_.push_back(pixel);
-          non_zero_low |= pixel;
-        }
+// Returns whether an intact index checkpoint chunk starts at pos.
+bool IsIndexCheckpoint(const uint8_t* data, size_t size, size_t pos) {
+  if (OutOfBounds(pos, CHECKPOINT_HEADER_SIZE, size)) return false;
+  const uint8_t* chunk = data + pos;
+  if (chunk[4] != CHUNK_AUXILIARY || chunk[5] != AUX_INDEX_CHECKPOINT) {
+    return false;
+  }
+  if (memcmp(chunk + 6, "fpvi", 4) != 0) return false;
+  if (ReadUint64LE(chunk + 10) != pos) return false;
+  if (ReadUint64LE(chunk + 18) >= pos) return false;
+  size_t chunk_size = ReadUint32LE(chunk);
+  size_t count = ReadUint32LE(chunk + 34);
+  if (chunk_size != CHECKPOINT_HEADER_SIZE + 8 * count) return false;
+  return !OutOfBounds(pos, chunk_size, size);
+}
 
-      }
-    // data endianess == system endianess
-    } else if (shift_to_left_align == 0) {
+// Options of DecompressImage.
+enum DecompressOptions {
+  // Only output the 8 most significant bits of the pixels, the least
+  // significant bits are set to 0.
+  DECOMPRESS_MSB_ONLY = 1,
+  // Decompress the low and high bytes concurrently, if the image has their
+  // sizes.
+  DECOMPRESS_PARALLEL_PLANES = 2,
+};
+
+// Parses the image flags and, if present, the size of the low bytes stream.
+// Outputs the position of the low bytes stream in *pos.
+bool ParseImageHeader(const uint8_t* in, size_t size, uint8_t* flags,
+                      size_t* pos, size_t* low_size) {
+  if (size < 1) return FAILURE("out of bounds");
+  *flags = in[0];
+  *pos = 1;
+  *low_size = 0;
+  if (*flags & FrameFlags::PLANE_SIZES) {
+    if (size < 5) return FAILURE("out of bounds");
+    *low_size = ReadUint32LE(in + 1);
+    *pos = 5;
+    if (*low_size > size - *pos) return FAILURE("low bytes size too large");
+  }
+  return true;
+}
 
-      for (size_t i = 0; i < size_; ++i) {
-        uint16_t pixel = image[i];
-        high_.push_back((pixel >> 8) & 0xff);
-        pixel &= 0xff;
-        low_.push_back(pixel);
-        non_zero_low |= pixel;
+// Writes the pixels reconstructed from the byte planes to the target, row by
+// row, converting each pixel with convert(value, row, x). Low is not used if
+// msb_only is set, delta_frame may be nullptr if the image has no delta.
+template <typename Convert>
+void StorePixels(const uint8_t* high, const uint8_t* low,
+                 const uint16_t* delta_frame, bool msb_only,
+                 size_t xsize, size_t ysize, const DecodeTarget& target,
+                 Convert convert) {
+  size_t pitch = target.RowPitch(xsize);
+  for (size_t y = 0; y < ysize; y++) {
+    const uint8_t* h = high + y * xsize;
+    const uint8_t* l = low + y * xsize;
+    const uint16_t* d = delta_frame ? delta_frame + y * xsize : nullptr;
+    uint8_t* row = static_cast<uint8_t*>(target.data) + y * pitch;
+    if (msb_only) {
+      // The low bytes do not carry into the high bytes.
+      for (size_t x = 0; x < xsize; x++) {
+        uint8_t msb = d ? h[x] + (d[x] >> 8) : h[x];
+        convert(static_cast<uint16_t>(msb << 8), row, x);
       }
-
-    } else if (shift_to_left_align == 8) {
-
-      for (size_t i = 0; i < size_; ++i) {
-        high_.push_back(image[i] & 0xff);
+    } else if (d) {
+      for (size_t x = 0; x < xsize; x++) {
+        convert(static_cast<uint16_t>(((h[x] + (d[x] >> 8)) << 8)
+                                      | ((l[x] + (d[x] & 0xff)) & 0xff)),
+                row, x);
       }
-
     } else {
-
-      for (size_t i = 0; i < size_; ++i) {
-        uint16_t pixel = image[i] << shift_to_left_align;
-        high_.push_back((pixel >> 8) & 0xff);
-        pixel &= 0xff;
-        low_.push_back(pixel);
-        non_zero_low |= pixel;
+      for (size_t x = 0; x < xsize; x++) {
+        convert(static_cast<uint16_t>((h[x] << 8) | l[x]), row, x);
       }
-
-    }
-    
-    if (!non_zero_low) {
-      flags_ |= FrameFlags::NO_LOW_BYTES;
     }
   }
 }
 
-Frame::Frame(size_t xsize, size_t ysize, const uint8_t* image, int64_t timestamp) {
-  xsize_ = xsize;
-  ysize_ = ysize;
-  size_ = xsize_ * ysize_;
-  state_ = FrameState::EMPTY;
-  flags_ = FrameFlags::NO_LOW_BYTES;
-  timestamp_ = timestamp;
-
-  if (image) {
-    state_ = FrameState::RAW;
+// Dispatches StorePixels on the pixel format of the target, so that the
+// conversion gets inlined in the reconstruction loop.
+void StorePixels(const uint8_t* high, const uint8_t* low,
+                 const uint16_t* delta_frame, bool msb_only,
+                 size_t xsize, size_t ysize, const DecodeTarget& target) {
+  int shift = target.shift;
+  switch (target.type) {
+    case DecodeTarget::UINT8:
+      StorePixels(high, low, delta_frame, msb_only, xsize, ysize, target,
+                  [shift](uint16_t v, uint8_t* row, size_t x) {
+                    row[x] = std::min<uint16_t>(v >> shift, 255);
+                  });
+      break;
+    case DecodeTarget::UINT16:
+      if (target.big_endian) {
+        StorePixels(high, low, delta_frame, msb_only, xsize, ysize, target,
+                    [shift](uint16_t v, uint8_t* row, size_t x) {
+                      v >>= shift;
+                      row[x * 2 + 0] = v >> 8;
+                      row[x * 2 + 1] = v & 255;
+                    });
+      } else if (shift == 0) {
+        StorePixels(high, low, delta_frame, msb_only, xsize, ysize, target,
+                    [](uint16_t v, uint8_t* row, size_t x) {
+                      reinterpret_cast<uint16_t*>(row)[x] = v;
+                    });
+      } else {
+        StorePixels(high, low, delta_frame, msb_only, xsize, ysize, target,
+                    [shift](uint16_t v, uint8_t* row, size_t x) {
+                      reinterpret_cast<uint16_t*>(row)[x] = v >> shift;
+                    });
+      }
+      break;
+    case DecodeTarget::FLOAT32:
+      StorePixels(high, low, delta_frame, msb_only, xsize, ysize, target,
+                  [shift](uint16_t v, uint8_t* row, size_t x) {
+                    reinterpret_cast<float*>(row)[x] = v >> shift;
+                  });
+      break;
+  }
+}
+
+// Target for packed uint16_t frames in native byte order.
+DecodeTarget Uint16Target(uint16_t* frame) {
+  DecodeTarget target;
+  target.data = frame;
+  return target;
+}
+
+// Reconstructs the pixels from the decompressed byte planes in the scratch and
+// writes them to the target. The low bytes are not used if msb_only is set.
+bool ReconstructImage(const uint16_t* delta_frame, bool use_clamped_gradient,
+                      bool msb_only, size_t xsize, size_t ysize,
+                      DecodeScratch& scratch, const DecodeTarget& target) {
+  size_t numpixels = xsize * ysize;
+  std::vector<uint8_t>& low = scratch.low;
+  std::vector<uint8_t>& high = scratch.high;
+  // Error: sizes don't match image size
+  if (!msb_only && low.size() != numpixels) {
+    return FAILURE("wrong decompressed plane size");
+  }
+  if (high.size() != numpixels) return FAILURE("wrong decompressed plane size");
+
+  if (use_clamped_gradient) {
+    for (size_t i = xsize + 1; i < numpixels; i++) {
+      uint8_t n = high[i - xsize];
+      uint8_t w = high[i - 1];
+      uint8_t nw = high[i - xsize - 1];
+      high[i] = high[i] + ClampedGradient(n, w, nw);
+    }
+  }
+
+  StorePixels(high.data(), low.data(), delta_frame, msb_only, xsize, ysize,
+              target);
+  return true;
+}
+
+// Decompresses an image into the target, converting the pixels while they are
+// reconstructed. The scratch is optional, it avoids allocating the planes for
+// every image. The options are a combination of DecompressOptions.
+bool DecompressImage(const uint16_t* delta_frame,
+                     const uint8_t* in, size_t size,
+                     size_t xsize, size_t ysize, const DecodeTarget& target,
+                     DecodeScratch* scratch = nullptr, int options = 0) {
+  size_t pos;
+  uint8_t flags;
+  size_t low_size;
+  if (!ParseImageHeader(in, size, &flags, &pos, &low_size)) return FAILURE();
+  bool use_delta = flags & 1;
+  bool use_clamped_gradient = flags & 2;
+  bool zero_low = flags & 4;
+  bool plane_sizes = flags & 8;
+  bool msb_only = options & DECOMPRESS_MSB_ONLY;
+  if (!xsize || !ysize) return FAILURE("invalid image dimensions");
+  size_t numpixels = xsize * ysize;
+  // Error: want to use inter-frame delta but delta_frame frame not supplied.
+  if (use_delta && !delta_frame) return FAILURE("delta frame not given");
+
+  DecodeScratch local_scratch;
+  if (!scratch) scratch = &local_scratch;
+
+  std::vector<uint8_t>& low = scratch->low;
+  std::vector<uint8_t>& high = scratch->high;
+  low.clear();
+  high.clear();
+  if (zero_low || (plane_sizes && msb_only)) {
+    // With the plane sizes, the high bytes can be located without the low.
+    if (!zero_low) pos += low_size;
+    if (!msb_only) low.resize(numpixels, 0);
+    if (!BrotliDecompress(in, size, &pos, &high)) return FAILURE();
+  } else if (plane_sizes && (options & DECOMPRESS_PARALLEL_PLANES)) {
+    size_t low_pos = pos;
+    size_t low_end = pos + low_size;
+    bool low_ok = false;
+    std::thread low_thread([&]() {
+      low_ok = BrotliDecompress(in, low_end, &low_pos, &low) &&
+          low_pos == low_end;
+    });
+    pos = low_end;
+    bool high_ok = BrotliDecompress(in, size, &pos, &high);
+    low_thread.join();
+    if (!low_ok || !high_ok) return FAILURE();
+  } else {
+    if (!BrotliDecompress(in, size, &pos, &low)) return FAILURE();
+    if (plane_sizes && pos != 1 + 4 + low_size) {
+      return FAILURE("wrong low bytes size");
+    }
+    if (!BrotliDecompress(in, size, &pos, &high)) return FAILURE();
+  }
+
+  return ReconstructImage(use_delta ? delta_frame : nullptr,
+                          use_clamped_gradient, msb_only, xsize, ysize,
+                          *scratch, target);
+}
+
+bool DecompressImage(const uint16_t* delta_frame,
+                     const uint8_t* in, size_t size,
+                     size_t xsize, size_t ysize, uint16_t* img,
+                     DecodeScratch* scratch = nullptr, int options = 0) {
+  return DecompressImage(delta_frame, in, size, xsize, ysize,
+                         Uint16Target(img), scratch, options);
+}
+
+// Reads a brotli stream incrementally, for decoding without holding the full
+// decompressed stream in memory.
+class BrotliStreamReader {
+ public:
+  BrotliStreamReader(const uint8_t* in, size_t size)
+      : decoder_(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr),
+                 &BrotliDecoderDestroyInstance),
+        next_in_(in), avail_in_(size) {}
+
+  // Outputs the next n decompressed bytes.
+  bool Read(size_t n, uint8_t* out) {
+    if (!decoder_) return FAILURE("couldn't init brotli decoder");
+    while (n > 0) {
+      if (BrotliDecoderHasMoreOutput(decoder_.get())) {
+        size_t out_size = n;
+        const uint8_t* out_buf = BrotliDecoderTakeOutput(decoder_.get(),
+                                                         &out_size);
+        memcpy(out, out_buf, out_size);
+        out += out_size;
+        n -= out_size;
+        continue;
+      }
+      if (BrotliDecoderIsFinished(decoder_.get())) {
+        return FAILURE("brotli stream too short");
+      }
+      size_t avail_out = 0;
+      BrotliDecoderResult result = BrotliDecoderDecompressStream(
+          decoder_.get(), &avail_in_, &next_in_, &avail_out, nullptr, nullptr);
+      if (result == BROTLI_DECODER_RESULT_ERROR ||
+          (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT &&
+           !BrotliDecoderHasMoreOutput(decoder_.get()))) {
+        return FAILURE("brotli decompression failed");
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::unique_ptr<BrotliDecoderState, std::function<void(BrotliDecoderState*)>>
+      decoder_;
+  const uint8_t* next_in_;
+  size_t avail_in_;
+};
+
+// Decodes an image in strips of strip_rows rows, passed to the callback. Only
+// the strip and the two rows above it are kept of each byte plane, which is
+// all that clamped gradient prediction needs.
+bool DecompressImageStrips(const uint16_t* delta_frame,
+                           const uint8_t* in, size_t size,
+                           size_t xsize, size_t ysize, size_t strip_rows,
+                           const StripCallback& callback,
+                           DecodeScratch* scratch = nullptr) {
+  size_t pos;
+  uint8_t flags;
+  size_t low_size;
+  if (!ParseImageHeader(in, size, &flags, &pos, &low_size)) return FAILURE();
+  if (!xsize || !ysize) return FAILURE("invalid image dimensions");
+  bool use_delta = flags & 1;
+  bool use_clamped_gradient = flags & 2;
+  bool zero_low = flags & 4;
+  bool plane_sizes = flags & 8;
+  if (use_delta && !delta_frame) return FAILURE("delta frame not given");
+  strip_rows = std::max<size_t>(1, std::min(strip_rows, ysize));
+
+  // Both planes are read at the same time, so the start of the high bytes is
+  // needed. Without the plane sizes, it is found by decompressing the low
+  // bytes once without keeping them.
+  size_t high_pos = pos;
+  if (plane_sizes) {
+    high_pos += low_size;
+  } else if (!zero_low) {
+    size_t total;
+    if (!BrotliDecompressRange(in, size, &high_pos, 0, 0, true, nullptr,
+                               &total)) {
+      return FAILURE();
+    }
+    if (total != xsize * ysize) return FAILURE("wrong decompressed plane size");
+  }
+  BrotliStreamReader low_reader(in + pos, high_pos - pos);
+  BrotliStreamReader high_reader(in + high_pos, size - high_pos);
+
+  DecodeScratch local_scratch;
+  if (!scratch) scratch = &local_scratch;
+  std::vector<uint8_t>& low = scratch->low;
+  std::vector<uint8_t>& high = scratch->high;
+  std::vector<uint16_t>& strip = scratch->strip;
+  low.assign(strip_rows * xsize, 0);
+  // The high bytes of the two rows above the strip come first.
+  high.assign((strip_rows + 2) * xsize, 0);
+  strip.resize(strip_rows * xsize);
+
+  for (size_t y0 = 0; y0 < ysize; y0 += strip_rows) {
+    size_t rows = std::min(strip_rows, ysize - y0);
+    size_t n = rows * xsize;
+    if (!zero_low && !low_reader.Read(n, low.data())) return FAILURE();
+    if (!high_reader.Read(n, high.data() + 2 * xsize)) return FAILURE();
+
+    // Buffer position of a pixel index of the full image.
+    const ptrdiff_t base = (static_cast<ptrdiff_t>(y0) - 2) * xsize;
+    uint8_t* h = high.data() - base;
+    if (use_clamped_gradient) {
+      for (size_t i = std::max(y0 * xsize, xsize + 1); i < y0 * xsize + n;
+           i++) {
+        uint8_t n = h[i - xsize];
+        uint8_t w = h[i - 1];
+        uint8_t nw = h[i - xsize - 1];
+        h[i] = h[i] + ClampedGradient(n, w, nw);
+      }
+    }
+
+    const uint8_t* hs = high.data() + 2 * xsize;
+    if (use_delta) {
+      const uint16_t* d = delta_frame + y0 * xsize;
+      for (size_t i = 0; i < n; i++) {
+        strip[i] = ((hs[i] + (d[i] >> 8)) << 8)
+            | ((low[i] + (d[i] & 0xff)) & 0xff);
+      }
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        strip[i] = (hs[i] << 8) | low[i];
+      }
+    }
+    if (!callback(y0, rows, strip.data())) return true;
+
+    // Keep the last two rows for the prediction of the next strip.
+    memmove(high.data(), high.data() + n, 2 * xsize);
+  }
+  return true;
+}
+
+// Decodes only the rows [y0, y1) of an image, to rows which must have room for
+// (y1 - y0) * xsize pixels. The decompression of the high bytes, which come
+// last, stops after row y1. Clamped gradient prediction needs all rows above,
+// without it only the rows themselves are kept. An empty range decodes
+// nothing.
+bool DecompressImageRows(const uint16_t* delta_frame,
+                         const uint8_t* in, size_t size,
+                         size_t xsize, size_t ysize, size_t y0, size_t y1,
+                         uint16_t* rows, DecodeScratch* scratch = nullptr) {
+  size_t pos;
+  uint8_t flags;
+  size_t low_size;
+  if (!ParseImageHeader(in, size, &flags, &pos, &low_size)) return FAILURE();
+  if (!xsize || !ysize) return FAILURE("invalid image dimensions");
+  if (y0 > y1 || y1 > ysize) return FAILURE("invalid rows");
+  if (y0 == y1) return true;
+
+  bool use_delta = flags & 1;
+  bool use_clamped_gradient = flags & 2;
+  bool zero_low = flags & 4;
+  bool plane_sizes = flags & 8;
+  size_t numpixels = xsize * ysize;
+  if (use_delta && !delta_frame) return FAILURE("delta frame not given");
+
+  DecodeScratch local_scratch;
+  if (!scratch) scratch = &local_scratch;
+
+  size_t begin = y0 * xsize;
+  size_t end = y1 * xsize;
+
+  std::vector<uint8_t>& low = scratch->low;
+  low.assign(end - begin, 0);
+  if (!zero_low && plane_sizes) {
+    // The high bytes start after the given size, so the low bytes can stop
+    // after the last needed row too.
+    size_t low_pos = pos;
+    if (!BrotliDecompressRange(in, pos + low_size, &low_pos, begin, end, false,
+                               low.data(), nullptr)) {
+      return FAILURE();
+    }
+    pos += low_size;
+  } else if (!zero_low) {
+    // The low bytes must be decompressed to their end to find where the high
+    // bytes start, but only the needed rows are kept.
+    size_t total;
+    if (!BrotliDecompressRange(in, size, &pos, begin, end, true, low.data(),
+                               &total)) {
+      return FAILURE();
+    }
+    if (total != numpixels) return FAILURE("wrong decompressed plane size");
+  }
+
+  size_t high_begin = use_clamped_gradient ? 0 : begin;
+  std::vector<uint8_t>& high = scratch->high;
+  high.resize(end - high_begin);
+  if (!BrotliDecompressRange(in, size, &pos, high_begin, end, false,
+                             high.data(), nullptr)) {
+    return FAILURE();
+  }
+
+  if (use_clamped_gradient) {
+    for (size_t i = xsize + 1; i < end; i++) {
+      uint8_t n = high[i - xsize];
+      uint8_t w = high[i - 1];
+      uint8_t nw = high[i - xsize - 1];
+      high[i] = high[i] + ClampedGradient(n, w, nw);
+    }
+  }
+
+  const uint8_t* h = high.data() + (begin - high_begin);
+  for (size_t i = 0; i < end - begin; i++) {
+    if (use_delta) {
+      uint16_t d = delta_frame[begin + i];
+      rows[i] = ((h[i] + (d >> 8)) << 8) | ((low[i] + (d & 0xff)) & 0xff);
+    } else {
+      rows[i] = (h[i] << 8) | low[i];
+    }
+  }
+
+  return true;
+}
+
+// Decodes the main image of a frame chunk. The chunk starts with the chunk
+// header, size is the amount of bytes available which may exceed the chunk.
+bool DecompressFrameChunk(const uint16_t* delta_frame, const uint8_t* chunk,
+                          size_t size, size_t xsize, size_t ysize,
+                          const DecodeTarget& target,
+                          DecodeScratch* scratch = nullptr, int options = 0) {
+  if (size < 9) return FAILURE("frame too small");
+  size_t frame_size = ReadUint32LE(chunk);
+  if (frame_size < 9) return FAILURE("frame too small");
+  if (frame_size > size) return FAILURE("out of bounds");
+  uint8_t flag = chunk[4];
+  if (flag != CHUNK_FRAME) return FAILURE("not a standard frame");
+  size_t preview_size = ReadUint32LE(chunk + 5);
+  if (preview_size > frame_size - 9) return FAILURE("preview too large");
+  size_t main_size = frame_size - preview_size - 9;
+  return DecompressImage(delta_frame, chunk + 9 + preview_size, main_size,
+                         xsize, ysize, target, scratch, options);
+}
+
+bool DecompressFrameChunk(const uint16_t* delta_frame, const uint8_t* chunk,
+                          size_t size, size_t xsize, size_t ysize,
+                          uint16_t* frame, DecodeScratch* scratch = nullptr,
+                          int options = 0) {
+  return DecompressFrameChunk(delta_frame, chunk, size, xsize, ysize,
+                              Uint16Target(frame), scratch, options);
+}
+
+// Decodes an 8-bit preview image from its image format bytes.
+bool DecompressPreview(const uint8_t* in, size_t size, size_t xsize,
+                       size_t ysize, uint8_t* preview,
+                       DecodeContext* context = nullptr) {
+  DecodeTarget target;
+  target.type = DecodeTarget::UINT8;
+  target.data = preview;
+  target.shift = 8;
+  if (!DecompressImage(nullptr, in, size, xsize, ysize, target,
+                       context ? &context->scratch : nullptr)) {
+    return FAILURE("failed to decompress preview");
+  }
+  return true;
+}
+
+// Locates the image of a level of the preview pyramid in the preview image
+// bytes of a frame, see the preview pyramid format.
+bool LocatePreviewLevel(const uint8_t* in, size_t size, int level,
+                        const uint8_t** image, size_t* image_size) {
+  if (level == 1) {
+    *image = in;
+    *image_size = size;
+    return true;
+  }
+  if (level < 0 || level >= NUM_PREVIEW_LEVELS) {
+    return FAILURE("invalid preview level");
+  }
+  if (size < 2 || !(in[0] & FrameFlags::PREVIEW_PYRAMID)) {
+    return FAILURE("no preview pyramid");
+  }
+  uint8_t mask = in[size - 1];
+  if (!(mask & (1 << level))) return FAILURE("preview level not stored");
+  size_t num_stored = 0;
+  size_t before = 0;  // Stored levels before the requested one.
+  for (int k = 0; k < NUM_PREVIEW_LEVELS; k++) {
+    if (k == 1 || !(mask & (1 << k))) continue;
+    if (k < level) before++;
+    num_stored++;
+  }
+  size_t table = 4 * num_stored + 1;
+  if (table > size) return FAILURE("preview pyramid too large");
+  const uint8_t* sizes = in + size - table;
+  // The level images end where the sizes table starts.
+  size_t end = size - table;
+  for (size_t k = num_stored; k-- > before;) {
+    size_t level_size = ReadUint32LE(sizes + 4 * k);
+    if (level_size > end) return FAILURE("preview pyramid too large");
+    end -= level_size;
+    if (k == before) {
+      *image = in + end;
+      *image_size = level_size;
+    }
+  }
+  return true;
+}
+
+// Decodes the 8-bit preview image of a frame chunk, given the dimensions of
+// the preview.
+bool DecompressPreviewChunk(const uint8_t* chunk, size_t size,
+                            size_t xsize, size_t ysize, uint8_t* preview,
+                            DecodeContext* context = nullptr) {
+  if (size < 9) return FAILURE("frame too small");
+  size_t frame_size = ReadUint32LE(chunk);
+  if (frame_size < 9) return FAILURE("frame too small");
+  if (frame_size > size) return FAILURE("out of bounds");
+  uint8_t flag = chunk[4];
+  if (flag != CHUNK_FRAME) return FAILURE("not a standard frame");
+  size_t preview_size = ReadUint32LE(chunk + 5);
+  if (OutOfBounds(9, preview_size, frame_size)) {
+    return FAILURE("preview too large");
+  }
+  return DecompressPreview(chunk + 9, preview_size, xsize, ysize, preview,
+                           context);
+}
+
+}  // namespace
+
+bool DecompressPlanes(const uint16_t* delta_frame, uint8_t flags,
+                      const uint8_t* high, size_t high_size,
+                      const uint8_t* low, size_t low_size,
+                      size_t xsize, size_t ysize, bool msb_only,
+                      const DecodeTarget& target, DecodeScratch* scratch) {
+  bool use_delta = flags & FrameFlags::USE_DELTA;
+  bool zero_low = (flags & FrameFlags::NO_LOW_BYTES) || low_size == 0;
+  if (!xsize || !ysize) return FAILURE("invalid image dimensions");
+  size_t numpixels = xsize * ysize;
+  if (use_delta && !delta_frame) return FAILURE("delta frame not given");
+
+  DecodeScratch local_scratch;
+  if (!scratch) scratch = &local_scratch;
+  scratch->low.clear();
+  scratch->high.clear();
+  size_t pos = 0;
+  if (!BrotliDecompress(high, high_size, &pos, &scratch->high)) {
+    return FAILURE();
+  }
+  if (msb_only) {
+    // Frame compresses a preview plane of a 16th of the frame size, which is
+    // more than the preview if the frame size isn't a multiple of 4.
+    if (scratch->high.size() > numpixels) scratch->high.resize(numpixels);
+  } else if (!zero_low) {
+    pos = 0;
+    if (!BrotliDecompress(low, low_size, &pos, &scratch->low)) {
+      return FAILURE();
+    }
+  } else if (use_delta) {
+    // Frame leaves the low bytes of such frames zero rather than adding the
+    // delta frame to them, which StorePixels does, so cancel that out.
+    scratch->low.resize(numpixels);
+    for (size_t i = 0; i < numpixels; i++) {
+      scratch->low[i] = -(delta_frame[i] & 255);
+    }
+  } else {
+    scratch->low.resize(numpixels, 0);
+  }
+  return ReconstructImage(use_delta ? delta_frame : nullptr,
+                          flags & FrameFlags::USE_CG, msb_only, xsize, ysize,
+                          *scratch, target);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Frame Frame::EMPTY(0, 0);
+
+size_t Frame::MaxCompressedPlaneSize(size_t xsize, size_t ysize) { 
+  return BrotliEncoderMaxCompressedSize(xsize * ysize); 
+}
+
+size_t Frame::MaxCompressedPreviewSize(size_t xsize, size_t ysize) {
+   return BrotliEncoderMaxCompressedSize(xsize * ysize / 16); 
+}
+
+// std::endian doc explicitly says that std::endian::native may be neither 
+// std::endian::little nor std::endian::big (on mixed endian systems).
+// Therefore this determines the endianess of uint16_t at initialization time
+static const uint16_t SYSTEM_UINT16_ENDIAN_TEST = 0x0100;
+static const bool SYSTEM_UINT16_BIG_ENDIAN = 
+      1 == reinterpret_cast<const uint8_t*>(&SYSTEM_UINT16_ENDIAN_TEST)[0];
+
+// Returns the CRC-32C of pixels as little endian 16-bit values.
+static uint32_t PixelsCrc32c(uint32_t crc, const uint16_t* pixels, size_t n) {
+  if (!SYSTEM_UINT16_BIG_ENDIAN) {
+    return Crc32c(crc, reinterpret_cast<const uint8_t*>(pixels), n * 2);
+  }
+  uint8_t buffer[512];
+  for (size_t i = 0; i < n; i += 256) {
+    size_t count = std::min<size_t>(256, n - i);
+    for (size_t j = 0; j < count; j++) {
+      buffer[j * 2] = pixels[i + j] & 255;
+      buffer[j * 2 + 1] = pixels[i + j] >> 8;
+    }
+    crc = Crc32c(crc, buffer, count * 2);
+  }
+  return crc;
+}
+
+Frame::Frame(size_t xsize, size_t ysize, const uint16_t* image,
+             int shift_to_left_align, bool big_endian, int64_t timestamp) {
+  xsize_ = xsize;
+  ysize_ = ysize;
+  size_ = xsize_ * ysize_;
+  state_ = FrameState::EMPTY;
+  flags_ = FrameFlags::NONE;
+  timestamp_ = timestamp;
+
+  bool switch_endian = big_endian != SYSTEM_UINT16_BIG_ENDIAN;
+  
+  uint8_t non_zero_low = 0;
+  // The statistics are of the left aligned values that decoders output, where
+  // saturated pixels have all bits of the data set.
+  StatsAccumulator stats((0xffff << shift_to_left_align) & 0xffff);
+
+  if (image) {
+    state_ = FrameState::RAW;
+    high_.reserve(size_);
+    low_.reserve(size_);
+
+    if (switch_endian) {
+      if (shift_to_left_align == 0) {
+
+        for (size_t i = 0; i < size_; ++i) {
+          uint16_t pixel = image[i];
+          high_.push_back(pixel & 0xff);
+          stats.Add((pixel << 8) | (pixel >> 8));
+          pixel = (pixel >> 8) & 0xff;
+          low_.push_back(pixel);
+          non_zero_low |= pixel;
+        }
+
+      } else if (shift_to_left_align == 8) {
+
+        for (size_t i = 0; i < size_; ++i) {
+          high_.push_back((image[i] >> 8) & 0xff);
+          stats.Add(image[i] & 0xff00);
+        }
+
+      } else {
+
+        int low_shift = 8 - shift_to_left_align;
+        int low_shift_high = 16 - shift_to_left_align;
+        for (size_t i = 0; i < size_; ++i) {
+          uint16_t pixel = image[i];
+          high_.push_back(((pixel << shift_to_left_align) | (pixel >> low_shift_high)) & 0xff);
+          pixel = (pixel >>  low_shift) & 0xff;
+          low_.push_back(pixel);
+          stats.Add((high_.back() << 8) | pixel);
+          non_zero_low |= pixel;
+        }
+
+      }
+    // data endianess == system endianess
+    } else if (shift_to_left_align == 0) {
+
+      for (size_t i = 0; i < size_; ++i) {
+        uint16_t pixel = image[i];
+        stats.Add(pixel);
+        high_.push_back((pixel >> 8) & 0xff);
+        pixel &= 0xff;
+        low_.push_back(pixel);
+        non_zero_low |= pixel;
+      }
+
+    } else if (shift_to_left_align == 8) {
+
+      for (size_t i = 0; i < size_; ++i) {
+        high_.push_back(image[i] & 0xff);
+        stats.Add(image[i] << 8);
+      }
+
+    } else {
+
+      for (size_t i = 0; i < size_; ++i) {
+        uint16_t pixel = image[i] << shift_to_left_align;
+        stats.Add(pixel);
+        high_.push_back((pixel >> 8) & 0xff);
+        pixel &= 0xff;
+        low_.push_back(pixel);
+        non_zero_low |= pixel;
+      }
+
+    }
+    
+    if (!non_zero_low) {
+      flags_ |= FrameFlags::NO_LOW_BYTES;
+    }
+    stats.Output(&stats_);
+  }
+}
+
+uint32_t Frame::PixelChecksum() const {
+  uint16_t row[256];
+  uint32_t crc = 0;
+  for (size_t i = 0; i < size_; i += 256) {
+    size_t count = std::min<size_t>(256, size_ - i);
+    for (size_t j = 0; j < count; j++) {
+      row[j] = (high_[i + j] << 8) | (low_.empty() ? 0 : low_[i + j]);
+    }
+    crc = PixelsCrc32c(crc, row, count);
+  }
+  return crc;
+}
+
+Frame::Frame(size_t xsize, size_t ysize, const uint8_t* image, int64_t timestamp) {
+  xsize_ = xsize;
+  ysize_ = ysize;
+  size_ = xsize_ * ysize_;
+  state_ = FrameState::EMPTY;
+  flags_ = FrameFlags::NO_LOW_BYTES;
+  timestamp_ = timestamp;
+
+  if (image) {
+    state_ = FrameState::RAW;
     high_.assign(image, image+size_);
   }
 }
@@ -492,22 +1520,44 @@ void Frame::GeneratePreview() {
   if (state_ & FrameState::PREVIEW_GENERATED)
     return;
 
-  size_t preview_xsize = xsize_ / 4;
-  size_t preview_ysize = ysize_ / 4;
-
-  preview_.reserve(preview_ysize * preview_xsize);
+  // Each level sums 2x2 blocks of the sums of the level before, so the full
+  // frame is only read once for all levels. The sums of 4^(k + 1) high bytes
+  // of level k fit in 16 bits for all levels.
+  size_t level_xsize = xsize_ / 2;
+  size_t level_ysize = ysize_ / 2;
+  std::vector<uint16_t> sums(level_xsize * level_ysize);
+  for (size_t y = 0; y < level_ysize; y++) {
+    const uint8_t* row0 = high_.data() + 2 * y * xsize_;
+    const uint8_t* row1 = row0 + xsize_;
+    uint16_t* out = sums.data() + y * level_xsize;
+    for (size_t x = 0; x < level_xsize; x++) {
+      out[x] = row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1];
+    }
+  }
 
-  for (size_t py = 0; py < preview_ysize; py++) {
-    for (size_t px = 0; px < preview_xsize; px++) {
-      uint32_t sum = 0;
-      size_t pos = (py * xsize_ + px ) * 4;
-      for (size_t j = 0; j < 4; j++) {
-        for (size_t i = 0; i < 4; i++) {
-          sum += high_[pos++];
+  int num_levels = preview_pyramid_ ? NUM_PREVIEW_LEVELS : 2;
+  for (int level = 0; level < num_levels; level++) {
+    if (level > 0) {
+      size_t prev_xsize = level_xsize;
+      level_xsize /= 2;
+      level_ysize /= 2;
+      for (size_t y = 0; y < level_ysize; y++) {
+        const uint16_t* row0 = sums.data() + 2 * y * prev_xsize;
+        const uint16_t* row1 = row0 + prev_xsize;
+        uint16_t* out = sums.data() + y * level_xsize;
+        for (size_t x = 0; x < level_xsize; x++) {
+          out[x] = row0[2 * x] + row0[2 * x + 1] + row1[2 * x] +
+              row1[2 * x + 1];
         }
-        pos += xsize_ - 4;
       }
-      preview_.push_back((sum / 16) & 0xfe);
+    }
+    if (level != 1 && !preview_pyramid_) continue;
+    std::vector<uint8_t>& preview =
+        level == 1 ? preview_ : pyramid_[level == 0 ? 0 : level - 1];
+    int shift = 2 * (level + 1);
+    preview.resize(level_xsize * level_ysize);
+    for (size_t i = 0; i < preview.size(); i++) {
+      preview[i] = (sums[i] >> shift) & 0xfe;
     }
   }
 
@@ -561,7 +1611,13 @@ void Frame::OptionallyApplyClampedGradientPrediction() {
     countb[b]++;
   }
 
-  if (EstimateEntropy(countb) < EstimateEntropy(counta)) {
+  size_t entropy_a = EstimateEntropy(counta);
+  size_t entropy_b = EstimateEntropy(countb);
+  // Entropy of the high bytes residuals that get compressed, from the sampled
+  // pixels, which saves a pass over the predicted high bytes.
+  stats_.entropy = std::min(entropy_a, entropy_b) / 1024.0f;
+
+  if (entropy_b < entropy_a) {
     std::vector<uint8_t> h(size_);
     for (size_t i = size_ - 1; i > xsize_; --i) {
         uint8_t n = high_[i - xsize_];
@@ -583,6 +1639,17 @@ void Frame::OptionallyApplyClampedGradientPrediction() {
       }
       std::copy_n(preview_.begin(),preview_xsize+1,p.begin());
       preview_.swap(p);
+
+      for (size_t k = 0; k < 3; k++) {
+        size_t level_xsize = xsize_ >> (k == 0 ? 1 : k + 2);
+        std::vector<uint8_t>& level = pyramid_[k];
+        for (size_t i = level.size(); i > level_xsize + 1; --i) {
+          uint8_t n = level[i - 1 - level_xsize];
+          uint8_t w = level[i - 2];
+          uint8_t nw = level[i - 2 - level_xsize];
+          level[i - 1] -= ClampedGradient(n, w, nw);
+        }
+      }
     }
 
     flags_ |= FrameFlags::USE_CG;
@@ -682,6 +1749,17 @@ void Frame::ApplyBrotliCompression() {
                     preview_.size(), preview_.data(), &compressed_size, compressed.data());
     compressed.resize(compressed_size);
     preview_.swap(compressed);
+
+    for (std::vector<uint8_t>& level : pyramid_) {
+      if (level.empty()) continue;
+      compressed.resize(BrotliEncoderMaxCompressedSize(level.size()));
+      compressed_size = compressed.size();
+      BrotliEncoderCompress(FPV_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                            BROTLI_DEFAULT_MODE, level.size(), level.data(),
+                            &compressed_size, compressed.data());
+      compressed.resize(compressed_size);
+      level.swap(compressed);
+    }
   }
   state_ &= ~FrameState::RAW;
   state_ |= FrameState::COMPRESSED;
@@ -821,8 +1899,15 @@ void Frame::OutputCore(std::vector<uint8_t> *out) {
   if (!(state_ & FrameState::COMPRESSED))
     return;
 
-  out->reserve(out->size() + 1 + high_.size() + low_.size());
-  out->push_back(flags_);
+  out->reserve(out->size() + 5 + high_.size() + low_.size());
+  if (plane_sizes_ && !(flags_ & FrameFlags::NO_LOW_BYTES)) {
+    // Store the size of the low bytes, which allows decoders to locate the
+    // high bytes without decompressing the low bytes.
+    out->push_back(flags_ | FrameFlags::PLANE_SIZES);
+    PushBackUint32LE(low_.size(), out);
+  } else {
+    out->push_back(flags_);
+  }
   out->insert(out->end(), low_.begin(), low_.end());
   out->insert(out->end(), high_.begin(), high_.end());
 }
@@ -831,16 +1916,42 @@ void Frame::OutputFull(std::vector<uint8_t> *out) {
   if (!(state_ & FrameState::COMPRESSED))
     return;
   
+  // The pyramid levels have a flags byte and a size each, and the mask.
+  size_t pyramid_size = 0;
+  for (const std::vector<uint8_t>& level : pyramid_) {
+    if (!level.empty()) pyramid_size += 1 + level.size() + 4;
+  }
+  if (pyramid_size) pyramid_size++;
+  uint8_t preview_flags =
+      (flags_ & FrameFlags::USE_CG) | FrameFlags::NO_LOW_BYTES;
+
   size_t total_size = (9 + 1 + preview_.size()) + // preview & flags
     (1 + high_.size() + low_.size()); // also reserve for OutputCoreFrame
+  total_size += pyramid_size;
+  // Size of the low bytes, see OutputCore
+  if (plane_sizes_ && !(flags_ & FrameFlags::NO_LOW_BYTES)) total_size += 4;
   out->reserve(out->size() + total_size);
 
   PushBackUint32LE(total_size, out);
   // Flag indicating this is not a delta frame or frame list.
   out->push_back(0);
-  PushBackUint32LE(preview_.size() + 1, out);
-  out->push_back((flags_ & FrameFlags::USE_CG) | FrameFlags::NO_LOW_BYTES);
+  PushBackUint32LE(preview_.size() + 1 + pyramid_size, out);
+  out->push_back(preview_flags |
+                 (pyramid_size ? FrameFlags::PREVIEW_PYRAMID : 0));
   out->insert(out->end(), preview_.begin(), preview_.end());
+  if (pyramid_size) {
+    uint8_t mask = 2;
+    for (size_t k = 0; k < 3; k++) {
+      if (pyramid_[k].empty()) continue;
+      mask |= 1 << (k == 0 ? 0 : k + 1);
+      out->push_back(preview_flags);
+      out->insert(out->end(), pyramid_[k].begin(), pyramid_[k].end());
+    }
+    for (const std::vector<uint8_t>& level : pyramid_) {
+      if (!level.empty()) PushBackUint32LE(level.size() + 1, out);
+    }
+    out->push_back(mask);
+  }
 
   OutputCore(out);
 }
@@ -849,110 +1960,373 @@ void Frame::OutputFull(std::vector<uint8_t> *out) {
 
 void UnextractFrame(const uint16_t* img, size_t xsize, size_t ysize, int shift,
                     bool big_endian, uint8_t* out) {
-  size_t numpixels = xsize * ysize;
-  for (size_t i = 0; i < numpixels; i++) {
-    uint16_t u = img[i];
-    u >>= shift;
-    uint8_t a = u & 255;
-    uint8_t b = u >> 8;
-    if (big_endian) std::swap(a, b);
-    out[i * 2 + 0] = a;
-    out[i * 2 + 1] = b;
+  Unextract16(img, xsize * ysize, shift, big_endian, out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void FramePool::Reset(size_t numpixels) {
+  std::lock_guard<std::mutex> l(m_);
+  if (numpixels == numpixels_) return;
+  numpixels_ = numpixels;
+  free_.clear();
+  frames_.clear();
+}
+
+uint16_t* FramePool::Borrow() {
+  std::lock_guard<std::mutex> l(m_);
+  if (free_.empty()) {
+    frames_.emplace_back(new uint16_t[numpixels_]);
+    return frames_.back().get();
   }
+  uint16_t* frame = free_.back();
+  free_.pop_back();
+  return frame;
+}
+
+void FramePool::Return(uint16_t* frame) {
+  std::lock_guard<std::mutex> l(m_);
+  free_.push_back(frame);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void StreamingDecoder::Decode(const uint8_t* bytes, size_t size,
-    std::function<void(bool ok, uint16_t* frame, size_t xsize, size_t ysize,
-        void* payload)> callback,
-    void* payload) {
-  // Don't copy the memory if not needed, but if the buffer already has data
-  // we need to copy to get contiguous memory of all chunks.
-  if (!buffer.empty()) {
-    buffer.insert(buffer.end(), bytes, bytes + size);
-  }
+StreamingDecoder::StreamingDecoder(size_t num_threads, size_t window)
+    : window_(window ? window : 2 * num_threads) {
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back(&StreamingDecoder::RunThread, this);
+  }
+}
+
+StreamingDecoder::~StreamingDecoder() {
+  {
+    std::unique_lock<std::mutex> l(m_);
+    finish_ = true;
+  }
+  cv_in_.notify_all();
+  for (std::thread& thread : threads_) thread.join();
+}
+
+void StreamingDecoder::Decode(const uint8_t* bytes, size_t size,
+    Callback callback, void* payload) {
+  DecodeInternal(bytes, size, callback, payload, false);
+  Deliver(SIZE_MAX);
+}
+
+void StreamingDecoder::DecodeBorrowed(const uint8_t* bytes, size_t size,
+    Callback callback, void* payload) {
+  DecodeInternal(bytes, size, callback, payload, true);
+  Deliver(SIZE_MAX);
+}
+
+void StreamingDecoder::Flush() {
+  Deliver(0);
+}
+
+StreamingDecoder::FrameSelector StreamingDecoder::Stride(size_t stride,
+                                                        size_t first) {
+  if (stride == 0) stride = 1;
+  return [stride, first](size_t index) {
+    return index >= first && (index - first) % stride == 0;
+  };
+}
+
+StreamingDecoder::FrameSelector StreamingDecoder::IndexSet(
+    std::vector<size_t> indices) {
+  std::sort(indices.begin(), indices.end());
+  return [indices](size_t index) {
+    return std::binary_search(indices.begin(), indices.end(), index);
+  };
+}
+
+bool StreamingDecoder::DecodeFrame(const uint8_t* chunk, size_t size,
+    uint16_t* frame, DecodeScratch* scratch) const {
+  DecodeTarget target = format_;
+  target.data = frame;
+  if (mode_ == DECODE_PREVIEW) {
+    size_t preview_size = ReadUint32LE(chunk + 5);
+    if (preview_size > size - 9) return FAILURE("preview too large");
+    return DecompressImage(nullptr, chunk + 9, preview_size, output_xsize(),
+                           output_ysize(), target, scratch);
+  }
+  return DecompressFrameChunk(delta_frame.data(), chunk, size, xsize, ysize,
+                              target, scratch,
+                              mode_ == DECODE_MSB ? DECOMPRESS_MSB_ONLY : 0);
+}
+
+void StreamingDecoder::QueueChunk(const uint8_t* chunk, size_t size,
+    size_t index, const Callback& callback, void* payload, bool borrow) {
+  // Make room in the window first, so that the amount of tasks stays bounded.
+  Deliver(window_ - 1);
+  if (failed_) return;
+
+  Task* task;
+  {
+    std::unique_lock<std::mutex> l(m_);
+    if (free_tasks_.empty()) {
+      tasks_.emplace_back(new Task());
+      free_tasks_.push_back(tasks_.back().get());
+    }
+    task = free_tasks_.back();
+    free_tasks_.pop_back();
+  }
+  // The input bytes are only valid during the Decode call, the worker gets its
+  // own copy. The buffer of a reused task already has the capacity for it.
+  if (mode_ == DECODE_PREVIEW) {
+    // Only the preview is needed.
+    size = std::min<size_t>(size, 9 + ReadUint32LE(chunk + 5));
+  }
+  task->index = index;
+  task->chunk.assign(chunk, chunk + size);
+  task->frame = nullptr;
+  task->ok = false;
+  task->done = false;
+  task->callback = callback;
+  task->payload = payload;
+  task->borrow = borrow;
+  {
+    std::unique_lock<std::mutex> l(m_);
+    q_in_.push(task);
+    pending_.push(task);
+  }
+  cv_in_.notify_one();
+}
+
+void StreamingDecoder::Deliver(size_t max_pending) {
+  for (;;) {
+    Task* task;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      if (pending_.empty()) return;
+      if (pending_.size() <= max_pending && !pending_.front()->done) return;
+      cv_main_.wait(l, [this] { return pending_.front()->done; });
+      task = pending_.front();
+      pending_.pop();
+    }
+
+    if (!failed_) {
+      callback_index_ = task->index;
+      if (task->ok) {
+        task->callback(true, task->frame, output_xsize(), output_ysize(),
+                       task->payload);
+        id++;
+      } else {
+        failed_ = true;
+        task->callback(FAILURE("decompressing frame failed"), nullptr, 0, 0,
+                       task->payload);
+      }
+    }
+    if (task->frame && (failed_ || !task->borrow)) pool_.Return(task->frame);
+    task->callback = nullptr;
+
+    std::unique_lock<std::mutex> l(m_);
+    free_tasks_.push_back(task);
+  }
+}
+
+void StreamingDecoder::RunThread() {
+  DecodeScratch scratch;
+  for (;;) {
+    Task* task;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      cv_in_.wait(l, [this] { return finish_ || !q_in_.empty(); });
+      if (finish_) return;
+      task = q_in_.front();
+      q_in_.pop();
+    }
+
+    // The delta frame is set before the first frame chunk gets queued and does
+    // not change afterwards.
+    task->frame = pool_.Borrow();
+    task->ok = DecodeFrame(task->chunk.data(), task->chunk.size(),
+                           task->frame, &scratch);
+
+    {
+      std::unique_lock<std::mutex> l(m_);
+      task->done = true;
+    }
+    cv_main_.notify_all();
+  }
+}
+
+void StreamingDecoder::DecodeInternal(const uint8_t* bytes, size_t size,
+    const Callback& callback, void* payload, bool borrow) {
+  // Frames before the error are delivered first to keep the callbacks in
+  // order.
+  #define FAIL_CALLBACK(message) {\
+    Deliver(0);\
+    failed_ = true;\
+    callback(FAILURE(message), nullptr, 0, 0, payload);\
+    return;\
+  }
+
+  size_t pos = 0;
+  while (!ended_ && !failed_) {
+    if (skip_) {
+      size_t amount = std::min(skip_, size - pos);
+      pos += amount;
+      skip_ -= amount;
+      if (skip_) break;
+      continue;
+    }
+
+    // The file starts with the header followed by the delta frame, which are
+    // handled together as the first chunk.
+    bool has_header = !delta_frame.empty();
+    size_t header_size = has_header ? 5 : 13;
+
+    const uint8_t* chunk;
+    size_t available;
+    if (partial_.empty()) {
+      if (pos == size) break;
+      chunk = bytes + pos;
+      available = size - pos;
+    } else {
+      // Gather only the missing bytes of the split chunk.
+      size_t needed = partial_chunk_size_ ? partial_chunk_size_ : header_size;
+      size_t amount = std::min(needed - partial_.size(), size - pos);
+      partial_.insert(partial_.end(), bytes + pos, bytes + pos + amount);
+      pos += amount;
+      chunk = partial_.data();
+      available = partial_.size();
+    }
+
+    if (available < header_size) {
+      if (partial_.empty()) partial_.assign(chunk, chunk + available);
+      break;
+    }
+
+    size_t chunk_size;
+    if (!has_header) {
+      xsize = ReadUint32LE(chunk + 0);
+      ysize = ReadUint32LE(chunk + 4);
+      if (xsize == 0 || ysize == 0) FAIL_CALLBACK("invalid image dimensions");
+      if (xsize > 65536 || ysize > 65536 || xsize * ysize > MAX_IMAGE_SIZE) {
+        // In theory larger sizes are possible, but this prevents OOM
+        FAIL_CALLBACK("image too large");
+      }
+      size_t deltasize = ReadUint32LE(chunk + 8);
+      if (deltasize < 5) FAIL_CALLBACK("too small for delta frame");
+      if (chunk[12] != CHUNK_DELTA_FRAME) FAIL_CALLBACK("not a delta frame");
+      chunk_size = 8 + deltasize;
+    } else {
+      chunk_size = ReadUint32LE(chunk);
+      uint8_t flag = chunk[4];
+      if (flag == CHUNK_FRAME_INDEX) {
+        // Frame index reached, end of frames.
+        ended_ = true;
+        break;
+      }
+      bool skip = false;
+      if (flag == CHUNK_AUXILIARY) {
+        if (chunk_size < 5) FAIL_CALLBACK("auxiliary chunk too small");
+        // Decoding uses no auxiliary chunks, which like the preview track may
+        // be large.
+        skip = true;
+      } else if (flag == CHUNK_FRAME) {
+        if (chunk_size < 9) FAIL_CALLBACK("frame too small");
+        // The frame is selected or not once its header is first complete.
+        if (!partial_chunk_size_) {
+          chunk_index_ = next_index_++;
+          skip = selector_ && !selector_(chunk_index_);
+        }
+      } else {
+        FAIL_CALLBACK("not a standard frame");
+      }
+      if (skip) {
+        // Skip the chunk without gathering or decoding it.
+        if (partial_.empty()) {
+          size_t amount = std::min(chunk_size, available);
+          pos += amount;
+          skip_ = chunk_size - amount;
+        } else {
+          skip_ = chunk_size - partial_.size();
+          partial_.clear();
+        }
+        continue;
+      }
+    }
+
+    if (available < chunk_size) {
+      if (partial_.empty()) {
+        partial_.reserve(chunk_size);
+        partial_.assign(chunk, chunk + available);
+        pos = size;
+      } else if (!partial_chunk_size_) {
+        partial_.reserve(chunk_size);
+      }
+      partial_chunk_size_ = chunk_size;
+      if (pos == size) break;
+      continue;
+    }
 
-  #define FAIL_CALLBACK(message) {\
-    callback(FAILURE(message), nullptr, 0, 0, payload);\
-    return;\
+    if (!DecodeChunk(chunk, chunk_size, chunk_index_, callback, payload,
+                     borrow)) {
+      failed_ = true;
+      return;
+    }
+    if (partial_.empty()) {
+      pos += chunk_size;
+    } else {
+      partial_.clear();
+      partial_chunk_size_ = 0;
+    }
   }
 
-  const uint8_t* in = buffer.empty() ? bytes : buffer.data();
-  size_t insize = buffer.empty() ? size : buffer.size();
-
-  bool has_header = !delta_frame.empty();
-  size_t pos = 0;
-  if (delta_frame.empty() && insize > 13) {
-    xsize = ReadUint32LE(in + 0);
-    ysize = ReadUint32LE(in + 4);
-    pos += 8;
+  #undef FAIL_CALLBACK
+}
 
-    if (xsize == 0 || ysize == 0) FAIL_CALLBACK("invalid image dimensions");
-    if (xsize > 65536 || ysize > 65536 || xsize * ysize > MAX_IMAGE_SIZE) {
-      // In theory larger sizes are possible, but this prevents OOM
-      FAIL_CALLBACK("image too large");
-    }
-
-    size_t deltasize = ReadUint32LE(in + pos);
-    if (deltasize < 5) FAIL_CALLBACK("too small for delta frame");
-    uint8_t flag = in[pos + 4];
-    if (flag != 1) FAIL_CALLBACK("not a delta frame");
-    if (deltasize + pos <= insize) {
-      delta_frame.resize(xsize * ysize);
-      if (!DecompressImage({}, in + pos + 5, deltasize - 5, xsize, ysize,
-          delta_frame.data())) {
-        FAIL_CALLBACK("decompressing delta frame failed");
-      }
-      pos += deltasize;
-      has_header = true;
-    } else {
-      pos = 0;
+bool StreamingDecoder::DecodeChunk(const uint8_t* chunk, size_t size,
+    size_t index, const Callback& callback, void* payload, bool borrow) {
+  if (delta_frame.empty()) {
+    delta_frame.resize(xsize * ysize);
+    if (!DecompressImage({}, chunk + 8 + 5, size - 8 - 5, xsize, ysize,
+        delta_frame.data(), &scratch_)) {
+      delta_frame.clear();
+      callback(FAILURE("decompressing delta frame failed"), nullptr, 0, 0,
+               payload);
+      return false;
     }
+    // The pool frames hold the output format, which may be larger than
+    // uint16_t pixels.
+    size_t frame_bytes = format_.Size(output_xsize(), output_ysize());
+    pool_.Reset((frame_bytes + 1) / sizeof(uint16_t));
+    return true;
   }
 
-  for (;;) {
-    if (!has_header) break;
-    if (pos + 9 > insize) break;
-
-    size_t frame_size = ReadUint32LE(in + pos);
-    uint8_t flag = in[pos + 4];
-    if (flag == 2) break;  // Frame index reached, end of frames.
-    if (flag != 0) FAIL_CALLBACK("not a standard frame");
-    if (pos + frame_size > insize) break;
-    size_t preview_size = ReadUint32LE(in + pos + 5);
-    if (preview_size > frame_size) FAIL_CALLBACK("preview size too large");
-
-    size_t main_size = frame_size - preview_size - 9;
-    std::vector<uint16_t> frame(xsize * ysize);
-    bool ok = DecompressImage(delta_frame.data(), in + pos + 9 + preview_size, main_size,
-        xsize, ysize, frame.data());
-    pos += frame_size;
-
-    if (!ok) FAIL_CALLBACK("decompressing frame failed");
-
-    callback(ok, frame.data(), xsize, ysize, payload);
+  if (chunk[4] == CHUNK_AUXILIARY) return true;
+
+  if (strip_callback_) {
+    callback_index_ = index;
+    size_t preview_size = ReadUint32LE(chunk + 5);
+    if (preview_size > size - 9 ||
+        !DecompressImageStrips(delta_frame.data(), chunk + 9 + preview_size,
+                               size - 9 - preview_size, xsize, ysize,
+                               strip_rows_, strip_callback_, &scratch_)) {
+      callback(FAILURE("decompressing frame failed"), nullptr, 0, 0, payload);
+      return false;
+    }
     id++;
+    return true;
   }
 
-  if (buffer.empty()) {
-    // Add any unprocessed bytes
-    if (pos < size) {
-      buffer.assign(bytes + pos, bytes + size);
-    }
-  } else {
-    if (pos > 0) {
-      if (pos == buffer.size()) {
-        buffer.clear();
-      } else {
-        // Move the unprocessed data to the front
-        memmove(buffer.data(), buffer.data() + pos, buffer.size() - pos);
-        buffer.resize(buffer.size() - pos);
-      }
-    }
+  if (!threads_.empty()) {
+    QueueChunk(chunk, size, index, callback, payload, borrow);
+    return !failed_;
   }
 
-  #undef FAIL_CALLBACK
+  uint16_t* frame = pool_.Borrow();
+  callback_index_ = index;
+  if (!DecodeFrame(chunk, size, frame, &scratch_)) {
+    pool_.Return(frame);
+    callback(FAILURE("decompressing frame failed"), nullptr, 0, 0, payload);
+    return false;
+  }
+  callback(true, frame, output_xsize(), output_ysize(), payload);
+  if (!borrow) pool_.Return(frame);
+  id++;
+  return true;
 }
 
 
@@ -964,6 +2338,8 @@ bool RandomAccessDecoder::Init(const uint8_t* data, size_t size) {
 
   data_ = data;
   size_ = size;
+  delta_frame_loaded_ = false;
+  delta_frame.clear();
 
   xsize_ = ReadUint32LE(data + 0);
   ysize_ = ReadUint32LE(data + 4);
@@ -973,103 +2349,784 @@ bool RandomAccessDecoder::Init(const uint8_t* data, size_t size) {
     return FAILURE("image too large");
   }
 
-  // Parse the delta frame
+  // Locate the delta frame, it only gets decoded by the first DecodeFrame.
   size_t pos = 8;
-  size_t delta_frame_size = ReadUint32LE(data + pos);
-  if (OutOfBounds(pos, delta_frame_size, size)) return FAILURE("out of bounds");
-  if (delta_frame_size < 5) return FAILURE("delta frame too small");
+  delta_frame_size_ = ReadUint32LE(data + pos);
+  if (OutOfBounds(pos, delta_frame_size_, size)) {
+    return FAILURE("out of bounds");
+  }
+  if (delta_frame_size_ < 5) return FAILURE("delta frame too small");
   uint8_t flag = data[12];
-  if (flag != 1) return FAILURE("must begin with delta frame");
-  delta_frame.resize(xsize_ * ysize_);
-  if (!fpvc::DecompressImage({}, data + pos + 5, delta_frame_size - 5,
-      xsize_, ysize_, delta_frame.data())) {
-    return FAILURE("failed to decode delta frame");
+  if (flag != CHUNK_DELTA_FRAME) return FAILURE("must begin with delta frame");
+
+  // Locate the frame index, its content is only read for the requested frames.
+  Footer footer;
+  if (!ParseFooter(data, size, &footer)) {
+    return FAILURE("must end with valid frame index");
   }
-  pos += delta_frame_size;
-  if (delta_frame.size() != xsize_ * ysize_) {
-    return FAILURE("delta frame dimensions don't match");
-  }
-
-  // Parse the frame index
-  size_t num_frames = ReadUint64LE(data + size - 8);
-  // Prevent num_frames overflow, the entire file needs at least 16 bytes per
-  // frame for its frame index listing and the frame's own header.
-  if (num_frames > size / 16) return FAILURE("too many frames");
-  size_t footer_size = 5 + 8 * num_frames + 8;
-  if (footer_size > size) return FAILURE("footer too large");
-  frame_offsets.resize(num_frames);
-  pos = size - footer_size;
-  size_t verify_footer_size = ReadUint32LE(data + pos);
-  if (verify_footer_size != footer_size) {
-    return FAILURE("footer size mismatch");
-  }
-  // Flag must be 2 to indicate frame index.
-  if (data[pos + 4] != 2) return FAILURE("must end with frame index");
-  pos += 5;
-  for (size_t i = 0; i < num_frames; i++) {
-    frame_offsets[i] = ReadUint64LE(data + pos);
-    pos += 8;
+  num_frames_ = footer.num_frames;
+  footer_offset_ = footer.offset;
+  frame_offsets_ = footer.frame_offsets;
+  index_blocks_ = nullptr;
+  index_sizes_ = nullptr;
+  index_sizes_size_ = 0;
+  index_block_frames_ = 0;
+  if (footer.frame_index) {
+    index_block_frames_ = ReadUint32LE(footer.frame_index);
+    size_t num_blocks =
+        (num_frames_ + index_block_frames_ - 1) / index_block_frames_;
+    index_blocks_ = footer.frame_index + 4;
+    index_sizes_ = index_blocks_ + 12 * num_blocks;
+    index_sizes_size_ = footer.frame_index + footer.frame_index_size -
+        index_sizes_;
+  }
+  preview_track_ = nullptr;
+  if (footer.preview_track && footer.preview_track_size >= 8 &&
+      ReadUint64LE(footer.preview_track) == num_frames_ &&
+      (footer.preview_track_size - 8) / 8 > num_frames_) {
+    preview_track_ = footer.preview_track + 8;
+  }
+  frame_stats_ = nullptr;
+  if (footer.frame_stats && footer.frame_stats_size >= 4) {
+    size_t record_size = ReadUint32LE(footer.frame_stats);
+    if (record_size >= FRAME_STATS_RECORD_SIZE &&
+        (footer.frame_stats_size - 4) / record_size >= num_frames_) {
+      frame_stats_ = footer.frame_stats + 4;
+      frame_stats_record_size_ = record_size;
+    }
+  }
+  timestamp_blocks_ = nullptr;
+  if (footer.timestamps && footer.timestamps_size >= 4) {
+    size_t block_frames = ReadUint32LE(footer.timestamps);
+    size_t num_blocks = block_frames ?
+        (num_frames_ + block_frames - 1) / block_frames : 0;
+    if (block_frames && (footer.timestamps_size - 4) / 12 >= num_blocks) {
+      timestamp_block_frames_ = block_frames;
+      timestamp_blocks_ = footer.timestamps + 4;
+      timestamp_deltas_ = timestamp_blocks_ + 12 * num_blocks;
+      timestamp_deltas_size_ = footer.timestamps + footer.timestamps_size -
+          timestamp_deltas_;
+    }
   }
 
   return true;
 }
 
-bool RandomAccessDecoder::DecodeFrame(size_t index, uint16_t* frame) const {
-  if (index >= frame_offsets.size()) return FAILURE("invalid frame index");
-  size_t offset = frame_offsets[index];
+bool RandomAccessDecoder::FrameOffset(size_t index, size_t* offset) const {
+  if (index >= num_frames_) return FAILURE("invalid frame index");
+  if (frame_offsets_) {
+    *offset = ReadUint64LE(frame_offsets_ + 8 * index);
+    return true;
+  }
+  const uint8_t* block = index_blocks_ + 12 * (index / index_block_frames_);
+  size_t result = ReadUint64LE(block);
+  size_t pos = ReadUint32LE(block + 8);
+  for (size_t i = index % index_block_frames_; i > 0; i--) {
+    uint64_t size;
+    if (!ReadVarint(index_sizes_, index_sizes_size_, &pos, &size)) {
+      return FAILURE("invalid frame index");
+    }
+    result += size;
+  }
+  *offset = result;
+  return true;
+}
+
+bool RandomAccessDecoder::LoadDeltaFrame() const {
+  if (delta_frame_loaded_.load(std::memory_order_acquire)) return true;
+  std::unique_lock<std::mutex> l(delta_frame_mutex_);
+  if (delta_frame_loaded_.load(std::memory_order_relaxed)) return true;
+  if (!data_) return FAILURE("not initialized");
+  Prefetch(8, delta_frame_size_);
+  std::vector<uint16_t> delta(xsize_ * ysize_);
+  if (!fpvc::DecompressImage({}, data_ + 8 + 5, delta_frame_size_ - 5,
+      xsize_, ysize_, delta.data())) {
+    return FAILURE("failed to decode delta frame");
+  }
+  delta_frame.swap(delta);
+  delta_frame_loaded_.store(true, std::memory_order_release);
+  return true;
+}
+
+RandomAccessDecoder::~RandomAccessDecoder() {
+  CloseFile();
+}
+
+bool RandomAccessDecoder::OpenFile(const std::string& path,
+                                   AccessPattern pattern) {
+  CloseFile();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return FAILURE("couldn't open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return FAILURE("couldn't stat " + path);
+  }
+  size_t size = st.st_size;
+  if (size < 12) {
+    close(fd);
+    return FAILURE("data too small to contain header");
+  }
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after closing the file descriptor.
+  close(fd);
+  if (mapping == MAP_FAILED) return FAILURE("couldn't map " + path);
+  mapping_ = mapping;
+  mapping_size_ = size;
+
+  SetAccessPattern(pattern);
+  // Opening only reads the header and the end of the footer, the delta frame
+  // and the frame index are read once frames get decoded.
+  if (!Init(static_cast<const uint8_t*>(mapping), size)) {
+    CloseFile();
+    return FAILURE("couldn't parse " + path);
+  }
+  return true;
+}
+
+void RandomAccessDecoder::SetAccessPattern(AccessPattern pattern) {
+  pattern_ = pattern;
+  if (!mapping_) return;
+  madvise(mapping_, mapping_size_, pattern == SEQUENTIAL_ACCESS ?
+      MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+void RandomAccessDecoder::Prefetch(size_t offset, size_t size) const {
+  if (!mapping_ || offset >= mapping_size_) return;
+  size = std::min(size, mapping_size_ - offset);
+  // madvise requires a page aligned start address.
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t begin = offset - offset % page;
+  madvise(static_cast<uint8_t*>(mapping_) + begin, offset + size - begin,
+          MADV_WILLNEED);
+}
+
+void RandomAccessDecoder::CloseFile() {
+  if (!mapping_) return;
+  munmap(mapping_, mapping_size_);
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  data_ = nullptr;
+  size_ = 0;
+  num_frames_ = 0;
+  footer_offset_ = 0;
+  frame_offsets_ = nullptr;
+  index_blocks_ = nullptr;
+  preview_track_ = nullptr;
+  frame_stats_ = nullptr;
+  timestamp_blocks_ = nullptr;
+  delta_frame_loaded_ = false;
+  delta_frame.clear();
+}
+
+bool RandomAccessDecoder::DecodeFrame(size_t index, uint16_t* frame,
+                                      DecodeContext* context) const {
+  return DecodeFrame(index, Uint16Target(frame), context);
+}
+
+bool RandomAccessDecoder::DecodeFrame(size_t index, const DecodeTarget& target,
+                                      DecodeContext* context) const {
+  size_t offset;
+  if (!FrameOffset(index, &offset)) return FAILURE("invalid frame index");
   if (OutOfBounds(offset, 9, size_)) return FAILURE("out of bounds");
   const uint8_t* data = data_ + offset;
 
   size_t frame_size = ReadUint32LE(data);
   if (frame_size < 9) return FAILURE("frame too small");
   if (OutOfBounds(offset, frame_size, size_)) return FAILURE("out of bounds");
-  uint8_t flag = data[4];
-  if (flag != 0) return FAILURE("not a standard frame");
-  size_t preview_size = ReadUint32LE(data + 5);
-  if (preview_size > frame_size - 9) return FAILURE("preview too large");
-  size_t main_size = frame_size - preview_size - 9;
-  if (!fpvc::DecompressImage(delta_frame.data(),
-      data + 9 + preview_size, main_size, xsize_, ysize_, frame)) {
+  Prefetch(offset, frame_size);
+  size_t next;
+  if (pattern_ == SEQUENTIAL_ACCESS && index + 1 < num_frames_ &&
+      FrameOffset(index + 1, &next)) {
+    // Let the next frame load while this one is being decompressed.
+    if (next > offset) Prefetch(next, next - offset);
+  }
+  return DecodeFrameChunk(data, frame_size, target, context);
+}
+
+bool RandomAccessDecoder::FrameRange(size_t index, size_t* offset,
+                                     size_t* size) const {
+  size_t begin, end = footer_offset_;
+  if (!FrameOffset(index, &begin)) return false;
+  if (index + 1 < num_frames_) {
+    if (!FrameOffset(index + 1, &end)) return false;
+  } else if (preview_track_) {
+    // The last frame ends before the preview track, whose first preview
+    // follows the header of the first preview track chunk.
+    size_t track = ReadUint64LE(preview_track_);
+    if (track >= begin + 6 && track - 6 < end) end = track - 6;
+  }
+  if (end <= begin || end > size_) return FAILURE("invalid frame offsets");
+  *offset = begin;
+  *size = end - begin;
+  return true;
+}
+
+bool RandomAccessDecoder::DecodeFrameChunk(const uint8_t* chunk, size_t size,
+                                           uint16_t* frame,
+                                           DecodeContext* context) const {
+  return DecodeFrameChunk(chunk, size, Uint16Target(frame), context);
+}
+
+bool RandomAccessDecoder::DecodeFrameChunk(const uint8_t* chunk, size_t size,
+                                           const DecodeTarget& target,
+                                           DecodeContext* context) const {
+  if (!LoadDeltaFrame()) return false;
+  bool parallel = parallel_planes_ && !(context && context->worker);
+  if (!DecompressFrameChunk(delta_frame.data(), chunk, size, xsize_, ysize_,
+                            target, context ? &context->scratch : nullptr,
+                            parallel ? DECOMPRESS_PARALLEL_PLANES : 0)) {
     return FAILURE();
   }
   return true;
 }
 
-bool RandomAccessDecoder::DecodePreview(size_t index, uint8_t* preview) const {
-  if (index >= frame_offsets.size()) return FAILURE("invalid preview index");
+bool RandomAccessDecoder::DecodeFrameMSB(size_t index, uint16_t* frame,
+                                         DecodeContext* context) const {
+  if (!LoadDeltaFrame()) return false;
+  size_t offset, size;
+  if (!FrameRange(index, &offset, &size)) return FAILURE("invalid frame index");
+  Prefetch(offset, size);
+  if (!DecompressFrameChunk(delta_frame.data(), data_ + offset, size, xsize_,
+                            ysize_, frame,
+                            context ? &context->scratch : nullptr,
+                            DECOMPRESS_MSB_ONLY)) {
+    return FAILURE();
+  }
+  return true;
+}
 
-  size_t offset = frame_offsets[index];
-  if (OutOfBounds(offset, 9, size_)) return FAILURE();
-  const uint8_t* data = data_ + offset;
+bool RandomAccessDecoder::DecodeStrips(size_t index, size_t strip_rows,
+                                       StripCallback callback,
+                                       DecodeScratch* scratch) const {
+  if (!LoadDeltaFrame()) return false;
+  size_t offset, size;
+  if (!FrameRange(index, &offset, &size)) return FAILURE("invalid frame index");
+  const uint8_t* chunk = data_ + offset;
+  size_t frame_size = ReadUint32LE(chunk);
+  if (frame_size < 9 || frame_size > size) return FAILURE("invalid frame size");
+  if (chunk[4] != CHUNK_FRAME) return FAILURE("not a standard frame");
+  size_t preview_size = ReadUint32LE(chunk + 5);
+  if (preview_size > frame_size - 9) return FAILURE("preview too large");
+  Prefetch(offset, frame_size);
+  return DecompressImageStrips(delta_frame.data(), chunk + 9 + preview_size,
+                               frame_size - 9 - preview_size, xsize_, ysize_,
+                               strip_rows, callback, scratch);
+}
 
-  size_t frame_size = ReadUint32LE(data);
+bool RandomAccessDecoder::DecodeRows(size_t index, size_t y0, size_t y1,
+                                     uint16_t* rows,
+                                     DecodeContext* context) const {
+  if (!LoadDeltaFrame()) return false;
+  size_t offset;
+  if (!FrameOffset(index, &offset)) return FAILURE("invalid frame index");
+  if (OutOfBounds(offset, 9, size_)) return FAILURE("out of bounds");
+  const uint8_t* chunk = data_ + offset;
+  size_t frame_size = ReadUint32LE(chunk);
   if (frame_size < 9) return FAILURE("frame too small");
   if (OutOfBounds(offset, frame_size, size_)) return FAILURE("out of bounds");
-  uint8_t flag = data[4];
-  if (flag != 0) return FAILURE("not a standard frame");
-  size_t preview_size = ReadUint32LE(data + 5);
-  if (OutOfBounds(9, preview_size, frame_size)) {
-    return FAILURE("preview too large");
+  if (chunk[4] != CHUNK_FRAME) return FAILURE("not a standard frame");
+  size_t preview_size = ReadUint32LE(chunk + 5);
+  if (preview_size > frame_size - 9) return FAILURE("preview too large");
+  return DecompressImageRows(delta_frame.data(), chunk + 9 + preview_size,
+                             frame_size - 9 - preview_size, xsize_, ysize_,
+                             y0, y1, rows,
+                             context ? &context->scratch : nullptr);
+}
+
+bool RandomAccessDecoder::DecodePreview(size_t index, uint8_t* preview,
+                                        DecodeContext* context) const {
+  if (preview_track_) {
+    if (index >= num_frames_) return FAILURE("invalid preview index");
+    size_t begin = ReadUint64LE(preview_track_ + 8 * index);
+    size_t end = ReadUint64LE(preview_track_ + 8 * index + 8);
+    if (begin > end || end > size_) return FAILURE("invalid preview track");
+    Prefetch(begin, end - begin);
+    return DecompressPreview(data_ + begin, end - begin, preview_xsize(),
+                             preview_ysize(), preview, context);
   }
 
-  size_t xsize = preview_xsize();
-  size_t ysize = preview_ysize();
-  std::vector<uint16_t> preview16(xsize * ysize);
-  if (!fpvc::DecompressImage(delta_frame.data(),
-      data + 9, preview_size, xsize, ysize, preview16.data())) {
-    return FAILURE("failed to decompress preview");
+  size_t offset;
+  if (!FrameOffset(index, &offset)) return FAILURE("invalid preview index");
+  if (OutOfBounds(offset, 9, size_)) return FAILURE();
+  return DecompressPreviewChunk(data_ + offset, size_ - offset,
+                                preview_xsize(), preview_ysize(), preview,
+                                context);
+}
+
+RandomAccessDecoder::VerifyResult RandomAccessDecoder::VerifyFrame(
+    size_t index, bool decode, DecodeContext* context) const {
+  size_t offset;
+  if (!FrameOffset(index, &offset) || OutOfBounds(offset, 9, size_)) {
+    return VERIFY_CORRUPT;
+  }
+  const uint8_t* chunk = data_ + offset;
+  size_t frame_size = ReadUint32LE(chunk);
+  if (frame_size < 9 || OutOfBounds(offset, frame_size, size_)) {
+    return VERIFY_CORRUPT;
+  }
+  const uint8_t* checksum = chunk + frame_size;
+  bool has_checksum =
+      !OutOfBounds(offset + frame_size, FRAME_CHECKSUM_SIZE, size_) &&
+      ReadUint32LE(checksum) == FRAME_CHECKSUM_SIZE &&
+      checksum[4] == CHUNK_AUXILIARY && checksum[5] == AUX_FRAME_CHECKSUM;
+  Prefetch(offset, frame_size + (has_checksum ? FRAME_CHECKSUM_SIZE : 0));
+  if (has_checksum &&
+      Crc32c(0, chunk, frame_size) != ReadUint32LE(checksum + 6)) {
+    return VERIFY_CORRUPT;
+  }
+  if (decode) {
+    std::vector<uint16_t> frame(xsize_ * ysize_);
+    if (!DecodeFrame(index, frame.data(), context)) return VERIFY_CORRUPT;
+    if (has_checksum && PixelsCrc32c(0, frame.data(), frame.size()) !=
+        ReadUint32LE(checksum + 10)) {
+      return VERIFY_CORRUPT;
+    }
   }
+  return has_checksum ? VERIFY_OK : VERIFY_NO_CHECKSUM;
+}
 
-  for (size_t y = 0; y < ysize; y++) {
-    for (size_t x = 0; x < xsize; x++) {
-      preview[y * xsize + x] = preview16[y * xsize + x] >> 8;
+bool RandomAccessDecoder::GetFrameStats(size_t index,
+                                        FrameStats* stats) const {
+  if (!frame_stats_) return FAILURE("no frame statistics");
+  if (index >= num_frames_) return FAILURE("invalid frame index");
+  const uint8_t* record = frame_stats_ + index * frame_stats_record_size_;
+  stats->min = ReadUint16LE(record);
+  stats->max = ReadUint16LE(record + 2);
+  stats->sum = ReadUint64LE(record + 4);
+  stats->mean = static_cast<double>(stats->sum) / (xsize_ * ysize_);
+  stats->saturated = ReadUint32LE(record + 12);
+  stats->entropy = ReadUint16LE(record + 16) / 1024.0f;
+  stats->compressed_size = ReadUint32LE(record + 18);
+  return true;
+}
+
+std::vector<size_t> RandomAccessDecoder::FindFrames(
+    const std::function<bool(const FrameStats&)>& predicate) const {
+  std::vector<size_t> result;
+  if (!frame_stats_) return result;
+  FrameStats stats;
+  for (size_t i = 0; i < num_frames_; i++) {
+    GetFrameStats(i, &stats);
+    if (predicate(stats)) result.push_back(i);
+  }
+  return result;
+}
+
+bool RandomAccessDecoder::GetTimestamp(size_t index,
+                                       int64_t* timestamp) const {
+  if (!timestamp_blocks_) return FAILURE("no timestamps");
+  if (index >= num_frames_) return FAILURE("invalid frame index");
+  const uint8_t* block =
+      timestamp_blocks_ + 12 * (index / timestamp_block_frames_);
+  int64_t result = ReadUint64LE(block);
+  size_t pos = ReadUint32LE(block + 8);
+  int64_t delta = 0;
+  for (size_t i = index % timestamp_block_frames_; i > 0; i--) {
+    uint64_t value;
+    if (!ReadVarint(timestamp_deltas_, timestamp_deltas_size_, &pos, &value)) {
+      return FAILURE("invalid timestamps");
+    }
+    delta += ZigzagDecode(value);
+    result += delta;
+  }
+  *timestamp = result;
+  return true;
+}
+
+bool RandomAccessDecoder::FindFrameAtTime(int64_t time, size_t* index) const {
+  if (!timestamp_blocks_) return FAILURE("no timestamps");
+  if (num_frames_ == 0) return FAILURE("no frames");
+  // Find the last block starting at or before the time, then walk it.
+  size_t num_blocks =
+      (num_frames_ + timestamp_block_frames_ - 1) / timestamp_block_frames_;
+  size_t lo = 0, hi = num_blocks;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    int64_t first = ReadUint64LE(timestamp_blocks_ + 12 * mid);
+    if (first <= time) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const uint8_t* block = timestamp_blocks_ + 12 * lo;
+  size_t result = lo * timestamp_block_frames_;
+  size_t end = std::min(result + timestamp_block_frames_, num_frames_);
+  int64_t timestamp = ReadUint64LE(block);
+  size_t pos = ReadUint32LE(block + 8);
+  int64_t delta = 0;
+  for (size_t i = result + 1; i < end; i++) {
+    uint64_t value;
+    if (!ReadVarint(timestamp_deltas_, timestamp_deltas_size_, &pos, &value)) {
+      return FAILURE("invalid timestamps");
+    }
+    delta += ZigzagDecode(value);
+    timestamp += delta;
+    if (timestamp > time) break;
+    result = i;
+  }
+  *index = result;
+  return true;
+}
+
+bool RandomAccessDecoder::DecodePreviewLevel(size_t index, int level,
+                                             uint8_t* preview,
+                                             DecodeContext* context) const {
+  if (level == 1) return DecodePreview(index, preview, context);
+  const uint8_t* in;
+  size_t size;
+  if (preview_track_) {
+    if (index >= num_frames_) return FAILURE("invalid preview index");
+    size_t begin = ReadUint64LE(preview_track_ + 8 * index);
+    size_t end = ReadUint64LE(preview_track_ + 8 * index + 8);
+    if (begin > end || end > size_) return FAILURE("invalid preview track");
+    in = data_ + begin;
+    size = end - begin;
+  } else {
+    size_t offset;
+    if (!FrameOffset(index, &offset)) return FAILURE("invalid preview index");
+    if (OutOfBounds(offset, 9, size_)) return FAILURE("out of bounds");
+    const uint8_t* chunk = data_ + offset;
+    size_t frame_size = ReadUint32LE(chunk);
+    if (frame_size < 9 || OutOfBounds(offset, frame_size, size_)) {
+      return FAILURE("invalid frame size");
+    }
+    if (chunk[4] != CHUNK_FRAME) return FAILURE("not a standard frame");
+    size = ReadUint32LE(chunk + 5);
+    if (OutOfBounds(9, size, frame_size)) return FAILURE("preview too large");
+    in = chunk + 9;
+  }
+  const uint8_t* image = nullptr;
+  size_t image_size = 0;
+  if (!LocatePreviewLevel(in, size, level, &image, &image_size)) {
+    return FAILURE();
+  }
+  // Only the pages of the requested level get read.
+  Prefetch(image - data_, image_size);
+  return DecompressPreview(image, image_size, preview_xsize(level),
+                           preview_ysize(level), preview, context);
+}
+
+bool RandomAccessDecoder::DecodeFrames(const std::vector<size_t>& indices,
+    const BatchDecodeOptions& options, FrameCallback callback,
+    BatchDecodeStats* stats) const {
+  return DecodeBatch(indices, options, xsize_ * ysize_ * sizeof(uint16_t),
+      [this](size_t index, DecodeContext* context, uint8_t* output) {
+        return DecodeFrame(index, reinterpret_cast<uint16_t*>(output),
+                           context);
+      },
+      [this](size_t index) {
+        size_t offset, size;
+        return FrameRange(index, &offset, &size) ? size : 0;
+      },
+      [&callback](bool ok, size_t index, const uint8_t* output) {
+        callback(ok, index, reinterpret_cast<const uint16_t*>(output));
+      }, stats);
+}
+
+bool RandomAccessDecoder::DecodeFrames(size_t begin, size_t end,
+    const BatchDecodeOptions& options, FrameCallback callback,
+    BatchDecodeStats* stats) const {
+  if (begin > end) return FAILURE("invalid frame range");
+  std::vector<size_t> indices(end - begin);
+  std::iota(indices.begin(), indices.end(), begin);
+  return DecodeFrames(indices, options, callback, stats);
+}
+
+bool RandomAccessDecoder::DecodePreviews(const std::vector<size_t>& indices,
+    const BatchDecodeOptions& options, PreviewCallback callback,
+    BatchDecodeStats* stats) const {
+  if (preview_track_ && !indices.empty()) {
+    // Read the part of the preview track with the requested previews at once,
+    // rather than one preview at a time by the workers.
+    auto minmax = std::minmax_element(indices.begin(), indices.end());
+    if (*minmax.second < num_frames_) {
+      size_t begin = ReadUint64LE(preview_track_ + 8 * *minmax.first);
+      size_t end = ReadUint64LE(preview_track_ + 8 * *minmax.second + 8);
+      if (begin < end) Prefetch(begin, end - begin);
+    }
+  }
+  return DecodeBatch(indices, options, preview_xsize() * preview_ysize(),
+      [this](size_t index, DecodeContext* context, uint8_t* output) {
+        return DecodePreview(index, output, context);
+      },
+      [this](size_t index) { return PreviewSize(index); }, callback, stats);
+}
+
+bool RandomAccessDecoder::DecodePreviews(size_t begin, size_t end,
+    const BatchDecodeOptions& options, PreviewCallback callback,
+    BatchDecodeStats* stats) const {
+  if (begin > end) return FAILURE("invalid frame range");
+  std::vector<size_t> indices(end - begin);
+  std::iota(indices.begin(), indices.end(), begin);
+  return DecodePreviews(indices, options, callback, stats);
+}
+
+size_t RandomAccessDecoder::PreviewSize(size_t index) const {
+  if (index >= num_frames_) return 0;
+  if (preview_track_) {
+    size_t begin = ReadUint64LE(preview_track_ + 8 * index);
+    size_t end = ReadUint64LE(preview_track_ + 8 * index + 8);
+    return begin < end ? end - begin : 0;
+  }
+  size_t offset;
+  if (!FrameOffset(index, &offset) || OutOfBounds(offset, 9, size_)) return 0;
+  return ReadUint32LE(data_ + offset + 5);
+}
+
+bool RandomAccessDecoder::DecodeBatch(const std::vector<size_t>& indices,
+    const BatchDecodeOptions& options, size_t output_size,
+    const std::function<bool(size_t index, DecodeContext* context,
+        uint8_t* output)>& decode,
+    const std::function<size_t(size_t index)>& compressed_size,
+    const std::function<void(bool ok, size_t index,
+        const uint8_t* output)>& deliver,
+    BatchDecodeStats* stats) const {
+  auto start = std::chrono::steady_clock::now();
+  if (!data_) return FAILURE("not initialized");
+  size_t n = indices.size();
+
+  // Every output buffer is either free, being decoded into, or holding a
+  // decoded output waiting to be delivered, so their amount bounds the memory.
+  size_t num_outputs = std::max<size_t>(1, options.max_output_bytes /
+                                           std::max<size_t>(1, output_size));
+  num_outputs = std::min(num_outputs, std::max<size_t>(1, n));
+  size_t num_threads = std::max<size_t>(1, options.num_threads);
+  num_threads = std::min(num_threads, num_outputs);
+  std::vector<std::vector<uint8_t>> outputs(num_outputs);
+  std::vector<size_t> free_outputs(num_outputs);
+  std::iota(free_outputs.begin(), free_outputs.end(), 0);
+
+  struct Done {
+    size_t job;  // Position in indices.
+    size_t output;
+    bool ok;
+  };
+
+  std::mutex m;
+  std::condition_variable cv_workers;
+  std::condition_variable cv_main;
+  size_t next_job = 0;
+  std::deque<Done> done;  // In order of completion.
+  bool stop = false;
+
+  auto run_thread = [&]() {
+    DecodeContext context;
+    context.worker = true;
+    for (;;) {
+      size_t job, output;
+      {
+        std::unique_lock<std::mutex> l(m);
+        cv_workers.wait(l, [&] {
+          return stop || next_job == n || !free_outputs.empty();
+        });
+        if (stop || next_job == n) return;
+        job = next_job++;
+        output = free_outputs.back();
+        free_outputs.pop_back();
+      }
+      outputs[output].resize(output_size);
+      bool ok = decode(indices[job], &context, outputs[output].data());
+      {
+        std::unique_lock<std::mutex> l(m);
+        done.push_back({job, output, ok});
+      }
+      cv_main.notify_one();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) threads.emplace_back(run_thread);
+
+  bool all_ok = true;
+  size_t compressed_bytes = 0;
+  for (size_t delivered = 0; delivered < n; delivered++) {
+    Done result;
+    {
+      std::unique_lock<std::mutex> l(m);
+      std::deque<Done>::iterator it;
+      // Jobs are taken in order, so in-order delivery never waits on a job
+      // that cannot get an output buffer.
+      cv_main.wait(l, [&] {
+        if (options.in_order) {
+          it = std::find_if(done.begin(), done.end(),
+              [&](const Done& d) { return d.job == delivered; });
+        } else {
+          it = done.begin();
+        }
+        return it != done.end();
+      });
+      result = *it;
+      done.erase(it);
+    }
+
+    size_t index = indices[result.job];
+    deliver(result.ok, index, outputs[result.output].data());
+    all_ok &= result.ok;
+    if (stats) compressed_bytes += compressed_size(index);
+
+    {
+      std::unique_lock<std::mutex> l(m);
+      free_outputs.push_back(result.output);
+    }
+    cv_workers.notify_one();
+  }
+
+  {
+    std::unique_lock<std::mutex> l(m);
+    stop = true;
+  }
+  cv_workers.notify_all();
+  for (std::thread& thread : threads) thread.join();
+
+  if (stats) {
+    stats->frames = n;
+    stats->compressed_bytes = compressed_bytes;
+    stats->decoded_bytes = n * output_size;
+    stats->seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+  return all_ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+LiveDecoder::~LiveDecoder() {
+  Close();
+}
+
+void LiveDecoder::Close() {
+  if (inotify_fd_ >= 0) close(inotify_fd_);
+  if (fd_ >= 0) close(fd_);
+  inotify_fd_ = -1;
+  fd_ = -1;
+  xsize_ = 0;
+  ysize_ = 0;
+  delta_frame.clear();
+  frame_offsets.clear();
+  frame_sizes.clear();
+  scan_pos_ = 0;
+  finished_ = false;
+}
+
+bool LiveDecoder::Open(const std::string& path) {
+  Close();
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) return FAILURE("couldn't open " + path);
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ >= 0 &&
+      inotify_add_watch(inotify_fd_, path.c_str(),
+                        IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+  }
+  return Update();
+}
+
+bool LiveDecoder::Update() {
+  if (fd_ < 0) return FAILURE("no file opened");
+  struct stat st;
+  if (fstat(fd_, &st) != 0) return FAILURE("couldn't stat file");
+  size_t size = st.st_size;
+
+  uint8_t header[12];
+  if (!has_header()) {
+    if (size < 13 || !ReadFully(fd_, 0, 12, header)) return true;
+    size_t xsize = ReadUint32LE(header + 0);
+    size_t ysize = ReadUint32LE(header + 4);
+    if (xsize == 0 || ysize == 0) return FAILURE("invalid image dimensions");
+    if (xsize > 65536 || ysize > 65536 || xsize * ysize > MAX_IMAGE_SIZE) {
+      // In theory larger sizes are possible, but this prevents OOM
+      return FAILURE("image too large");
     }
+    size_t delta_frame_size = ReadUint32LE(header + 8);
+    if (delta_frame_size < 5) return FAILURE("delta frame too small");
+    if (OutOfBounds(8, delta_frame_size, size)) return true;
+    chunk_.resize(delta_frame_size);
+    if (!ReadFully(fd_, 8, delta_frame_size, chunk_.data())) return true;
+    if (chunk_[4] != CHUNK_DELTA_FRAME) {
+      return FAILURE("must begin with delta frame");
+    }
+    std::vector<uint16_t> delta(xsize * ysize);
+    if (!DecompressImage(nullptr, chunk_.data() + 5, delta_frame_size - 5,
+                         xsize, ysize, delta.data())) {
+      return FAILURE("failed to decode delta frame");
+    }
+    xsize_ = xsize;
+    ysize_ = ysize;
+    delta_frame.swap(delta);
+    scan_pos_ = 8 + delta_frame_size;
+  }
+
+  // Only the chunk headers are read, a chunk counts once it is complete.
+  while (!finished_ && !OutOfBounds(scan_pos_, 5, size)) {
+    if (!ReadFully(fd_, scan_pos_, 5, header)) break;
+    size_t chunk_size = ReadUint32LE(header);
+    uint8_t flag = header[4];
+    if (flag == CHUNK_FRAME_INDEX) {
+      finished_ = true;
+      break;
+    }
+    if (chunk_size < 5) return FAILURE("chunk too small");
+    if (OutOfBounds(scan_pos_, chunk_size, size)) break;
+    if (flag == CHUNK_FRAME) {
+      frame_offsets.push_back(scan_pos_);
+      frame_sizes.push_back(chunk_size);
+    } else if (flag != CHUNK_AUXILIARY) {
+      return FAILURE("not a standard frame");
+    }
+    scan_pos_ += chunk_size;
+  }
+  return true;
+}
+
+bool LiveDecoder::WaitForFrames(int timeout_ms) {
+  size_t before = frame_offsets.size();
+  if (!Update()) return false;
+  auto deadline = std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(timeout_ms);
+  while (frame_offsets.size() == before && !finished_) {
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0) break;
+    // Poll the file size regularly even when waiting for inotify events.
+    int wait_ms = std::min(remaining, 50);
+    if (inotify_fd_ >= 0) {
+      struct pollfd p = {inotify_fd_, POLLIN, 0};
+      if (poll(&p, 1, wait_ms) > 0) {
+        char events[4096];
+        while (read(inotify_fd_, events, sizeof(events)) > 0) {}
+      }
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+    }
+    if (!Update()) return false;
   }
+  return frame_offsets.size() > before;
+}
 
+bool LiveDecoder::ReadChunk(size_t index) {
+  if (index >= frame_offsets.size()) return FAILURE("invalid frame index");
+  chunk_.resize(frame_sizes[index]);
+  if (!ReadFully(fd_, frame_offsets[index], chunk_.size(), chunk_.data())) {
+    return FAILURE("couldn't read frame");
+  }
   return true;
 }
 
+bool LiveDecoder::DecodeFrame(size_t index, uint16_t* frame) {
+  if (!ReadChunk(index)) return false;
+  return DecompressFrameChunk(delta_frame.data(), chunk_.data(), chunk_.size(),
+                              xsize_, ysize_, frame);
+}
 
+bool LiveDecoder::DecodePreview(size_t index, uint8_t* preview) {
+  if (!ReadChunk(index)) return false;
+  return DecompressPreviewChunk(chunk_.data(), chunk_.size(), preview_xsize(),
+                                preview_ysize(), preview);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1102,6 +3159,11 @@ void Encoder::Init(const uint16_t* delta_frame, size_t xsize, size_t ysize,
 
   WriteUint32LE(compressed.size() - 8, compressed.data() + 8);
   bytes_written = compressed.size();
+  if (preview_track_) {
+    // Without a temporary file, the file is written without preview track.
+    preview_spool_ = tmpfile();
+    if (!preview_spool_) FAILURE("couldn't create preview track file");
+  }
   callback(compressed.data(), compressed.size(), payload);
 }
 
@@ -1120,23 +3182,54 @@ void Encoder::Finish(Callback callback, void* payload) {
     delete threads[i];
   }
 
+  std::vector<size_t> preview_offsets;
+  if (preview_spool_) WritePreviewTrack(callback, payload, &preview_offsets);
+
   std::vector<uint8_t> compressed;
-  WriteFrameIndex(&compressed);
+  WriteFooter(preview_offsets, &compressed);
   callback(compressed.data(), compressed.size(), payload);
 }
 
+Encoder::~Encoder() {
+  if (preview_spool_) fclose(preview_spool_);
+}
+
+void Encoder::SetPreviewTrack(bool enabled) {
+  preview_track_ = enabled;
+}
+
+void Encoder::SetPreviewPyramid(bool enabled) {
+  preview_pyramid_ = enabled;
+}
+
+void Encoder::SetFrameChecksums(bool enabled) {
+  frame_checksums_ = enabled;
+}
+
+void Encoder::SetPlaneSizes(bool enabled) {
+  plane_sizes_ = enabled;
+}
+
 void Encoder::CompressFrame(const uint16_t* img,
     Callback callback, void* payload) {
+  CompressFrame(img, -1, callback, payload);
+}
+
+void Encoder::CompressFrame(const uint16_t* img, int64_t timestamp,
+    Callback callback, void* payload) {
+  if (timestamp != -1) has_timestamps_ = true;
   Task task;
   task.frame = img;
   task.id = id++;
+  task.timestamp = timestamp;
   task.callback = callback;
   task.payload = payload;
 
   if (threads.empty()) {
     // Don't use multithreading
-    std::vector<uint8_t> compressed = RunTask(task);
-    FinishTask(task, &compressed);
+    FrameStats stats;
+    std::vector<uint8_t> compressed = RunTask(task, &stats);
+    FinishTask(task, &compressed, stats);
     return;
   }
 
@@ -1156,14 +3249,29 @@ void Encoder::CompressFrame(const uint16_t* img,
   }
 }
 
-std::vector<uint8_t> Encoder::RunTask(const Task& task) {
+std::vector<uint8_t> Encoder::RunTask(const Task& task, FrameStats* stats) {
   std::vector<uint8_t> compressed;
 
   Frame frame = Frame(xsize_, ysize_, task.frame, shift_to_left_align_, big_endian_);
+  frame.SetPreviewPyramid(preview_pyramid_);
+  frame.SetPlaneSizes(plane_sizes_);
+  uint32_t pixel_crc = frame_checksums_ ? frame.PixelChecksum() : 0;
   
   frame.Compress(delta_frame_);
   
   frame.OutputFull(&compressed);
+  *stats = frame.stats();
+  stats->compressed_size = compressed.size();
+
+  if (frame_checksums_) {
+    // Computed here rather than in FinishTask, to run on the worker threads.
+    uint32_t chunk_crc = Crc32c(0, compressed.data(), compressed.size());
+    PushBackUint32LE(FRAME_CHECKSUM_SIZE, &compressed);
+    compressed.push_back(CHUNK_AUXILIARY);
+    compressed.push_back(AUX_FRAME_CHECKSUM);
+    PushBackUint32LE(chunk_crc, &compressed);
+    PushBackUint32LE(pixel_crc, &compressed);
+  }
   
   return compressed;
 }
@@ -1176,24 +3284,230 @@ size_t Encoder::MaxQueued() const {
   return threads.empty() ? 1 : (threads.size() + (threads.size() + 1) / 2);
 }
 
-void Encoder::FinishTask(const Task& task, std::vector<uint8_t>* compressed) {
+void Encoder::SetCheckpointInterval(size_t num_frames) {
+  checkpoint_interval_ = num_frames;
+}
+
+void Encoder::FinishTask(const Task& task, std::vector<uint8_t>* compressed,
+                         const FrameStats& stats) {
+  frame_stats_.push_back(stats);
+  timestamps_.push_back(task.timestamp);
+  if (preview_spool_) {
+    uint32_t preview_size = ReadUint32LE(compressed->data() + 5);
+    if (fwrite(compressed->data() + 9, 1, preview_size, preview_spool_) !=
+        preview_size) {
+      FAILURE("couldn't write preview track file");
+      fclose(preview_spool_);
+      preview_spool_ = nullptr;
+    }
+    preview_sizes_.push_back(preview_size);
+  }
   frame_offsets.push_back(bytes_written);
   bytes_written += compressed->size();
+  if (checkpoint_interval_ &&
+      frame_offsets.size() - checkpointed_frames_ >= checkpoint_interval_) {
+    // Output the checkpoint together with the frame, so that it is written
+    // no later than the frames it lists.
+    WriteIndexCheckpoint(compressed);
+  }
   task.callback(compressed->data(), compressed->size(), task.payload);
 }
 
-void Encoder::WriteFrameIndex(std::vector<uint8_t>* compressed) const {
+void Encoder::WriteFooter(const std::vector<size_t>& preview_offsets,
+                          std::vector<uint8_t>* compressed) const {
+  size_t begin = BeginFooter(compressed);
+  AppendFrameIndexSection(frame_offsets, compressed);
+  if (!preview_offsets.empty()) {
+    std::vector<uint8_t> content;
+    PushBackUint64LE(preview_offsets.size() - 1, &content);
+    for (size_t offset : preview_offsets) PushBackUint64LE(offset, &content);
+    AppendFooterSection(FOOTER_PREVIEW_TRACK, content, compressed);
+  }
+  AppendFrameStatsSection(frame_stats_, compressed);
+  if (has_timestamps_) AppendTimestampsSection(timestamps_, compressed);
+  EndFooter(begin, frame_offsets.size(), compressed);
+}
+
+void Encoder::WritePreviewTrack(Callback callback, void* payload,
+                                std::vector<size_t>* preview_offsets) {
+  bool ok = fseek(preview_spool_, 0, SEEK_SET) == 0;
+  std::vector<uint8_t> buffer;
+  size_t i = 0;
+  while (i < preview_sizes_.size()) {
+    // Group as many previews in a chunk as its 32-bit size allows.
+    size_t chunk_size = 6;
+    size_t end = i;
+    while (end < preview_sizes_.size() &&
+           chunk_size + preview_sizes_[end] <= MAX_PREVIEW_TRACK_CHUNK) {
+      chunk_size += preview_sizes_[end++];
+    }
+    if (end == i) chunk_size += preview_sizes_[end++];
+
+    buffer.clear();
+    PushBackUint32LE(chunk_size, &buffer);
+    buffer.push_back(CHUNK_AUXILIARY);
+    buffer.push_back(AUX_PREVIEW_TRACK);
+    callback(buffer.data(), buffer.size(), payload);
+    bytes_written += buffer.size();
+
+    for (; i < end; i++) {
+      preview_offsets->push_back(bytes_written);
+      buffer.resize(preview_sizes_[i]);
+      if (ok && fread(buffer.data(), 1, buffer.size(), preview_spool_) !=
+          buffer.size()) {
+        ok = FAILURE("couldn't read preview track file");
+      }
+      // After an error the chunk is still completed, to keep the file valid.
+      if (!ok) std::fill(buffer.begin(), buffer.end(), 0);
+      callback(buffer.data(), buffer.size(), payload);
+      bytes_written += buffer.size();
+    }
+  }
+  preview_offsets->push_back(bytes_written);
+  // The footer only lists a preview track that is complete.
+  if (!ok || preview_sizes_.size() != frame_offsets.size()) {
+    preview_offsets->clear();
+  }
+
+  fclose(preview_spool_);
+  preview_spool_ = nullptr;
+  preview_sizes_.clear();
+}
+
+void Encoder::WriteIndexCheckpoint(std::vector<uint8_t>* compressed) {
+  size_t count = frame_offsets.size() - checkpointed_frames_;
+  size_t chunk_size = CHECKPOINT_HEADER_SIZE + 8 * count;
   size_t pos = compressed->size();
-  size_t frameindex_size = 5 + 8 * frame_offsets.size() + 8;
-  compressed->resize(compressed->size() + frameindex_size);
-  WriteUint32LE(frameindex_size, &(*compressed)[pos]);
-  (*compressed)[pos + 4] = 2;  // flag indicating it's the frame index
-  pos += 5;
-  for (size_t i = 0; i < frame_offsets.size(); i++) {
-    WriteUint64LE(frame_offsets[i], &(*compressed)[pos]);
-    pos += 8;
+  compressed->resize(pos + chunk_size);
+  uint8_t* chunk = compressed->data() + pos;
+  WriteUint32LE(chunk_size, chunk);
+  chunk[4] = CHUNK_AUXILIARY;
+  chunk[5] = AUX_INDEX_CHECKPOINT;
+  memcpy(chunk + 6, "fpvi", 4);
+  WriteUint64LE(bytes_written, chunk + 10);
+  WriteUint64LE(last_checkpoint_, chunk + 18);
+  WriteUint64LE(checkpointed_frames_, chunk + 26);
+  WriteUint32LE(count, chunk + 34);
+  for (size_t i = 0; i < count; i++) {
+    WriteUint64LE(frame_offsets[checkpointed_frames_ + i],
+                  chunk + CHECKPOINT_HEADER_SIZE + 8 * i);
+  }
+  last_checkpoint_ = bytes_written;
+  checkpointed_frames_ = frame_offsets.size();
+  bytes_written += chunk_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void AppendFooter(const std::vector<size_t>& frame_offsets,
+                  const std::vector<FrameStats>& frame_stats,
+                  const std::vector<int64_t>& timestamps,
+                  std::vector<uint8_t>* out) {
+  size_t begin = BeginFooter(out);
+  AppendFrameIndexSection(frame_offsets, out);
+  if (!frame_stats.empty()) AppendFrameStatsSection(frame_stats, out);
+  if (!timestamps.empty()) AppendTimestampsSection(timestamps, out);
+  EndFooter(begin, frame_offsets.size(), out);
+}
+
+// Walks the chunk headers of the frames from pos, up to the first incomplete
+// chunk, or up to the first index checkpoint if stop_at_checkpoint. Outputs
+// the offsets of the frames, and returns where the walk stopped.
+size_t WalkFrameChunks(const uint8_t* data, size_t size, size_t pos,
+                       bool stop_at_checkpoint,
+                       std::vector<size_t>* frame_offsets) {
+  while (!OutOfBounds(pos, 5, size)) {
+    size_t chunk_size = ReadUint32LE(data + pos);
+    uint8_t flag = data[pos + 4];
+    if (chunk_size < 5 || OutOfBounds(pos, chunk_size, size)) break;
+    if (flag == CHUNK_FRAME) {
+      frame_offsets->push_back(pos);
+    } else if (flag != CHUNK_AUXILIARY) {
+      break;
+    } else if (stop_at_checkpoint && IsIndexCheckpoint(data, size, pos)) {
+      break;
+    }
+    pos += chunk_size;
+  }
+  return pos;
+}
+
+bool RecoverFrameIndex(const uint8_t* data, size_t size, size_t* valid_size,
+                       std::vector<uint8_t>* footer, size_t* num_frames) {
+  footer->clear();
+  if (size < 13) return FAILURE("data too small to contain header");
+  size_t delta_frame_size = ReadUint32LE(data + 8);
+  if (delta_frame_size < 5 || OutOfBounds(8, delta_frame_size, size)) {
+    return FAILURE("delta frame incomplete");
+  }
+  if (data[12] != CHUNK_DELTA_FRAME) return FAILURE("must begin with delta frame");
+  size_t first_frame = 8 + delta_frame_size;
+
+  Footer complete;
+  if (ParseFooter(data, size, &complete)) {
+    // Already complete.
+    *valid_size = size;
+    if (num_frames) *num_frames = complete.num_frames;
+    return true;
+  }
+
+  // Walk the chunk headers up to the first checkpoint. Without checkpoints
+  // this already indexes the whole file, reading only the chunk headers.
+  std::vector<size_t> frame_offsets;
+  size_t pos = WalkFrameChunks(data, size, first_frame, true, &frame_offsets);
+  if (IsIndexCheckpoint(data, size, pos)) {
+    // Find the last intact checkpoint. Checkpoints are at most the checkpoint
+    // interval of frames apart, so this only scans the last few frames.
+    size_t first_checkpoint = pos;
+    size_t checkpoint = first_checkpoint;
+    for (size_t i = size - 4; i > first_checkpoint + 6; i--) {
+      if (data[i] == 'f' && memcmp(data + i, "fpvi", 4) == 0 &&
+          IsIndexCheckpoint(data, size, i - 6)) {
+        checkpoint = i - 6;
+        break;
+      }
+    }
+
+    // Follow the chain of checkpoints back to the first one, these only
+    // contain offsets so none of the frame data is read.
+    std::vector<size_t> chain;
+    for (size_t i = checkpoint; i != 0; i = ReadUint64LE(data + i + 18)) {
+      if (i < first_checkpoint || !IsIndexCheckpoint(data, size, i)) {
+        chain.clear();
+        break;
+      }
+      chain.push_back(i);
+    }
+    if (chain.empty() || chain.back() != first_checkpoint) chain.clear();
+
+    std::vector<size_t> checkpointed;
+    bool consistent = !chain.empty();
+    for (size_t i = chain.size(); i > 0; i--) {
+      const uint8_t* chunk = data + chain[i - 1];
+      if (ReadUint64LE(chunk + 26) != checkpointed.size()) {
+        consistent = false;
+        break;
+      }
+      size_t count = ReadUint32LE(chunk + 34);
+      for (size_t j = 0; j < count; j++) {
+        checkpointed.push_back(
+            ReadUint64LE(chunk + CHECKPOINT_HEADER_SIZE + 8 * j));
+      }
+      pos = chain[i - 1] + ReadUint32LE(chunk);
+    }
+    if (!consistent || checkpointed.size() < frame_offsets.size()) {
+      // Inconsistent checkpoints, fall back to walking all the frames.
+      pos = first_checkpoint;
+    } else {
+      frame_offsets.swap(checkpointed);
+    }
   }
-  WriteUint64LE(frame_offsets.size(), &(*compressed)[pos]);
+
+  // Walk the chunk headers of the frames after the last checkpoint.
+  *valid_size = WalkFrameChunks(data, size, pos, false, &frame_offsets);
+  if (num_frames) *num_frames = frame_offsets.size();
+  AppendFrameIndex(frame_offsets, footer);
+  return true;
 }
 
 void Encoder::RunThread() {
@@ -1211,7 +3525,8 @@ void Encoder::RunThread() {
       q_in.pop();
     }
 
-    std::vector<uint8_t> compressed = RunTask(task);
+    FrameStats stats;
+    std::vector<uint8_t> compressed = RunTask(task, &stats);
 
     // Wait to output in the correct order.
     {
@@ -1219,7 +3534,7 @@ void Encoder::RunThread() {
       cv_out.wait(l, [&task, this]{
         return q_out.front().id == task.id;
       });
-      FinishTask(task, &compressed);
+      FinishTask(task, &compressed, stats);
       q_out.pop();
     }
     // Finished outputting
@@ -16,11 +16,15 @@
 #define FUSION_POWER_VIDEO_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
+#include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -33,27 +37,258 @@ void UnextractFrame(const uint16_t* img,
                     size_t xsize, size_t ysize, int shift,
                     bool big_endian, uint8_t* out);
 
+// Buffers reused by consecutive decompressions, so that decoding many frames
+// does not allocate the intermediate byte planes for each frame. A scratch
+// may only be used by one thread at a time.
+struct DecodeScratch {
+  std::vector<uint8_t> low;
+  std::vector<uint8_t> high;
+  std::vector<uint16_t> strip;  // Used when decoding in strips.
+};
+
+/* Describes the memory that a frame gets decoded into, so that decoders write
+the pixels in the format that the caller needs while reconstructing them,
+rather than in a packed uint16_t frame that then needs another conversion
+pass. Each pixel value is shifted right by shift bits before being stored. */
+struct DecodeTarget {
+  enum PixelType {
+    UINT8,    // Values above 255 after the shift are clamped to 255.
+    UINT16,
+    FLOAT32,
+  };
+  PixelType type = UINT16;
+  void* data = nullptr;
+  // Bytes from the start of one row to the next, 0 for packed rows. Must be a
+  // multiple of the pixel size.
+  size_t row_pitch = 0;
+  int shift = 0;
+  // Store UINT16 pixels in big endian rather than native byte order.
+  bool big_endian = false;
+
+  size_t PixelSize() const {
+    return type == UINT8 ? 1 : type == UINT16 ? 2 : 4;
+  }
+  size_t RowPitch(size_t xsize) const {
+    return row_pitch ? row_pitch : xsize * PixelSize();
+  }
+  // Bytes of memory needed for a frame of the given size.
+  size_t Size(size_t xsize, size_t ysize) const {
+    return ysize ? RowPitch(xsize) * (ysize - 1) + xsize * PixelSize() : 0;
+  }
+};
+
+/* Receives a frame decoded in strips: num_rows rows starting at row y0, with
+xsize values per row. The rows are only valid during the call. Returning false
+stops decoding the rest of the frame. */
+typedef std::function<bool(size_t y0, size_t num_rows, const uint16_t* rows)>
+    StripCallback;
+
+/* Pool of frame buffers of a fixed amount of pixels. Frames are borrowed from
+the pool and must be returned to it once no longer used, after which they get
+handed out again rather than allocating new memory. Thread-safe: a frame may be
+returned from a different thread than the one that borrowed it. */
+class FramePool {
+ public:
+  explicit FramePool(size_t numpixels = 0) : numpixels_(numpixels) {}
+
+  FramePool(const FramePool&) = delete;
+  FramePool& operator=(const FramePool&) = delete;
+
+  // Changes the frame size, all borrowed frames must have been returned.
+  void Reset(size_t numpixels);
+
+  // Returns a frame of numpixels values, with undefined content.
+  uint16_t* Borrow();
+
+  // Hands a borrowed frame back to the pool.
+  void Return(uint16_t* frame);
+
+  size_t numpixels() const { return numpixels_; }
+
+ private:
+  std::mutex m_;
+  size_t numpixels_;
+  std::vector<std::unique_ptr<uint16_t[]>> frames_;
+  std::vector<uint16_t*> free_;
+};
+
 // Streaming decoder
 class StreamingDecoder {
  public:
+  // The payload is an optional argument to pass from calls to the callback.
+  typedef std::function<void(bool ok, uint16_t* frame, size_t xsize,
+      size_t ysize, void* payload)> Callback;
+
+  /* Decodes frames using num_threads worker threads, or on the thread calling
+  Decode if num_threads is 0. The calling thread then only splits the input
+  into chunks. At most window frames are being decoded or waiting to be
+  delivered at the same time, Decode blocks when that many are pending. A
+  window of 0 uses twice the amount of threads.
+  The callbacks are always called from the thread calling Decode or Flush, in
+  the order of the frames in the stream. */
+  StreamingDecoder(size_t num_threads = 0, size_t window = 0);
+  ~StreamingDecoder();
+
   /* Decodes frames in a streaming fashing. Appends the given bytes to the
   input buffer. Calls the callback function for all decoded frames that could
   be decoded so far. The payload is an optional parameter to pass on to the
-  callback. */
-  void Decode(const uint8_t* bytes, size_t size,
-      std::function<void(bool ok, uint16_t* frame, size_t xsize, size_t ysize,
-          void* payload)> callback,
+  callback. The frame is only valid during the callback.
+  With worker threads, frames still being decoded are delivered by a later
+  Decode or by Flush. */
+  void Decode(const uint8_t* bytes, size_t size, Callback callback,
       void* payload = nullptr);
 
+  /* Like Decode, but the callback borrows the frame from the frame pool of
+  this decoder: the frame stays valid after the callback until it is handed
+  back with ReturnFrame, which may be done from any thread. */
+  void DecodeBorrowed(const uint8_t* bytes, size_t size, Callback callback,
+      void* payload = nullptr);
+
+  // Waits until all frames given so far are decoded and calls their callbacks.
+  // Must be called after the last Decode when using worker threads.
+  void Flush();
+
+  // Returns a frame borrowed by the callback of DecodeBorrowed to the pool.
+  void ReturnFrame(uint16_t* frame) { pool_.Return(frame); }
+
+  // What gets decoded of the selected frames.
+  enum DecodeMode {
+    DECODE_FULL,     // The full 16-bit frames.
+    DECODE_PREVIEW,  // Only the previews, the callback gets the preview
+                     // dimensions and the 8 bits in the most significant bits.
+    DECODE_MSB,      // Only the 8 most significant bits of the full frames,
+                     // the least significant bits are 0.
+  };
+
+  // Returns whether the frame with the given index in the stream is selected.
+  typedef std::function<bool(size_t index)> FrameSelector;
+
+  // Selects every stride-th frame, starting at frame first.
+  static FrameSelector Stride(size_t stride, size_t first = 0);
+
+  // Selects the frames with the given indices.
+  static FrameSelector IndexSet(std::vector<size_t> indices);
+
+  /* Sets which frames are decoded, the callback is only called for the
+  selected frames. Frames that are not selected are skipped after reading their
+  chunk header, without copying or decompressing them. All frames are selected
+  by default. Must be called before the first Decode. */
+  void SetFrameSelector(FrameSelector selector) { selector_ = selector; }
+
+  // Sets what gets decoded of the selected frames. Must be called before the
+  // first Decode.
+  void SetDecodeMode(DecodeMode mode) { mode_ = mode; }
+
+  /* Sets the pixel format of the frames given to the callback, described by a
+  target whose data is ignored. The frame pointer given to the callback then
+  points to a buffer in that format, e.g. to be cast to uint8_t* or float*,
+  which is written while decoding without an additional conversion pass.
+  Must be called before the first Decode. */
+  void SetOutputFormat(const DecodeTarget& format) { format_ = format; }
+
+  // Returns the index in the stream of the frame given to the callback that
+  // is running.
+  size_t frame_index() const { return callback_index_; }
+
+  /* Delivers the selected frames in strips of strip_rows rows to the strip
+  callback rather than as full frames to the callback of Decode, which then
+  only gets called for failures. Frames are then decoded on the thread
+  calling Decode without a full frame buffer, so the memory used for decoding
+  is proportional to the strip size. The decode mode must be DECODE_FULL.
+  Must be called before the first Decode. */
+  void SetStripCallback(size_t strip_rows, StripCallback callback) {
+    strip_rows_ = strip_rows;
+    strip_callback_ = callback;
+  }
+
  private:
+  // A frame chunk handed to the worker threads. Tasks are reused for later
+  // frames once delivered.
+  struct Task {
+    size_t index = 0;
+    std::vector<uint8_t> chunk;
+    uint16_t* frame = nullptr;
+    bool ok = false;
+    bool done = false;
+    Callback callback;
+    void* payload = nullptr;
+    bool borrow = false;
+  };
+
+  void DecodeInternal(const uint8_t* bytes, size_t size,
+      const Callback& callback, void* payload, bool borrow);
+
+  // Decodes one complete chunk, the size is at least the chunk size. Returns
+  // false if decoding must stop.
+  bool DecodeChunk(const uint8_t* chunk, size_t size, size_t index,
+      const Callback& callback, void* payload, bool borrow);
+
+  // Queues a frame chunk for the worker threads.
+  void QueueChunk(const uint8_t* chunk, size_t size, size_t index,
+      const Callback& callback, void* payload, bool borrow);
+
+  // Decodes a frame chunk according to the decode mode.
+  bool DecodeFrame(const uint8_t* chunk, size_t size, uint16_t* frame,
+      DecodeScratch* scratch) const;
+
+  // Dimensions of the images given to the callback.
+  size_t output_xsize() const {
+    return mode_ == DECODE_PREVIEW ? xsize / 4 : xsize;
+  }
+  size_t output_ysize() const {
+    return mode_ == DECODE_PREVIEW ? ysize / 4 : ysize;
+  }
+
+  // Calls the callbacks of the decoded frames at the front of the pending
+  // frames. Waits for the frames to be decoded until at most max_pending
+  // remain pending, or does not wait if max_pending is SIZE_MAX.
+  void Deliver(size_t max_pending);
+
+  void RunThread();
+
   size_t xsize;
   size_t ysize;
 
   size_t id = 0;
 
   std::vector<uint16_t> delta_frame;
-
-  std::vector<uint8_t> buffer;
+  bool ended_ = false;  // The frame index was reached.
+  bool failed_ = false;
+
+  // Input bytes are decoded in place when a chunk lies entirely in one Decode
+  // call. Only a chunk split over several calls gets gathered in this buffer,
+  // which keeps its capacity so that it stops allocating once it has grown to
+  // the largest chunk size.
+  std::vector<uint8_t> partial_;
+  // Total size of the chunk being gathered in partial_, or 0 if the chunk
+  // header itself is not complete yet.
+  size_t partial_chunk_size_ = 0;
+
+  FrameSelector selector_;
+  DecodeMode mode_ = DECODE_FULL;
+  size_t next_index_ = 0;      // Index of the next frame chunk in the stream.
+  size_t chunk_index_ = 0;     // Index of the frame chunk being gathered.
+  size_t callback_index_ = 0;
+  // Bytes still to skip of an auxiliary chunk or of a frame that is not
+  // selected.
+  size_t skip_ = 0;
+  size_t strip_rows_ = 0;
+  StripCallback strip_callback_;
+  DecodeTarget format_;
+
+  FramePool pool_;
+  DecodeScratch scratch_;
+
+  std::vector<std::thread> threads_;
+  size_t window_;
+  std::mutex m_;
+  std::condition_variable cv_in_;    // for the worker threads
+  std::condition_variable cv_main_;  // for the thread delivering frames
+  std::queue<Task*> q_in_;
+  std::queue<Task*> pending_;  // In stream order, decoded or not.
+  std::vector<std::unique_ptr<Task>> tasks_;
+  std::vector<Task*> free_tasks_;
+  bool finish_ = false;
 };
 
 enum FrameState {
@@ -70,6 +305,51 @@ enum FrameFlags {
   USE_DELTA = 1,
   USE_CG = 2,
   NO_LOW_BYTES = 4,
+  PLANE_SIZES = 8,
+  PREVIEW_PYRAMID = 16,
+};
+
+// Chunk flags values, see the format description.
+#define CHUNK_FRAME 0
+#define CHUNK_DELTA_FRAME 1
+#define CHUNK_FRAME_INDEX 2
+#define CHUNK_AUXILIARY 4
+
+// Auxiliary chunk types
+#define AUX_INDEX_CHECKPOINT 1
+#define AUX_PREVIEW_TRACK 2
+#define AUX_FRAME_CHECKSUM 3
+
+// Size of a frame checksum chunk.
+#define FRAME_CHECKSUM_SIZE 14
+
+// Little endian integers of the file format.
+uint32_t ReadUint32LE(const uint8_t* data);
+void WriteUint32LE(uint32_t value, uint8_t* data);
+uint64_t ReadUint64LE(const uint8_t* data);
+void WriteUint64LE(uint64_t value, uint8_t* data);
+
+// Reads size bytes at offset of the file, retrying short reads. Returns false
+// on errors and at the end of the file.
+bool ReadFully(int fd, size_t offset, size_t size, uint8_t* out);
+
+// Amount of levels of a preview pyramid. Level k has the dimensions of the
+// frame divided by 2^(k + 1), level 1 is the standard 1/4 scale preview.
+#define NUM_PREVIEW_LEVELS 4
+
+// Statistics of a frame, computed by the encoder while splitting the frame and
+// stored in the footer, so that frames can be searched without decoding them.
+// The pixel values are the left aligned 16-bit values that decoders output.
+struct FrameStats {
+  uint16_t min = 0;
+  uint16_t max = 0;
+  uint64_t sum = 0;
+  double mean = 0;  // Only set by the decoder, computed from sum.
+  uint32_t saturated = 0;  // Pixels with all bits of the data set.
+  // Estimated bits per pixel of the predicted high bytes, a measure of how
+  // much the frame differs from its predictions.
+  float entropy = 0;
+  uint32_t compressed_size = 0;  // Size of the frame chunk in the file.
 };
 
 class Frame {
@@ -79,9 +359,14 @@ class Frame {
   uint8_t flags_ = FrameFlags::NONE; // FrameFlags
   uint8_t state_ = FrameState::EMPTY; // FrameState
   int64_t timestamp_;
+  bool preview_pyramid_ = false;
+  bool plane_sizes_ = false;
+  FrameStats stats_;
 
  protected:
   std::vector<uint8_t> preview_;
+  // The previews of the pyramid levels 0, 2 and 3, empty unless enabled.
+  std::vector<uint8_t> pyramid_[3];
   std::vector<uint8_t> high_;
   std::vector<uint8_t> low_;
 
@@ -93,6 +378,11 @@ class Frame {
   uint8_t flags() const { return flags_; }
   uint8_t state() const { return state_; }
   int64_t timestamp() const { return timestamp_; }
+  // Pixel statistics, entropy is set by Predict.
+  const FrameStats& stats() const { return stats_; }
+  // Returns the CRC-32C of the left aligned pixels as little endian 16-bit
+  // values, as output by decoders. Only valid before compressing.
+  uint32_t PixelChecksum() const;
   const std::vector<uint8_t> &high() { return high_; }
   const std::vector<uint8_t> &low() { return low_; }
   const std::vector<uint8_t> &preview() { return preview_; }
@@ -100,6 +390,17 @@ class Frame {
   std::vector<uint8_t> &&MoveOutLow() { return std::move(low_); }
   std::vector<uint8_t> &&MoveOutPreview() { return std::move(preview_); }
 
+  /* Sets whether the 1/2, 1/8 and 1/16 scale previews are generated and
+  output besides the 1/4 scale preview. Must be called before Predict. Only
+  Compress and OutputCore, as used by Encoder, handle the pyramid:
+  CompressPredicted, Uncompress and the clamped gradient unprediction leave
+  it out, so the columnar batch path does not store it. */
+  void SetPreviewPyramid(bool enabled) { preview_pyramid_ = enabled; }
+
+  // Sets whether OutputCore stores the size of the compressed low bytes, see
+  // Encoder::SetPlaneSizes.
+  void SetPlaneSizes(bool enabled) { plane_sizes_ = enabled; }
+
   Frame(size_t xsize = 0, size_t ysize = 0, const uint16_t* image = nullptr,
         int shift_to_left_align = 0, bool big_endian = false, int64_t timestamp = -1);
   Frame(size_t xsize, size_t ysize, const uint8_t* image, int64_t timestamp = -1);
@@ -138,19 +439,226 @@ class Frame {
   
 };
 
-// Rnadom access decoder: requires random access to the entire data file,
+/* Decodes an image from its byte planes compressed separately, as output by
+Frame::CompressPredicted, into the target. flags are the FrameFlags of the
+frame. The low bytes are not read if msb_only is set or if the frame has none.
+delta_frame may be nullptr if the frame is not delta predicted. The scratch is
+optional, it avoids allocating the planes for every image. Also decodes the
+8-bit preview planes, as msb_only with the flags of the frame without
+USE_DELTA. */
+bool DecompressPlanes(const uint16_t* delta_frame, uint8_t flags,
+                      const uint8_t* high, size_t high_size,
+                      const uint8_t* low, size_t low_size,
+                      size_t xsize, size_t ysize, bool msb_only,
+                      const DecodeTarget& target,
+                      DecodeScratch* scratch = nullptr);
+
+// Per-thread state reused between decoded frames and previews.
+struct DecodeContext {
+  DecodeScratch scratch;
+  // Set on the threads of a pool that decodes many frames at once. These
+  // decompress both byte planes of a frame themselves, rather than starting a
+  // thread per frame for the low bytes as SetParallelPlanes asks for.
+  bool worker = false;
+};
+
+// Options for decoding many frames or previews at once.
+struct BatchDecodeOptions {
+  // Amount of worker threads, at least 1.
+  size_t num_threads = 4;
+  // Whether the callback gets the frames in the order of the requested
+  // indices, rather than in the order in which they finish.
+  bool in_order = true;
+  // Maximum amount of memory used for decoded outputs that are not yet
+  // delivered, this limits the amount of frames decoded concurrently. At least
+  // one output is always allowed.
+  size_t max_output_bytes = 256 << 20;
+};
+
+// Throughput of a batch decode.
+struct BatchDecodeStats {
+  size_t frames = 0;
+  size_t compressed_bytes = 0;
+  size_t decoded_bytes = 0;
+  double seconds = 0;
+
+  double FramesPerSecond() const { return seconds > 0 ? frames / seconds : 0; }
+  double DecodedBytesPerSecond() const {
+    return seconds > 0 ? decoded_bytes / seconds : 0;
+  }
+};
+
+// Random access decoder: requires random access to the entire data file,
 // can decode any frame in any order.
 class RandomAccessDecoder {
  public:
+   // Receives one output of DecodeFrames or DecodePreviews. The output is only
+   // valid during the call.
+   typedef std::function<void(bool ok, size_t index, const uint16_t* frame)>
+       FrameCallback;
+   typedef std::function<void(bool ok, size_t index, const uint8_t* preview)>
+       PreviewCallback;
+
+   // Hint for the expected order of DecodeFrame calls on a file opened with
+   // OpenFile, used to choose the madvise readahead behavior of the mapping.
+   enum AccessPattern {
+     RANDOM_ACCESS,      // Frames are decoded in arbitrary order.
+     SEQUENTIAL_ACCESS,  // Frames are decoded mostly in increasing order.
+   };
+
+   RandomAccessDecoder() = default;
+   ~RandomAccessDecoder();
+   RandomAccessDecoder(const RandomAccessDecoder&) = delete;
+   RandomAccessDecoder& operator=(const RandomAccessDecoder&) = delete;
+
    // Parses the header and footer, must be called once with the full data
-   // before using DecodeFrame, xsize, ysize or numframes.
+   // before using DecodeFrame, xsize, ysize or numframes. This does not decode
+   // anything: the frame index is looked up on demand and the delta frame is
+   // decoded by the first DecodeFrame, so opening a file costs the same no
+   // matter how many frames it has.
    bool Init(const uint8_t* data, size_t size);
 
+   // Alternative to Init: memory-maps the file at path and parses the header
+   // and footer from the mapping. Only the pages of the header, the end of the
+   // footer, the parts of the frame index that get looked up and the frames
+   // that are actually decoded get read from disk. The mapping is kept
+   // until the decoder is destroyed or another file is opened.
+   bool OpenFile(const std::string& path,
+                 AccessPattern pattern = RANDOM_ACCESS);
+
+   // Changes the readahead hint of a file opened with OpenFile.
+   void SetAccessPattern(AccessPattern pattern);
+
    // Decodes the frame with the given index. The index must be smaller than
    // numframes. The output frame must have xsize * ysize values.
-   bool DecodeFrame(size_t index, uint16_t* frame) const;
-
-   bool DecodePreview(size_t index, uint8_t* preview) const;
+   // The context is optional, it avoids allocations when decoding many
+   // frames, and may only be used by one thread at a time.
+   bool DecodeFrame(size_t index, uint16_t* frame,
+                    DecodeContext* context = nullptr) const;
+
+   // Like DecodeFrame, but writes the frame in the format of the target.
+   bool DecodeFrame(size_t index, const DecodeTarget& target,
+                    DecodeContext* context = nullptr) const;
+
+   // Like DecodeFrame, but only decodes the 8 most significant bits of each
+   // pixel, the least significant bits are output as 0. Frames that store the
+   // size of their low bytes stream skip decompressing it.
+   bool DecodeFrameMSB(size_t index, uint16_t* frame,
+                       DecodeContext* context = nullptr) const;
+
+   /* Sets whether frames that store the size of their low bytes stream get
+   their low and high bytes decompressed concurrently on two threads, which
+   lowers the latency of decoding a single large frame. Not done for decode
+   contexts of worker threads, which already decode frames concurrently. */
+   void SetParallelPlanes(bool enabled) { parallel_planes_ = enabled; }
+
+   bool DecodePreview(size_t index, uint8_t* preview,
+                      DecodeContext* context = nullptr) const;
+
+   /* Decodes the preview of the given level of the preview pyramid, see
+   NUM_PREVIEW_LEVELS, with preview_xsize(level) * preview_ysize(level)
+   pixels. Level 1 is the preview of DecodePreview and always present, the
+   other levels fail unless the encoder wrote a preview pyramid. */
+   bool DecodePreviewLevel(size_t index, int level, uint8_t* preview,
+                           DecodeContext* context = nullptr) const;
+
+   /* Decodes the frame with the given index in strips of strip_rows rows,
+   which are passed to the callback from top to bottom. Only a few rows of
+   each byte plane and one strip of output are in memory at any time, rather
+   than full frames. */
+   bool DecodeStrips(size_t index, size_t strip_rows, StripCallback callback,
+                     DecodeScratch* scratch = nullptr) const;
+
+   /* Decodes only the rows [y0, y1) of the frame with the given index, for
+   example a region of interest. The output must have (y1 - y0) * xsize
+   values. Decompression stops after the last needed row, so bands near the
+   top of the frame decode fastest. An empty range, y0 == y1, writes nothing
+   and succeeds for a valid index. */
+   bool DecodeRows(size_t index, size_t y0, size_t y1, uint16_t* rows,
+                   DecodeContext* context = nullptr) const;
+
+   /* Decodes the frames with the given indices on a pool of worker threads,
+   each with its own DecodeContext. The callback is called on the calling
+   thread for every frame, in order or as completed depending on the options.
+   Returns false if any frame failed to decode. The stats are optional. */
+   bool DecodeFrames(const std::vector<size_t>& indices,
+                     const BatchDecodeOptions& options, FrameCallback callback,
+                     BatchDecodeStats* stats = nullptr) const;
+
+   // Decodes the frames in the range [begin, end).
+   bool DecodeFrames(size_t begin, size_t end,
+                     const BatchDecodeOptions& options, FrameCallback callback,
+                     BatchDecodeStats* stats = nullptr) const;
+
+   // Like DecodeFrames, but decodes the previews.
+   bool DecodePreviews(const std::vector<size_t>& indices,
+                       const BatchDecodeOptions& options,
+                       PreviewCallback callback,
+                       BatchDecodeStats* stats = nullptr) const;
+
+   bool DecodePreviews(size_t begin, size_t end,
+                       const BatchDecodeOptions& options,
+                       PreviewCallback callback,
+                       BatchDecodeStats* stats = nullptr) const;
+
+   // Returns the byte range of the data that holds the frame with the given
+   // index, without touching the frame bytes themselves. The range may extend
+   // past the end of the frame. Together with DecodeFrameChunk this allows
+   // fetching the frame bytes by other means than the data given to Init.
+   bool FrameRange(size_t index, size_t* offset, size_t* size) const;
+
+   // Returns whether the file has a preview track, which DecodePreview and
+   // DecodePreviews then use rather than the previews in the frames.
+   bool has_preview_track() const { return preview_track_ != nullptr; }
+
+   // Result of VerifyFrame.
+   enum VerifyResult {
+     VERIFY_OK,           // The checksums match.
+     VERIFY_NO_CHECKSUM,  // The frame has no checksum chunk.
+     VERIFY_CORRUPT,      // A checksum mismatches, or decoding failed.
+   };
+
+   /* Checks the CRC-32C of the compressed frame against its checksum chunk,
+   which only reads the frame bytes. If decode is true, also decodes the frame
+   and checks the CRC-32C of the pixels, or only checks that it decodes if the
+   frame has no checksum. May be called from multiple threads with different
+   contexts. */
+   VerifyResult VerifyFrame(size_t index, bool decode,
+                            DecodeContext* context = nullptr) const;
+
+   // Returns whether the footer has the statistics of the frames.
+   bool has_frame_stats() const { return frame_stats_ != nullptr; }
+
+   // Outputs the statistics of a frame, read from the footer without
+   // touching the frame itself.
+   bool GetFrameStats(size_t index, FrameStats* stats) const;
+
+   /* Returns the indices of the frames whose statistics match the predicate,
+   e.g. [](const FrameStats& s) { return s.max > threshold; }. Only reads the
+   statistics table, no frames are decoded. Returns no frames if the file has
+   no statistics. */
+   std::vector<size_t> FindFrames(
+       const std::function<bool(const FrameStats&)>& predicate) const;
+
+   // Returns whether the footer has the timestamps of the frames.
+   bool has_timestamps() const { return timestamp_blocks_ != nullptr; }
+
+   // Outputs the timestamp the frame was encoded with, -1 if it had none.
+   bool GetTimestamp(size_t index, int64_t* timestamp) const;
+
+   /* Outputs the index of the last frame with a timestamp at or before the
+   given time, or of the first frame if all frames are later. Timestamps are in
+   the units given to the encoder, e.g. those of the camera, and must be
+   increasing. Searches the timestamps in the footer without reading frames. */
+   bool FindFrameAtTime(int64_t time, size_t* index) const;
+
+   // Decodes a frame from a copy of its bytes as located by FrameRange.
+   bool DecodeFrameChunk(const uint8_t* chunk, size_t size,
+                         uint16_t* frame,
+                         DecodeContext* context = nullptr) const;
+   bool DecodeFrameChunk(const uint8_t* chunk, size_t size,
+                         const DecodeTarget& target,
+                         DecodeContext* context = nullptr) const;
 
    size_t xsize() const { return xsize_; }
    size_t ysize() const { return ysize_; }
@@ -159,16 +667,138 @@ class RandomAccessDecoder {
    size_t preview_xsize() const { return xsize_ / 4; }
    size_t preview_ysize() const { return ysize_ / 4; }
 
+   // Returns the dimensions of the previews of a preview pyramid level.
+   size_t preview_xsize(int level) const { return xsize_ >> (level + 1); }
+   size_t preview_ysize(int level) const { return ysize_ >> (level + 1); }
+
    // Returns amount of frames in the full file.
-   size_t numframes() const { return frame_offsets.size(); }
+   size_t numframes() const { return num_frames_; }
 
  private:
+  // Looks up the offset of a frame in the frame index.
+  bool FrameOffset(size_t index, size_t* offset) const;
+  // Decodes the delta frame the first time it is needed.
+  bool LoadDeltaFrame() const;
+  // Hints the kernel to read the given byte range of a mapped file ahead.
+  void Prefetch(size_t offset, size_t size) const;
+  void CloseFile();
+
+  // Returns the compressed size of the preview image that DecodePreview reads,
+  // or 0 if the index is invalid.
+  size_t PreviewSize(size_t index) const;
+
+  /* Runs decode for the given indices on worker threads, with outputs of
+  output_size bytes, and calls deliver with them on the calling thread.
+  compressed_size gives the amount of compressed bytes that decode reads for
+  an index, for the stats. */
+  bool DecodeBatch(const std::vector<size_t>& indices,
+      const BatchDecodeOptions& options, size_t output_size,
+      const std::function<bool(size_t index, DecodeContext* context,
+          uint8_t* output)>& decode,
+      const std::function<size_t(size_t index)>& compressed_size,
+      const std::function<void(bool ok, size_t index,
+          const uint8_t* output)>& deliver,
+      BatchDecodeStats* stats) const;
+
   size_t xsize_ = 0;
   size_t ysize_ = 0;
-  std::vector<uint16_t> delta_frame;
-  std::vector<size_t> frame_offsets;
+  size_t num_frames_ = 0;
+
+  mutable std::vector<uint16_t> delta_frame;
+  mutable std::mutex delta_frame_mutex_;
+  mutable std::atomic<bool> delta_frame_loaded_{false};
+  size_t delta_frame_size_ = 0;
+
+  // The frame index, read on demand from the data: either the 8-byte offsets
+  // of an older footer, or the blocks and varint sizes of the two-level index.
+  const uint8_t* frame_offsets_ = nullptr;
+  const uint8_t* index_blocks_ = nullptr;
+  const uint8_t* index_sizes_ = nullptr;
+  size_t index_sizes_size_ = 0;
+  size_t index_block_frames_ = 0;
+  size_t footer_offset_ = 0;
+  // The N + 1 preview offsets of the preview track, or nullptr if none.
+  const uint8_t* preview_track_ = nullptr;
+  // The records of the frame statistics section, or nullptr if none.
+  const uint8_t* frame_stats_ = nullptr;
+  size_t frame_stats_record_size_ = 0;
+  // The blocks and varint deltas of the timestamps section, or nullptr if none.
+  const uint8_t* timestamp_blocks_ = nullptr;
+  const uint8_t* timestamp_deltas_ = nullptr;
+  size_t timestamp_deltas_size_ = 0;
+  size_t timestamp_block_frames_ = 0;
+
   const uint8_t* data_ = nullptr;
   size_t size_ = 0;
+
+  // Memory mapping owned by this decoder if opened with OpenFile.
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  AccessPattern pattern_ = RANDOM_ACCESS;
+  bool parallel_planes_ = false;
+};
+
+// Live decoder: follows a file that is still being written by the encoder.
+// New frames are indexed by only reading their chunk headers as the file grows,
+// and any complete frame can be decoded in any order.
+class LiveDecoder {
+ public:
+  LiveDecoder() = default;
+  ~LiveDecoder();
+  LiveDecoder(const LiveDecoder&) = delete;
+  LiveDecoder& operator=(const LiveDecoder&) = delete;
+
+  // Opens the file to follow, closing the previous one if any. The encoder
+  // does not need to have written the header yet.
+  bool Open(const std::string& path);
+
+  // Stops following the file and forgets its frames.
+  void Close();
+
+  // Indexes the frames that were completely appended since the previous call,
+  // without decompressing them. Returns false if the file is invalid.
+  bool Update();
+
+  /* Waits until at least one new frame is complete, the file is finished or
+  timeout_ms milliseconds have passed, and returns whether there are new
+  frames. Appends are noticed through inotify, with periodic polling as
+  fallback, e.g. for network file systems where inotify is not triggered by
+  other hosts. */
+  bool WaitForFrames(int timeout_ms);
+
+  // Decodes a complete frame. The index must be smaller than numframes.
+  bool DecodeFrame(size_t index, uint16_t* frame);
+
+  bool DecodePreview(size_t index, uint8_t* preview);
+
+  // Returns whether the header and delta frame are available yet, xsize and
+  // ysize are only valid once this is true.
+  bool has_header() const { return !delta_frame.empty(); }
+
+  // Returns whether the encoder finished the file, no more frames will come.
+  bool finished() const { return finished_; }
+
+  size_t xsize() const { return xsize_; }
+  size_t ysize() const { return ysize_; }
+  size_t preview_xsize() const { return xsize_ / 4; }
+  size_t preview_ysize() const { return ysize_ / 4; }
+
+  // Returns the amount of complete frames indexed so far.
+  size_t numframes() const { return frame_offsets.size(); }
+
+ private:
+  bool ReadChunk(size_t index);
+
+  int fd_ = -1;
+  int inotify_fd_ = -1;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  std::vector<uint16_t> delta_frame;
+  std::vector<size_t> frame_offsets;
+  std::vector<uint32_t> frame_sizes;
+  size_t scan_pos_ = 0;  // Start of the first chunk not yet indexed.
+  bool finished_ = false;
+  std::vector<uint8_t> chunk_;  // Reused buffer for reading frames.
 };
 
 // Multithreaded encoder.
@@ -201,6 +831,12 @@ class Encoder {
   called after the last frame was queued.*/
   void CompressFrame(const uint16_t* img, Callback callback, void* payload);
 
+  /* Same as above, but also stores the timestamp of the frame, for example the
+  one of the camera frame, in the footer. Frames compressed without timestamp
+  get -1. The footer only has timestamps if any frame was given one. */
+  void CompressFrame(const uint16_t* img, int64_t timestamp,
+                     Callback callback, void* payload);
+
   /* Waits and finishes all threads, and writes the footer bytes by
   outputting them to the callback. */
   void Finish(Callback callback, void* payload);
@@ -210,23 +846,71 @@ class Encoder {
   amount of worker threads. */
   size_t MaxQueued() const;
 
+  /* Sets after how many frames an index checkpoint listing the offsets of the
+  frames since the previous checkpoint is written, or disables checkpoints if
+  0. Checkpoints allow RecoverFrameIndex to quickly make a file random
+  accessible if Finish never got called. Off by default, since streaming
+  decoders that predate auxiliary chunks can't read such files. Must be called
+  before Init. */
+  void SetCheckpointInterval(size_t num_frames);
+
+  /* Sets whether Finish writes a preview track: a copy of the previews of all
+  frames packed together after the last frame, so that RandomAccessDecoder
+  can read all previews with one sequential read. The compressed previews are
+  kept in a temporary file until Finish. Off by default, the track is stored
+  in auxiliary chunks. Must be called before Init. */
+  void SetPreviewTrack(bool enabled);
+
+  /* Sets whether frames store a preview pyramid: previews at 1/2, 1/8 and 1/16
+  scale besides the 1/4 scale preview, for RandomAccessDecoder::
+  DecodePreviewLevel. Must be called before Init. */
+  void SetPreviewPyramid(bool enabled);
+
+  /* Sets whether every frame is followed by a checksum chunk with the CRC-32C
+  of the frame chunk and of its pixels, for RandomAccessDecoder::VerifyFrame.
+  Off by default, the checksums are stored in auxiliary chunks. Must be called
+  before Init. */
+  void SetFrameChecksums(bool enabled);
+
+  /* Sets whether frames store the size of their compressed low bytes, which
+  lets decoders find the high bytes without decompressing the low bytes:
+  RandomAccessDecoder::DecodeFrameMSB then skips the low bytes,
+  SetParallelPlanes decompresses both at once, and strip and row decoding save
+  a pass over the low bytes. Off by default, since decoders older than this
+  option can't read such frames. Must be called before Init. */
+  void SetPlaneSizes(bool enabled);
+
+  ~Encoder();
+
  private:
   struct Task {
     const uint16_t* frame;
     size_t id;
+    int64_t timestamp;
     Callback callback;
     void* payload;
   };
 
   void RunThread();
 
-  std::vector<uint8_t> RunTask(const Task& task);
+  std::vector<uint8_t> RunTask(const Task& task, FrameStats* stats);
 
   // Finalize a task, unlike RunTask this is guaranteed to run in sequential
   // order and guarded.
-  void FinishTask(const Task& task, std::vector<uint8_t>* compressed);
+  void FinishTask(const Task& task, std::vector<uint8_t>* compressed,
+                  const FrameStats& stats);
+
+  // Writes the footer, with the preview track section if preview_offsets is
+  // not empty, the frame statistics section, and the timestamps section if
+  // frames had timestamps.
+  void WriteFooter(const std::vector<size_t>& preview_offsets,
+                   std::vector<uint8_t>* compressed) const;
+
+  // Outputs the preview track chunks and the offsets of the previews in them.
+  void WritePreviewTrack(Callback callback, void* payload,
+                         std::vector<size_t>* preview_offsets);
 
-  void WriteFrameIndex(std::vector<uint8_t>* compressed) const;
+  void WriteIndexCheckpoint(std::vector<uint8_t>* compressed);
 
   std::vector<std::thread*> threads;
   std::mutex m;
@@ -250,10 +934,48 @@ class Encoder {
   std::vector<size_t> frame_offsets;
   size_t bytes_written = 0;
 
+  size_t checkpoint_interval_ = 0;
+  size_t checkpointed_frames_ = 0;  // Frames listed in checkpoints so far.
+  size_t last_checkpoint_ = 0;  // Offset of the last checkpoint, 0 if none.
+
+  bool preview_track_ = false;
+  bool preview_pyramid_ = false;
+  bool frame_checksums_ = false;
+  bool plane_sizes_ = false;
+  FILE* preview_spool_ = nullptr;  // Compressed previews so far.
+  std::vector<uint32_t> preview_sizes_;
+
+  std::vector<FrameStats> frame_stats_;
+
+  std::vector<int64_t> timestamps_;
+  bool has_timestamps_ = false;
+
   int shift_to_left_align_ = 0;
   bool big_endian_ = false;
 };
 
+/* Appends a footer for frames at the given offsets, with the frame statistics
+and timestamps sections if these are not empty, in which case they must have
+one entry per frame. For writing files out of existing frame chunks, e.g. when
+remuxing: the bytes before the footer must be the header, the delta frame and
+the frame chunks. */
+void AppendFooter(const std::vector<size_t>& frame_offsets,
+                  const std::vector<FrameStats>& frame_stats,
+                  const std::vector<int64_t>& timestamps,
+                  std::vector<uint8_t>* out);
+
+/* Rebuilds the frame index of a file of which the encoder never got to write
+the footer, for example because the encoding process died. Outputs the size to
+which the file must be truncated to drop an incomplete last frame in
+valid_size, and the footer that must be appended after that in footer, which
+indexes num_frames frames. num_frames may be nullptr. Only the header, the
+index checkpoints and the chunk headers of the frames before the first and
+after the last checkpoint are read. If the file is already complete,
+valid_size is the full size and the footer is empty. */
+bool RecoverFrameIndex(const uint8_t* data, size_t size, size_t* valid_size,
+                       std::vector<uint8_t>* footer,
+                       size_t* num_frames = nullptr);
+
 }  // namespace fpvc
 
 #endif  // FUSION_POWER_VIDEO_H_
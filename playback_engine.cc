@@ -0,0 +1,222 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "playback_engine.h"
+
+#include <stdlib.h>
+
+namespace fpvc {
+
+// Steps up to this size between consecutive requests are taken as the
+// playback speed, larger jumps that were not prefetched are seeks.
+#define MAX_PLAYBACK_STEP 16
+
+PlaybackEngine::PlaybackEngine(const RandomAccessDecoder& decoder)
+    : PlaybackEngine(decoder, Options()) {}
+
+PlaybackEngine::PlaybackEngine(const RandomAccessDecoder& decoder,
+                               const Options& options)
+    : decoder_(decoder), options_(options) {
+  for (size_t i = 0; i < options_.num_threads; i++) {
+    threads_.emplace_back(&PlaybackEngine::RunThread, this);
+  }
+}
+
+PlaybackEngine::~PlaybackEngine() {
+  {
+    std::unique_lock<std::mutex> l(m_);
+    finish_ = true;
+  }
+  cv_prefetch_.notify_all();
+  for (std::thread& thread : threads_) thread.join();
+}
+
+PlaybackEngine::FramePtr PlaybackEngine::GetFrame(size_t index) {
+  if (index >= decoder_.numframes()) return nullptr;
+  uint64_t key = Key(index, false);
+
+  std::unique_lock<std::mutex> l(m_);
+  if (!has_last_ || index != last_index_) {
+    int64_t delta = static_cast<int64_t>(index) -
+        static_cast<int64_t>(last_index_);
+    bool planned = false;
+    if (has_last_ && delta % step_ == 0) {
+      // A frame from the planned prefetches, e.g. when the viewer skipped
+      // frames to keep up: continue with the same step.
+      int64_t k = delta / step_;
+      planned = k >= 1 && k <= static_cast<int64_t>(options_.prefetch_frames);
+    }
+    if (!planned && has_last_ && delta != 0 &&
+        llabs(delta) <= MAX_PLAYBACK_STEP) {
+      step_ = delta;
+    }
+    has_last_ = true;
+    last_index_ = index;
+    Plan(index, step_);
+  }
+
+  Entry* entry = Lookup(key);
+  if (!entry && in_flight_.count(index)) {
+    stats_.waits++;
+    cv_decoded_.wait(l, [&] { return !in_flight_.count(index); });
+    entry = Lookup(key);
+    if (entry) return entry->frame;
+  } else if (entry) {
+    stats_.hits++;
+    return entry->frame;
+  }
+
+  stats_.misses++;
+  in_flight_.insert(index);
+  l.unlock();
+  std::shared_ptr<std::vector<uint16_t>> frame(
+      new std::vector<uint16_t>(decoder_.xsize() * decoder_.ysize()));
+  DecodeContext context;
+  bool ok = decoder_.DecodeFrame(index, frame->data(), &context);
+  l.lock();
+  in_flight_.erase(index);
+  cv_decoded_.notify_all();
+  if (!ok) return nullptr;
+  Entry inserted;
+  inserted.frame = frame;
+  inserted.bytes = frame->size() * sizeof(uint16_t);
+  Insert(key, inserted);
+  return frame;
+}
+
+PlaybackEngine::PreviewPtr PlaybackEngine::GetPreview(size_t index) {
+  if (index >= decoder_.numframes()) return nullptr;
+  uint64_t key = Key(index, true);
+  {
+    std::unique_lock<std::mutex> l(m_);
+    Entry* entry = Lookup(key);
+    if (entry) {
+      stats_.hits++;
+      return entry->preview;
+    }
+    stats_.misses++;
+  }
+
+  // Previews are small, so concurrent requests for the same preview just
+  // decode it twice.
+  std::shared_ptr<std::vector<uint8_t>> preview(new std::vector<uint8_t>(
+      decoder_.preview_xsize() * decoder_.preview_ysize()));
+  DecodeContext context;
+  if (!decoder_.DecodePreview(index, preview->data(), &context)) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> l(m_);
+  Entry inserted;
+  inserted.preview = preview;
+  inserted.bytes = preview->size();
+  Insert(key, inserted);
+  return preview;
+}
+
+void PlaybackEngine::Play(size_t index, int64_t step) {
+  std::unique_lock<std::mutex> l(m_);
+  step_ = step ? step : 1;
+  has_last_ = true;
+  last_index_ = index;
+  Plan(index, step_);
+}
+
+void PlaybackEngine::Pause() {
+  std::unique_lock<std::mutex> l(m_);
+  prefetch_.clear();
+}
+
+PlaybackEngine::Stats PlaybackEngine::stats() const {
+  std::unique_lock<std::mutex> l(m_);
+  return stats_;
+}
+
+PlaybackEngine::Entry* PlaybackEngine::Lookup(uint64_t key) {
+  auto it = cache_.find(key);
+  if (it == cache_.end()) return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return &it->second;
+}
+
+void PlaybackEngine::Insert(uint64_t key, Entry entry) {
+  auto it = cache_.find(key);
+  if (it != cache_.end()) {
+    cache_size_ -= it->second.bytes;
+    lru_.erase(it->second.lru);
+    cache_.erase(it);
+  }
+  lru_.push_front(key);
+  entry.lru = lru_.begin();
+  cache_size_ += entry.bytes;
+  cache_[key] = entry;
+
+  // The newest entry is kept even if it alone exceeds the limit.
+  while (cache_size_ > options_.cache_bytes && lru_.size() > 1) {
+    auto evict = cache_.find(lru_.back());
+    cache_size_ -= evict->second.bytes;
+    cache_.erase(evict);
+    lru_.pop_back();
+    stats_.evicted++;
+  }
+}
+
+void PlaybackEngine::Plan(size_t index, int64_t step) {
+  // Anything still queued belongs to the previous position or direction.
+  prefetch_.clear();
+  if (threads_.empty()) return;
+  int64_t numframes = decoder_.numframes();
+  for (size_t k = 1; k <= options_.prefetch_frames; k++) {
+    int64_t next = static_cast<int64_t>(index) + static_cast<int64_t>(k) * step;
+    if (next < 0 || next >= numframes) break;
+    if (cache_.count(Key(next, false)) || in_flight_.count(next)) continue;
+    prefetch_.push_back(next);
+  }
+  cv_prefetch_.notify_all();
+}
+
+void PlaybackEngine::RunThread() {
+  DecodeContext context;
+  context.worker = true;
+  for (;;) {
+    size_t index;
+    {
+      std::unique_lock<std::mutex> l(m_);
+      cv_prefetch_.wait(l, [this] { return finish_ || !prefetch_.empty(); });
+      if (finish_) return;
+      index = prefetch_.front();
+      prefetch_.pop_front();
+      if (cache_.count(Key(index, false)) || in_flight_.count(index)) continue;
+      in_flight_.insert(index);
+    }
+
+    std::shared_ptr<std::vector<uint16_t>> frame(
+        new std::vector<uint16_t>(decoder_.xsize() * decoder_.ysize()));
+    bool ok = decoder_.DecodeFrame(index, frame->data(), &context);
+
+    {
+      std::unique_lock<std::mutex> l(m_);
+      in_flight_.erase(index);
+      if (ok) {
+        Entry inserted;
+        inserted.frame = frame;
+        inserted.bytes = frame->size() * sizeof(uint16_t);
+        Insert(Key(index, false), inserted);
+        stats_.prefetched++;
+      }
+    }
+    cv_decoded_.notify_all();
+  }
+}
+
+}  // namespace fpvc
@@ -0,0 +1,146 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FPV_PLAYBACK_ENGINE_H_
+#define FPV_PLAYBACK_ENGINE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "fusion_power_video.h"
+
+namespace fpvc {
+
+/* Serves frames and previews for interactive playback and scrubbing. Decoded
+frames and previews are kept in an LRU cache bounded in bytes, so that going
+back and forth does not decode the same frames again. The engine follows the
+direction and step size of the requested frames, and decodes the frames that
+will be requested next ahead of time on background threads. On a seek, the
+prefetches that are still queued for the old position are dropped. */
+class PlaybackEngine {
+ public:
+  struct Options {
+    // Amount of background threads decoding frames ahead, 0 disables
+    // prefetching.
+    size_t num_threads = 2;
+    // Amount of frames to decode ahead of the current frame.
+    size_t prefetch_frames = 8;
+    // Maximum memory used by the cached frames and previews. Frames still held
+    // by the caller are not counted once evicted.
+    size_t cache_bytes = 512 << 20;
+  };
+
+  // Usage statistics, e.g. to tune the options.
+  struct Stats {
+    size_t hits = 0;      // Requests served from the cache.
+    size_t waits = 0;     // Requests that waited for a prefetch in progress.
+    size_t misses = 0;    // Requests decoded on the calling thread.
+    size_t prefetched = 0;
+    size_t evicted = 0;
+  };
+
+  typedef std::shared_ptr<const std::vector<uint16_t>> FramePtr;
+  typedef std::shared_ptr<const std::vector<uint8_t>> PreviewPtr;
+
+  // The decoder must be initialized and outlive the engine.
+  explicit PlaybackEngine(const RandomAccessDecoder& decoder);
+  PlaybackEngine(const RandomAccessDecoder& decoder, const Options& options);
+  ~PlaybackEngine();
+
+  PlaybackEngine(const PlaybackEngine&) = delete;
+  PlaybackEngine& operator=(const PlaybackEngine&) = delete;
+
+  /* Returns the decoded frame with the given index, or nullptr if decoding
+  failed. The frame stays valid as long as the returned pointer is held, even
+  if it gets evicted from the cache. Consecutive calls determine the playback
+  direction and speed: requesting index + step after index continues playback
+  with that step, anything else is treated as a seek. */
+  FramePtr GetFrame(size_t index);
+
+  // Returns the decoded preview with the given index, or nullptr if decoding
+  // failed. Previews are cached but not prefetched. GetFrame and GetPreview may
+  // be called from multiple threads.
+  PreviewPtr GetPreview(size_t index);
+
+  /* Sets the playback direction and speed explicitly, for example when the
+  user presses play: frames index + step, index + 2 * step, ... will be
+  prefetched after the frame at index. A negative step plays backwards. */
+  void Play(size_t index, int64_t step);
+
+  // Stops prefetching until the next GetFrame or Play, e.g. when pausing.
+  void Pause();
+
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    FramePtr frame;
+    PreviewPtr preview;
+    size_t bytes = 0;
+    std::list<uint64_t>::iterator lru;  // Position in lru_.
+  };
+
+  // Cache key of the frame or the preview with the given index.
+  static uint64_t Key(size_t index, bool preview) {
+    return (static_cast<uint64_t>(index) << 1) | (preview ? 1 : 0);
+  }
+
+  // Looks up an entry and marks it as most recently used, must be called with
+  // m_ held.
+  Entry* Lookup(uint64_t key);
+  // Adds an entry and evicts the least recently used ones over the byte
+  // limit, must be called with m_ held.
+  void Insert(uint64_t key, Entry entry);
+  // Replaces the queued prefetches by the frames after index, must be called
+  // with m_ held.
+  void Plan(size_t index, int64_t step);
+
+  void RunThread();
+
+  const RandomAccessDecoder& decoder_;
+  Options options_;
+
+  mutable std::mutex m_;
+  std::condition_variable cv_prefetch_;  // for the background threads
+  std::condition_variable cv_decoded_;   // for requests waiting on prefetches
+
+  std::unordered_map<uint64_t, Entry> cache_;
+  std::list<uint64_t> lru_;  // Most recently used first.
+  size_t cache_size_ = 0;    // Bytes of the cached entries.
+
+  std::deque<size_t> prefetch_;            // Frames to decode ahead.
+  std::unordered_set<size_t> in_flight_;   // Frames being decoded.
+
+  bool has_last_ = false;
+  size_t last_index_ = 0;
+  int64_t step_ = 1;
+
+  Stats stats_;
+
+  std::vector<std::thread> threads_;
+  bool finish_ = false;
+};
+
+}  // namespace fpvc
+
+#endif  // FPV_PLAYBACK_ENGINE_H_
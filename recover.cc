@@ -0,0 +1,81 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Makes a file that the encoder never finished random accessible again, by
+// dropping an incomplete last frame and appending a rebuilt frame index.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "fusion_power_video.h"
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " file\n"
+              << "    file: fusion power video file to repair in place\n"
+              << std::endl;
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDWR);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "couldn't open " << argv[1] << std::endl;
+    return 1;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    std::cerr << "empty file" << std::endl;
+    return 1;
+  }
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "couldn't map " << argv[1] << std::endl;
+    return 1;
+  }
+  // Only the pages with the chunk headers and checkpoints get read.
+  madvise(mapping, size, MADV_RANDOM);
+
+  size_t valid_size;
+  size_t num_frames;
+  std::vector<uint8_t> footer;
+  bool ok = fpvc::RecoverFrameIndex(static_cast<const uint8_t*>(mapping), size,
+                                    &valid_size, &footer, &num_frames);
+  munmap(mapping, size);
+  if (!ok) {
+    std::cerr << "couldn't recover " << argv[1] << std::endl;
+    return 1;
+  }
+  if (footer.empty()) {
+    std::cerr << "file is already complete" << std::endl;
+    return 0;
+  }
+
+  if (ftruncate(fd, valid_size) != 0 ||
+      pwrite(fd, footer.data(), footer.size(), valid_size) !=
+          static_cast<ssize_t>(footer.size()) ||
+      fsync(fd) != 0) {
+    std::cerr << "couldn't write frame index" << std::endl;
+    return 1;
+  }
+  close(fd);
+
+  std::cerr << "dropped " << (size - valid_size) << " bytes, indexed "
+            << num_frames << " frames" << std::endl;
+  return 0;
+}
@@ -0,0 +1,171 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reduction_engine.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "simd_kernels.h"
+
+namespace fpvc {
+
+void PixelStatsReducer::Init(size_t xsize, size_t ysize, size_t /*begin*/,
+                             size_t /*end*/) {
+  size_t n = xsize * ysize;
+  count_ = 0;
+  sum_.assign(n, 0);
+  sum_squares_.assign(n, 0);
+  min_.assign(n, 65535);
+  max_.assign(n, 0);
+}
+
+std::unique_ptr<Reducer> PixelStatsReducer::Clone() const {
+  return std::unique_ptr<Reducer>(new PixelStatsReducer(*this));
+}
+
+void PixelStatsReducer::Add(size_t /*index*/, const uint16_t* frame) {
+  AccumulateMoments16(frame, sum_.size(), sum_.data(), sum_squares_.data());
+  AccumulateMinMax16(frame, min_.size(), min_.data(), max_.data());
+  count_++;
+}
+
+void PixelStatsReducer::Merge(const Reducer& other) {
+  const PixelStatsReducer& o = static_cast<const PixelStatsReducer&>(other);
+  if (!o.count_) return;
+  count_ += o.count_;
+  for (size_t i = 0; i < sum_.size(); i++) {
+    sum_[i] += o.sum_[i];
+    sum_squares_[i] += o.sum_squares_[i];
+  }
+  // Every minimum of other is at most its maximum, so folding in both as if
+  // they were frames gives the combined minimum and maximum.
+  AccumulateMinMax16(o.min_.data(), min_.size(), min_.data(), max_.data());
+  AccumulateMinMax16(o.max_.data(), max_.size(), min_.data(), max_.data());
+}
+
+void PixelStatsReducer::Mean(std::vector<double>* mean) const {
+  mean->assign(sum_.size(), 0);
+  if (!count_) return;
+  for (size_t i = 0; i < sum_.size(); i++) {
+    (*mean)[i] = static_cast<double>(sum_[i]) / count_;
+  }
+}
+
+void PixelStatsReducer::StdDev(std::vector<double>* stddev) const {
+  stddev->assign(sum_.size(), 0);
+  if (!count_) return;
+  for (size_t i = 0; i < sum_.size(); i++) {
+    double mean = static_cast<double>(sum_[i]) / count_;
+    double variance = static_cast<double>(sum_squares_[i]) / count_ -
+        mean * mean;
+    (*stddev)[i] = variance > 0 ? sqrt(variance) : 0;
+  }
+}
+
+RoiSumReducer::RoiSumReducer(size_t x0, size_t y0, size_t width,
+                             size_t height)
+    : x0_(x0), y0_(y0), width_(width), height_(height) {}
+
+void RoiSumReducer::Init(size_t xsize, size_t ysize, size_t begin,
+                         size_t end) {
+  x0_ = std::min(x0_, xsize);
+  y0_ = std::min(y0_, ysize);
+  width_ = std::min(width_, xsize - x0_);
+  height_ = std::min(height_, ysize - y0_);
+  xsize_ = xsize;
+  begin_ = begin;
+  sums_.assign(end > begin ? end - begin : 0, 0);
+}
+
+std::unique_ptr<Reducer> RoiSumReducer::Clone() const {
+  return std::unique_ptr<Reducer>(new RoiSumReducer(*this));
+}
+
+void RoiSumReducer::Add(size_t index, const uint16_t* frame) {
+  uint64_t sum = 0;
+  for (size_t y = y0_; y < y0_ + height_; y++) {
+    sum += Sum16(frame + y * xsize_ + x0_, width_);
+  }
+  sums_[index - begin_] = sum;
+}
+
+void RoiSumReducer::Merge(const Reducer& other) {
+  // Every frame is added to exactly one clone, the others keep it at 0.
+  const RoiSumReducer& o = static_cast<const RoiSumReducer&>(other);
+  for (size_t i = 0; i < sums_.size(); i++) sums_[i] += o.sums_[i];
+}
+
+bool ReduceFrames(const RandomAccessDecoder& decoder, size_t begin, size_t end,
+                  Reducer* reducer, const ReduceOptions& options,
+                  BatchDecodeStats* stats) {
+  auto start = std::chrono::steady_clock::now();
+  end = std::min(end, decoder.numframes());
+  begin = std::min(begin, end);
+  size_t n = end - begin;
+  size_t xsize = decoder.xsize();
+  size_t ysize = decoder.ysize();
+  reducer->Init(xsize, ysize, begin, end);
+
+  size_t num_threads = std::max<size_t>(1, options.num_threads);
+  num_threads = std::min(num_threads, std::max<size_t>(1, n));
+  std::vector<std::unique_ptr<Reducer>> clones(num_threads);
+  for (size_t i = 0; i < num_threads; i++) clones[i] = reducer->Clone();
+
+  // Frames are taken in increasing order, so the threads together read the
+  // file close to sequentially.
+  std::atomic<size_t> next{begin};
+  std::atomic<bool> ok{true};
+  std::atomic<size_t> compressed_bytes{0};
+  auto run_thread = [&](Reducer* clone) {
+    DecodeContext context;
+    context.worker = true;
+    std::vector<uint16_t> frame(xsize * ysize);
+    for (;;) {
+      size_t index = next++;
+      if (index >= end) return;
+      if (!decoder.DecodeFrame(index, frame.data(), &context)) {
+        ok = false;
+        continue;
+      }
+      clone->Add(index, frame.data());
+      size_t offset, size;
+      if (decoder.FrameRange(index, &offset, &size)) compressed_bytes += size;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(run_thread, clones[i].get());
+  }
+  run_thread(clones[0].get());
+  for (std::thread& thread : threads) thread.join();
+
+  for (const std::unique_ptr<Reducer>& clone : clones) reducer->Merge(*clone);
+
+  if (stats) {
+    stats->frames = n;
+    stats->compressed_bytes = compressed_bytes;
+    stats->decoded_bytes = n * xsize * ysize * sizeof(uint16_t);
+    stats->seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+  return ok;
+}
+
+}  // namespace fpvc
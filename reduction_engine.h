@@ -0,0 +1,112 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FPV_REDUCTION_ENGINE_H_
+#define FPV_REDUCTION_ENGINE_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "fusion_power_video.h"
+
+namespace fpvc {
+
+/* Folds decoded frames into a result, such as a per-pixel mean image or the
+intensity of a region per frame. ReduceFrames gives every thread its own clone
+of the reducer, adds each frame to one of the clones in any order, and finally
+merges the clones into the original reducer, which then holds the result. */
+class Reducer {
+ public:
+  virtual ~Reducer() = default;
+
+  // Called on the original reducer before the clones are made, with the
+  // frame dimensions and the range [begin, end) of frames that get reduced.
+  virtual void Init(size_t xsize, size_t ysize, size_t begin, size_t end) = 0;
+
+  // Returns a new reducer with the settings and the initial state of this
+  // one, to be used by one thread.
+  virtual std::unique_ptr<Reducer> Clone() const = 0;
+
+  // Folds in the decoded frame with the given index.
+  virtual void Add(size_t index, const uint16_t* frame) = 0;
+
+  // Folds in the state of a clone of this reducer.
+  virtual void Merge(const Reducer& other) = 0;
+};
+
+// Per-pixel statistics over all reduced frames.
+class PixelStatsReducer : public Reducer {
+ public:
+  void Init(size_t xsize, size_t ysize, size_t begin, size_t end) override;
+  std::unique_ptr<Reducer> Clone() const override;
+  void Add(size_t index, const uint16_t* frame) override;
+  void Merge(const Reducer& other) override;
+
+  size_t count() const { return count_; }
+  const std::vector<uint16_t>& min() const { return min_; }
+  const std::vector<uint16_t>& max() const { return max_; }
+  // Outputs the mean and the population standard deviation per pixel.
+  void Mean(std::vector<double>* mean) const;
+  void StdDev(std::vector<double>* stddev) const;
+
+ private:
+  size_t count_ = 0;
+  std::vector<uint64_t> sum_;
+  std::vector<uint64_t> sum_squares_;
+  std::vector<uint16_t> min_;
+  std::vector<uint16_t> max_;
+};
+
+// The sum of the pixels inside a rectangle per frame, e.g. the integrated
+// intensity of a region of interest as a time series.
+class RoiSumReducer : public Reducer {
+ public:
+  // The rectangle is clipped to the frame.
+  RoiSumReducer(size_t x0, size_t y0, size_t width, size_t height);
+
+  void Init(size_t xsize, size_t ysize, size_t begin, size_t end) override;
+  std::unique_ptr<Reducer> Clone() const override;
+  void Add(size_t index, const uint16_t* frame) override;
+  void Merge(const Reducer& other) override;
+
+  // The sum per frame, the first being that of frame begin.
+  const std::vector<uint64_t>& sums() const { return sums_; }
+
+ private:
+  size_t x0_, y0_, width_, height_;
+  size_t xsize_ = 0;
+  size_t begin_ = 0;
+  std::vector<uint64_t> sums_;
+};
+
+struct ReduceOptions {
+  // Amount of threads that each decode frames and fold them into their own
+  // clone of the reducer, at least 1. Every thread holds one decoded frame.
+  size_t num_threads = 4;
+};
+
+/* Decodes the frames [begin, end) of the decoder on multiple threads and
+reduces them with the reducer, see Reducer. The reducers run concurrently on
+different clones, so they must not share mutable state. Returns false if a
+frame failed to decode, in which case the result is incomplete. Optionally
+outputs the decode throughput. */
+bool ReduceFrames(const RandomAccessDecoder& decoder, size_t begin, size_t end,
+                  Reducer* reducer, const ReduceOptions& options = {},
+                  BatchDecodeStats* stats = nullptr);
+
+}  // namespace fpvc
+
+#endif  // FPV_REDUCTION_ENGINE_H_
@@ -0,0 +1,93 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Concatenates, trims or decimates fusion power video files by copying the
+// compressed frames, without decoding and encoding them again.
+
+#include <iostream>
+#include <sstream>
+
+#include "remuxer.h"
+
+template <typename T>
+T Parse(const std::string& s) {
+  T result = 0;
+  std::istringstream sstream(s);
+  sstream >> result;
+  return result;
+}
+
+int Usage(const char* name) {
+  std::cerr << "Usage: " << name << " trim infile outfile begin end\n"
+            << "       " << name << " trimtime infile outfile t0 t1\n"
+            << "       " << name << " decimate infile outfile step\n"
+            << "       " << name << " concat outfile infile...\n"
+            << "    trim: keeps the frames [begin, end)\n"
+            << "    trimtime: keeps the frames shown during the time range"
+            << " [t0, t1), in the units of the timestamps of the file\n"
+            << "    decimate: keeps every step-th frame\n"
+            << "    concat: appends the frames of all input files, which must"
+            << " have been encoded with the same dimensions and delta frame\n"
+            << std::endl;
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) return Usage(argv[0]);
+  std::string command = argv[1];
+  std::vector<fpvc::RemuxInput> inputs;
+  std::string output;
+
+  if (command == "concat" && argc >= 4) {
+    output = argv[2];
+    for (int i = 3; i < argc; i++) inputs.push_back({argv[i], {}});
+  } else if ((command == "trim" && argc == 6) ||
+             (command == "trimtime" && argc == 6) ||
+             (command == "decimate" && argc == 5)) {
+    output = argv[3];
+    fpvc::RandomAccessDecoder decoder;
+    if (!decoder.OpenFile(argv[2])) {
+      std::cerr << "couldn't open " << argv[2] << std::endl;
+      return 1;
+    }
+    inputs.push_back({argv[2], {}});
+    std::vector<size_t>* frames = &inputs.back().frames;
+    if (command == "trim") {
+      size_t end = std::min(Parse<size_t>(argv[5]), decoder.numframes());
+      fpvc::SelectFrames(Parse<size_t>(argv[4]), end, 1, frames);
+    } else if (command == "trimtime") {
+      if (!fpvc::SelectTimeRange(decoder, Parse<int64_t>(argv[4]),
+                                 Parse<int64_t>(argv[5]), frames)) {
+        std::cerr << argv[2] << " has no timestamps" << std::endl;
+        return 1;
+      }
+    } else {
+      fpvc::SelectFrames(0, decoder.numframes(), Parse<size_t>(argv[4]),
+                         frames);
+    }
+    // An empty selection would copy all frames.
+    if (frames->empty()) {
+      std::cerr << "no frames selected" << std::endl;
+      return 1;
+    }
+  } else {
+    return Usage(argv[0]);
+  }
+
+  if (!fpvc::Remux(inputs, output)) {
+    std::cerr << "couldn't remux to " << output << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,236 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "remuxer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace fpvc {
+
+namespace {
+
+// Buffer size of the copy when copy_file_range isn't available.
+#define REMUX_COPY_BUFFER_SIZE (4 << 20)
+
+bool WriteFully(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t r = write(fd, data, size);
+    if (r <= 0) return false;
+    data += r;
+    size -= r;
+  }
+  return true;
+}
+
+// Copies size bytes at offset of in to the current position of out. Uses
+// copy_file_range, which lets the kernel or filesystem share or copy the data
+// without passing it through user space, and falls back to buffered reads and
+// writes where it isn't supported, e.g. between different filesystems.
+bool CopyRange(int in, size_t offset, size_t size, int out, bool* use_kernel,
+               std::vector<uint8_t>* buffer) {
+  while (size > 0 && *use_kernel) {
+    loff_t in_offset = offset;
+    ssize_t r = copy_file_range(in, &in_offset, out, nullptr, size, 0);
+    if (r > 0) {
+      offset += r;
+      size -= r;
+    } else if (r < 0 && (errno == EXDEV || errno == ENOSYS ||
+                         errno == EINVAL || errno == EOPNOTSUPP)) {
+      *use_kernel = false;
+    } else {
+      return false;
+    }
+  }
+  if (size > 0) buffer->resize(REMUX_COPY_BUFFER_SIZE);
+  while (size > 0) {
+    size_t n = std::min<size_t>(size, buffer->size());
+    if (!ReadFully(in, offset, n, buffer->data())) return false;
+    if (!WriteFully(out, buffer->data(), n)) return false;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+struct Source {
+  RandomAccessDecoder decoder;
+  int fd = -1;
+  // The header and the delta frame chunk.
+  std::vector<uint8_t> header;
+
+  ~Source() {
+    if (fd >= 0) close(fd);
+  }
+};
+
+bool OpenSource(const std::string& path, Source* source) {
+  if (!source->decoder.OpenFile(
+          path, RandomAccessDecoder::SEQUENTIAL_ACCESS)) {
+    return false;
+  }
+  source->fd = open(path.c_str(), O_RDONLY);
+  if (source->fd < 0) return false;
+  uint8_t header[12];
+  if (!ReadFully(source->fd, 0, 12, header)) return false;
+  size_t size = 8 + ReadUint32LE(header + 8);
+  source->header.resize(size);
+  return ReadFully(source->fd, 0, size, source->header.data());
+}
+
+// Outputs the range of the frame chunk and of the checksum chunk that follows
+// it, if any, leaving out other auxiliary chunks up to the next frame.
+bool FrameChunkRange(const Source& source, size_t index, size_t* offset,
+                     size_t* size) {
+  size_t range;
+  if (!source.decoder.FrameRange(index, offset, &range)) return false;
+  uint8_t chunk[10];
+  size_t read = std::min<size_t>(range, 10);
+  if (read < 4 || !ReadFully(source.fd, *offset, read, chunk)) return false;
+  size_t frame_size = ReadUint32LE(chunk);
+  if (frame_size < 5 || frame_size > range) return false;
+  *size = frame_size;
+  if (frame_size + FRAME_CHECKSUM_SIZE <= range) {
+    uint8_t aux[6];
+    if (!ReadFully(source.fd, *offset + frame_size, 6, aux)) return false;
+    if (ReadUint32LE(aux) == FRAME_CHECKSUM_SIZE &&
+        aux[4] == CHUNK_AUXILIARY &&
+        aux[5] == AUX_FRAME_CHECKSUM) {
+      *size += FRAME_CHECKSUM_SIZE;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool Remux(const std::vector<RemuxInput>& inputs, const std::string& output) {
+  if (inputs.empty()) return false;
+  std::vector<Source> sources(inputs.size());
+  bool has_stats = true;
+  bool has_timestamps = true;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!OpenSource(inputs[i].path, &sources[i])) return false;
+    // Frames are coded relative to the delta frame, so it must be the same.
+    if (sources[i].header != sources[0].header) return false;
+    for (size_t index : inputs[i].frames) {
+      if (index >= sources[i].decoder.numframes()) return false;
+    }
+    has_stats &= sources[i].decoder.has_frame_stats();
+    has_timestamps &= sources[i].decoder.has_timestamps();
+  }
+
+  int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) return false;
+  bool ok = WriteFully(out, sources[0].header.data(),
+                       sources[0].header.size());
+  size_t position = sources[0].header.size();
+  std::vector<size_t> offsets;
+  std::vector<FrameStats> stats;
+  std::vector<int64_t> timestamps;
+  bool use_kernel = true;
+  std::vector<uint8_t> buffer;
+
+  for (size_t i = 0; ok && i < inputs.size(); i++) {
+    const Source& source = sources[i];
+    std::vector<size_t> all;
+    const std::vector<size_t>* frames = &inputs[i].frames;
+    if (frames->empty()) {
+      SelectFrames(0, source.decoder.numframes(), 1, &all);
+      frames = &all;
+    }
+    // Chunks that directly follow each other in the input are copied at once.
+    size_t run_offset = 0, run_size = 0;
+    for (size_t index : *frames) {
+      size_t offset, size;
+      if (!FrameChunkRange(source, index, &offset, &size)) {
+        ok = false;
+        break;
+      }
+      if (run_size && offset != run_offset + run_size) {
+        ok = CopyRange(source.fd, run_offset, run_size, out, &use_kernel,
+                       &buffer);
+        if (!ok) break;
+        run_size = 0;
+      }
+      if (!run_size) run_offset = offset;
+      run_size += size;
+      offsets.push_back(position);
+      position += size;
+      if (has_stats) {
+        stats.emplace_back();
+        ok &= source.decoder.GetFrameStats(index, &stats.back());
+      }
+      if (has_timestamps) {
+        timestamps.emplace_back();
+        ok &= source.decoder.GetTimestamp(index, &timestamps.back());
+      }
+    }
+    if (ok && run_size) {
+      ok = CopyRange(source.fd, run_offset, run_size, out, &use_kernel,
+                     &buffer);
+    }
+  }
+
+  // Timestamps of concatenated inputs may restart, but must increase to be
+  // searchable.
+  for (size_t i = 1; i < timestamps.size(); i++) {
+    if (timestamps[i] < timestamps[i - 1]) {
+      timestamps.clear();
+      break;
+    }
+  }
+
+  if (ok) {
+    std::vector<uint8_t> footer;
+    AppendFooter(offsets, stats, timestamps, &footer);
+    ok = WriteFully(out, footer.data(), footer.size());
+  }
+  ok &= close(out) == 0;
+  if (!ok) unlink(output.c_str());
+  return ok;
+}
+
+void SelectFrames(size_t begin, size_t end, size_t step,
+                  std::vector<size_t>* frames) {
+  frames->clear();
+  if (step == 0) step = 1;
+  for (size_t i = begin; i < end; i += step) frames->push_back(i);
+}
+
+bool SelectTimeRange(const RandomAccessDecoder& decoder, int64_t t0,
+                     int64_t t1, std::vector<size_t>* frames) {
+  frames->clear();
+  if (decoder.numframes() == 0) return true;
+  // The frame shown at t0, or the first frame if t0 is before all frames.
+  size_t begin, end;
+  int64_t first, last;
+  if (!decoder.FindFrameAtTime(t0, &begin) ||
+      !decoder.FindFrameAtTime(t1, &end) ||
+      !decoder.GetTimestamp(begin, &first) ||
+      !decoder.GetTimestamp(end, &last)) {
+    return false;
+  }
+  if (first >= t1) return true;
+  // Frame end is only shown during the range if it starts before t1.
+  if (last < t1) end++;
+  SelectFrames(begin, end, 1, frames);
+  return true;
+}
+
+}  // namespace fpvc
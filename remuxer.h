@@ -0,0 +1,57 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FPV_REMUXER_H_
+#define FPV_REMUXER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "fusion_power_video.h"
+
+namespace fpvc {
+
+// Frames of one input file of Remux.
+struct RemuxInput {
+  std::string path;
+  // Indices of the frames to copy, in output order. Empty copies all frames.
+  std::vector<size_t> frames;
+};
+
+/* Writes a new file with the selected frames of the inputs one after another,
+by copying their compressed chunks without decoding them, which is possible
+since frames only depend on the delta frame. All inputs must have the same
+dimensions and the same delta frame. The checksum chunks of the frames are
+copied along, and the frame statistics and timestamps are kept if all inputs
+have them, the timestamps only if they stay increasing. The preview track and
+index checkpoints are not copied. The chunks are copied with copy_file_range
+where the filesystem supports it, and with large sequential reads and writes
+otherwise. */
+bool Remux(const std::vector<RemuxInput>& inputs, const std::string& output);
+
+// Outputs the indices of the frames [begin, end) of which every step-th frame
+// is kept, e.g. for trimming and decimating.
+void SelectFrames(size_t begin, size_t end, size_t step,
+                  std::vector<size_t>* frames);
+
+// Outputs the indices of the frames shown during the time range [t0, t1), of
+// a decoder that has timestamps, see RandomAccessDecoder::FindFrameAtTime.
+bool SelectTimeRange(const RandomAccessDecoder& decoder, int64_t t0,
+                     int64_t t1, std::vector<size_t>* frames);
+
+}  // namespace fpvc
+
+#endif  // FPV_REMUXER_H_
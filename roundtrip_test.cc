@@ -0,0 +1,1139 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Encodes synthetic frames and checks that the decoders and tools give them
+// back, for the optional sections of the file format.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_frame_reader.h"
+#include "fusion_power_video.h"
+#include "playback_engine.h"
+#include "reduction_engine.h"
+#include "remuxer.h"
+#include "timeseries_cache.h"
+
+namespace {
+
+// Multiples of 16: the encoder reads past the preview of other sizes, and 16
+// is the scale of the smallest level of the preview pyramid.
+const size_t kXsize = 112;
+const size_t kYsize = 80;
+const size_t kNumPixels = kXsize * kYsize;
+// The frames are 12-bit, left aligned by the encoder.
+const int kShift = 4;
+// Timestamps of the frames, in microseconds.
+const int64_t kStartTime = 1000000;
+const int64_t kFrameTime = 40;
+
+size_t failures = 0;
+std::vector<std::string> temp_files;
+
+void Expect(bool ok, const std::string& what) {
+  if (ok) return;
+  std::cout << "failed: " << what << std::endl;
+  failures++;
+}
+
+// Returns num_frames frames of a moving gradient with noise.
+std::vector<uint16_t> MakeFrames(size_t num_frames) {
+  std::vector<uint16_t> frames(num_frames * kNumPixels);
+  srand(1);
+  for (size_t i = 0; i < num_frames; i++) {
+    for (size_t y = 0; y < kYsize; y++) {
+      for (size_t x = 0; x < kXsize; x++) {
+        frames[i * kNumPixels + y * kXsize + x] =
+            (x * 20 + y * 10 + i * 30 + (rand() & 15)) & 4095;
+      }
+    }
+  }
+  return frames;
+}
+
+// Encodes the frames, after configure got to change the encoder settings,
+// with the timestamps kStartTime + i * kFrameTime if timestamps is set.
+std::vector<uint8_t> Encode(const std::vector<uint16_t>& frames,
+                            std::function<void(fpvc::Encoder*)> configure =
+                                nullptr,
+                            bool timestamps = false) {
+  std::vector<uint8_t> file;
+  auto callback = [&file](const uint8_t* data, size_t size, void*) {
+    file.insert(file.end(), data, data + size);
+  };
+  fpvc::Encoder encoder(2, kShift, false);
+  if (configure) configure(&encoder);
+  encoder.Init(frames.data(), kXsize, kYsize, callback, nullptr);
+  for (size_t i = 0; i < frames.size() / kNumPixels; i++) {
+    encoder.CompressFrame(frames.data() + i * kNumPixels,
+                          timestamps ? kStartTime + i * kFrameTime : -1,
+                          callback, nullptr);
+  }
+  encoder.Finish(callback, nullptr);
+  return file;
+}
+
+// Writes the data to a new temporary file, removed at exit, and returns its
+// path.
+std::string WriteTempFile(const std::vector<uint8_t>& data) {
+  char path[] = "/tmp/roundtrip_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return "";
+  close(fd);
+  temp_files.push_back(path);
+  std::ofstream out(path, std::ios::binary);
+  out.write(reinterpret_cast<const char*>(data.data()), data.size());
+  return path;
+}
+
+// Returns whether the decoded frame is the left aligned input frame.
+bool SameFrame(const uint16_t* expected, const uint16_t* decoded) {
+  for (size_t i = 0; i < kNumPixels; i++) {
+    if (decoded[i] != expected[i] << kShift) return false;
+  }
+  return true;
+}
+
+void TestFrameRange() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames, [](fpvc::Encoder* encoder) {
+    encoder->SetPreviewTrack(true);
+    encoder->SetFrameChecksums(true);
+  });
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "frame range init");
+  Expect(decoder.has_preview_track(), "frame range preview track");
+  for (size_t i = 0; i < decoder.numframes(); i++) {
+    size_t offset, size;
+    Expect(decoder.FrameRange(i, &offset, &size), "frame range");
+    // The frame chunk and its checksum chunk, but not the preview track.
+    size_t chunk_size = file[offset] | (file[offset + 1] << 8) |
+        (file[offset + 2] << 16) | (file[offset + 3] << 24);
+    Expect(size == chunk_size + 14, "frame range size of frame " +
+           std::to_string(i));
+    std::vector<uint8_t> chunk(file.begin() + offset,
+                               file.begin() + offset + size);
+    std::vector<uint16_t> decoded(kNumPixels);
+    Expect(decoder.DecodeFrameChunk(chunk.data(), chunk.size(),
+                                    decoded.data()) &&
+           SameFrame(&frames[i * kNumPixels], decoded.data()),
+           "decode frame range");
+  }
+}
+
+// Returns whether all frames of the decoder are the given input frames.
+bool SameFrames(const fpvc::RandomAccessDecoder& decoder,
+                const std::vector<uint16_t>& frames,
+                const std::vector<size_t>& indices) {
+  if (decoder.numframes() != indices.size()) return false;
+  std::vector<uint16_t> decoded(kNumPixels);
+  for (size_t i = 0; i < indices.size(); i++) {
+    if (!decoder.DecodeFrame(i, decoded.data()) ||
+        !SameFrame(&frames[indices[i] * kNumPixels], decoded.data())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<size_t> AllFrames(size_t num_frames) {
+  std::vector<size_t> indices(num_frames);
+  for (size_t i = 0; i < num_frames; i++) indices[i] = i;
+  return indices;
+}
+
+void TestAsyncFrameReader() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames);
+  std::string path = WriteTempFile(file);
+  for (bool use_io_uring : {true, false}) {
+    std::string name = use_io_uring ? " with io_uring" : " with threads";
+    // A queue shorter than the submissions, to also queue the reads.
+    fpvc::AsyncFrameReader reader(2, 3, use_io_uring);
+    size_t file_ids[2];
+    Expect(reader.AddFile(path, &file_ids[0]) &&
+           reader.AddFile(path, &file_ids[1]), "async add file" + name);
+    if (!use_io_uring) Expect(!reader.UsesIoUring(), "async thread pool");
+
+    // Each frame of both files once, in a scattered order, with the submission
+    // number as payload.
+    std::vector<std::pair<size_t, size_t>> submitted;
+    for (size_t i = 0; i < 40; i++) {
+      submitted.emplace_back(file_ids[i % 2], i * 7 % 20);
+      Expect(reader.Submit(submitted.back().first, submitted.back().second,
+                           reinterpret_cast<void*>(i)), "async submit" + name);
+    }
+    Expect(!reader.Submit(file_ids[0], 20), "async submit past the end");
+
+    std::vector<size_t> delivered(submitted.size());
+    fpvc::AsyncFrameReader::Result result;
+    size_t count = 0;
+    auto check = [&]() {
+      size_t i = reinterpret_cast<size_t>(result.payload);
+      bool ok = i < submitted.size() && result.ok &&
+          result.file == submitted[i].first &&
+          result.index == submitted[i].second && result.xsize == kXsize &&
+          result.ysize == kYsize &&
+          SameFrame(&frames[result.index * kNumPixels], result.frame.data());
+      Expect(ok, "async frame " + std::to_string(result.index) + name);
+      if (ok) delivered[i]++;
+      count++;
+    };
+    // Half the results by polling, the rest by waiting.
+    while (count < submitted.size() / 2) {
+      if (reader.PollResult(&result)) {
+        check();
+      } else {
+        usleep(100);
+      }
+    }
+    while (reader.WaitResult(&result)) check();
+    Expect(!reader.PollResult(&result), "async poll when done" + name);
+    Expect(count == submitted.size() &&
+           std::count(delivered.begin(), delivered.end(), 1) ==
+               (ptrdiff_t)submitted.size(), "async frames once" + name);
+  }
+}
+
+void TestRecovery() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  for (size_t interval : {0, 1, 6}) {
+    std::string name = " with checkpoint interval " + std::to_string(interval);
+    std::vector<uint8_t> file = Encode(frames, [=](fpvc::Encoder* encoder) {
+      encoder->SetCheckpointInterval(interval);
+    });
+    size_t valid_size, num_frames;
+    std::vector<uint8_t> footer;
+    Expect(fpvc::RecoverFrameIndex(file.data(), file.size(), &valid_size,
+                                   &footer, &num_frames) &&
+           footer.empty() && valid_size == file.size() && num_frames == 20,
+           "recover complete file" + name);
+
+    // Cut the file in the middle of a frame, as if the encoder died.
+    fpvc::RandomAccessDecoder decoder;
+    size_t offset, size;
+    Expect(decoder.Init(file.data(), file.size()) &&
+           decoder.FrameRange(13, &offset, &size), "recover frame range");
+    Expect(fpvc::RecoverFrameIndex(file.data(), offset + size / 2,
+                                   &valid_size, &footer, &num_frames) &&
+           num_frames == 13 && valid_size <= offset,
+           "recover cut file" + name);
+    file.resize(valid_size);
+    file.insert(file.end(), footer.begin(), footer.end());
+    fpvc::RandomAccessDecoder recovered;
+    Expect(recovered.Init(file.data(), file.size()) &&
+           SameFrames(recovered, frames, AllFrames(13)),
+           "recovered frames" + name);
+  }
+}
+
+void TestLiveDecoder() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::string path = WriteTempFile({});
+  // Appends the frames slowly, every output in two parts, with checkpoints in
+  // between the frames.
+  std::thread writer([&]() {
+    FILE* f = fopen(path.c_str(), "ab");
+    auto callback = [f](const uint8_t* data, size_t size, void*) {
+      fwrite(data, 1, size / 2, f);
+      fflush(f);
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      fwrite(data + size / 2, 1, size - size / 2, f);
+      fflush(f);
+    };
+    fpvc::Encoder encoder(2, kShift, false);
+    encoder.SetCheckpointInterval(4);
+    encoder.Init(frames.data(), kXsize, kYsize, callback, nullptr);
+    for (size_t i = 0; i < 20; i++) {
+      encoder.CompressFrame(frames.data() + i * kNumPixels, callback, nullptr);
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    encoder.Finish(callback, nullptr);
+    fclose(f);
+  });
+
+  fpvc::LiveDecoder decoder;
+  Expect(decoder.Open(path), "live open");
+  std::vector<uint16_t> decoded(kNumPixels);
+  size_t delivered = 0;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (!decoder.finished() && std::chrono::steady_clock::now() < deadline) {
+    decoder.WaitForFrames(1000);
+    // Every frame is handed out once, when it is first complete.
+    for (; delivered < decoder.numframes(); delivered++) {
+      Expect(decoder.DecodeFrame(delivered, decoded.data()) &&
+             SameFrame(&frames[delivered * kNumPixels], decoded.data()),
+             "live frame " + std::to_string(delivered));
+    }
+  }
+  writer.join();
+  Expect(decoder.finished() && delivered == 20 && decoder.numframes() == 20,
+         "live all frames");
+
+  // Opening another file forgets the frames of the first.
+  std::vector<uint16_t> first_frames(frames.begin(),
+                                     frames.begin() + 5 * kNumPixels);
+  Expect(decoder.Open(WriteTempFile(Encode(first_frames))) &&
+         decoder.Update() && decoder.finished() && decoder.numframes() == 5 &&
+         decoder.DecodeFrame(4, decoded.data()) &&
+         SameFrame(&frames[4 * kNumPixels], decoded.data()), "live reopen");
+}
+
+void TestFrameIndex() {
+  // More frames than fit in one block of the two-level index.
+  std::vector<uint16_t> frames = MakeFrames(150);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.OpenFile(WriteTempFile(file)) && decoder.numframes() == 150,
+         "frame index open");
+  // The first frames are decoded concurrently, which also loads the delta
+  // frame from several threads at once.
+  std::vector<std::thread> threads;
+  std::vector<char> same(4);
+  for (size_t t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      std::vector<uint16_t> decoded(kNumPixels);
+      same[t] = true;
+      for (size_t i = t * 37 + 1; i < 150; i += 64) {
+        same[t] = same[t] && decoder.DecodeFrame(i, decoded.data()) &&
+            SameFrame(&frames[i * kNumPixels], decoded.data());
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  Expect(same == std::vector<char>(4, true), "frame index threads");
+  Expect(SameFrames(decoder, frames, AllFrames(150)), "frame index frames");
+
+  // The same file with the footer of older encoders: the frame offsets and
+  // the amount of frames.
+  size_t footer_size = fpvc::ReadUint64LE(file.data() + file.size() - 12);
+  std::vector<uint8_t> old_file(file.begin(), file.end() - footer_size);
+  std::vector<uint8_t> footer(5 + 150 * 8 + 8);
+  fpvc::WriteUint32LE(footer.size(), footer.data());
+  footer[4] = CHUNK_FRAME_INDEX;
+  for (size_t i = 0; i < 150; i++) {
+    size_t offset, size;
+    decoder.FrameRange(i, &offset, &size);
+    fpvc::WriteUint64LE(offset, footer.data() + 5 + i * 8);
+  }
+  fpvc::WriteUint64LE(150, footer.data() + 5 + 150 * 8);
+  old_file.insert(old_file.end(), footer.begin(), footer.end());
+  fpvc::RandomAccessDecoder old_decoder;
+  Expect(old_decoder.Init(old_file.data(), old_file.size()) &&
+         SameFrames(old_decoder, frames, AllFrames(150)), "older footer");
+}
+
+void TestStreaming() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  // Checkpoints between the frames, which the decoder must skip.
+  std::vector<uint8_t> file = Encode(frames, [](fpvc::Encoder* encoder) {
+    encoder->SetCheckpointInterval(4);
+  });
+  for (size_t num_threads : {0, 3}) {
+    // Pieces of one byte, pieces that split most chunks, and the whole file.
+    for (size_t piece : {1, 777, 1 << 30}) {
+      for (bool borrow : {false, true}) {
+        std::string name = " with " + std::to_string(num_threads) +
+            " threads in pieces of " + std::to_string(piece) +
+            (borrow ? " borrowed" : "");
+        // A short window with threads, so that Decode also has to wait.
+        fpvc::StreamingDecoder streaming(num_threads, num_threads ? 4 : 0);
+        size_t count = 0;
+        std::vector<uint16_t*> borrowed;
+        auto callback = [&](bool ok, uint16_t* frame, size_t xsize,
+                            size_t ysize, void*) {
+          Expect(ok && count < 20 && xsize == kXsize && ysize == kYsize &&
+                 SameFrame(&frames[count * kNumPixels], frame),
+                 "streaming frame " + std::to_string(count) + name);
+          if (borrow) borrowed.push_back(frame);
+          count++;
+        };
+        for (size_t pos = 0; pos < file.size(); pos += piece) {
+          size_t size = std::min(piece, file.size() - pos);
+          if (borrow) {
+            streaming.DecodeBorrowed(file.data() + pos, size, callback);
+          } else {
+            streaming.Decode(file.data() + pos, size, callback);
+          }
+        }
+        streaming.Flush();
+        Expect(count == 20, "streaming all frames" + name);
+        // Borrowed frames stay valid until they are returned.
+        for (size_t i = 0; i < borrowed.size(); i++) {
+          Expect(SameFrame(&frames[i * kNumPixels], borrowed[i]),
+                 "borrowed frame " + std::to_string(i));
+          streaming.ReturnFrame(borrowed[i]);
+        }
+      }
+    }
+  }
+}
+
+void TestBatchDecode() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "batch init");
+  std::vector<size_t> indices = {19, 3, 3, 0, 11, 7, 15, 2, 8};
+  size_t frame_bytes = 0;
+  for (size_t index : indices) {
+    size_t offset, size;
+    decoder.FrameRange(index, &offset, &size);
+    frame_bytes += size;
+  }
+
+  for (bool in_order : {true, false}) {
+    std::string name = in_order ? " in order" : " as they finish";
+    fpvc::BatchDecodeOptions options;
+    options.num_threads = 3;
+    options.in_order = in_order;
+    // Room for two decoded frames, fewer than the threads.
+    options.max_output_bytes = 2 * kNumPixels * sizeof(uint16_t);
+    std::vector<size_t> delivered;
+    fpvc::BatchDecodeStats stats;
+    Expect(decoder.DecodeFrames(indices, options,
+        [&](bool ok, size_t index, const uint16_t* frame) {
+          Expect(ok && SameFrame(&frames[index * kNumPixels], frame),
+                 "batch frame " + std::to_string(index) + name);
+          delivered.push_back(index);
+        }, &stats), "decode frames" + name);
+    if (in_order) Expect(delivered == indices, "batch order");
+    std::sort(delivered.begin(), delivered.end());
+    std::vector<size_t> sorted = indices;
+    std::sort(sorted.begin(), sorted.end());
+    Expect(delivered == sorted, "batch frames once" + name);
+    Expect(stats.frames == indices.size() &&
+           stats.compressed_bytes == frame_bytes &&
+           stats.decoded_bytes ==
+               indices.size() * kNumPixels * sizeof(uint16_t),
+           "batch frame stats" + name);
+  }
+
+  std::vector<uint8_t> expected(decoder.preview_xsize() *
+                                decoder.preview_ysize());
+  fpvc::BatchDecodeOptions options;
+  fpvc::BatchDecodeStats stats;
+  size_t count = 0;
+  Expect(decoder.DecodePreviews(5, 20, options,
+      [&](bool ok, size_t index, const uint8_t* preview) {
+        Expect(ok && index == 5 + count &&
+               decoder.DecodePreview(index, expected.data()) &&
+               std::equal(expected.begin(), expected.end(), preview),
+               "batch preview " + std::to_string(index));
+        count++;
+      }, &stats) && count == 15, "decode previews");
+  // Only the previews are read, not the full frames.
+  Expect(stats.compressed_bytes > 0 &&
+         stats.compressed_bytes * 4 < frame_bytes * 15 / indices.size(),
+         "batch preview stats");
+}
+
+void TestPlayback() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "playback init");
+  for (size_t num_threads : {0, 2}) {
+    std::string name = " with " + std::to_string(num_threads) + " threads";
+    fpvc::PlaybackEngine::Options options;
+    options.num_threads = num_threads;
+    options.prefetch_frames = 4;
+    // Room for a few frames only, to also evict.
+    options.cache_bytes = 6 * kNumPixels * sizeof(uint16_t);
+    fpvc::PlaybackEngine engine(decoder, options);
+
+    // Forward, a seek, backward with a step, and the same frames twice.
+    std::vector<size_t> requests;
+    for (size_t i = 0; i < 10; i++) requests.push_back(i);
+    for (size_t i = 19; i >= 11; i -= 2) requests.push_back(i);
+    for (size_t i = 5; i < 8; i++) requests.push_back(i);
+    for (size_t i = 5; i < 8; i++) requests.push_back(i);
+    fpvc::PlaybackEngine::FramePtr first = engine.GetFrame(0);
+    for (size_t index : requests) {
+      fpvc::PlaybackEngine::FramePtr frame = engine.GetFrame(index);
+      Expect(frame && frame->size() == kNumPixels &&
+             SameFrame(&frames[index * kNumPixels], frame->data()),
+             "playback frame " + std::to_string(index) + name);
+    }
+    // Held frames stay valid after their eviction.
+    Expect(SameFrame(frames.data(), first->data()), "playback held frame");
+    Expect(!engine.GetFrame(20), "playback past the end");
+
+    std::vector<uint8_t> expected(decoder.preview_xsize() *
+                                  decoder.preview_ysize());
+    fpvc::PlaybackEngine::PreviewPtr preview = engine.GetPreview(3);
+    Expect(decoder.DecodePreview(3, expected.data()) && preview &&
+           *preview == expected, "playback preview" + name);
+
+    // The requests, the held frame and the preview.
+    fpvc::PlaybackEngine::Stats stats = engine.stats();
+    Expect(stats.hits + stats.waits + stats.misses == requests.size() + 2 &&
+           stats.evicted > 0 && (num_threads == 0) == (stats.prefetched == 0),
+           "playback stats" + name);
+  }
+}
+
+void TestPreviewTrack() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> plain = Encode(frames);
+  std::vector<uint8_t> file = Encode(frames, [](fpvc::Encoder* encoder) {
+    encoder->SetPreviewTrack(true);
+  });
+  fpvc::RandomAccessDecoder plain_decoder, decoder;
+  Expect(plain_decoder.Init(plain.data(), plain.size()) &&
+         decoder.Init(file.data(), file.size()), "preview track init");
+  Expect(!plain_decoder.has_preview_track() && decoder.has_preview_track(),
+         "has preview track");
+  Expect(SameFrames(decoder, frames, AllFrames(20)),
+         "frames with preview track");
+
+  // The track holds the same previews as the frames.
+  size_t preview_size = decoder.preview_xsize() * decoder.preview_ysize();
+  std::vector<uint8_t> expected(preview_size), preview(preview_size);
+  for (size_t i = 0; i < 20; i++) {
+    Expect(plain_decoder.DecodePreview(i, expected.data()) &&
+           decoder.DecodePreview(i, preview.data()) && preview == expected,
+           "preview track of frame " + std::to_string(i));
+  }
+
+  fpvc::BatchDecodeOptions options;
+  options.in_order = false;
+  fpvc::BatchDecodeStats plain_stats, stats;
+  size_t count = 0;
+  Expect(plain_decoder.DecodePreviews(0, 20, options,
+             [](bool, size_t, const uint8_t*) {}, &plain_stats) &&
+         decoder.DecodePreviews(0, 20, options,
+             [&](bool ok, size_t index, const uint8_t* batch_preview) {
+               plain_decoder.DecodePreview(index, expected.data());
+               Expect(ok && std::equal(expected.begin(), expected.end(),
+                                       batch_preview),
+                      "batch preview track " + std::to_string(index));
+               count++;
+             }, &stats) && count == 20, "decode preview track");
+  Expect(stats.compressed_bytes == plain_stats.compressed_bytes,
+         "preview track stats");
+}
+
+void TestStreamingSelection() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames, [](fpvc::Encoder* encoder) {
+    encoder->SetCheckpointInterval(4);
+  });
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "selection init");
+
+  for (size_t num_threads : {0, 3}) {
+    std::string name = " with " + std::to_string(num_threads) + " threads";
+    fpvc::StreamingDecoder streaming(num_threads);
+    streaming.SetFrameSelector(fpvc::StreamingDecoder::Stride(3, 1));
+    std::vector<size_t> decoded;
+    auto callback = [&](bool ok, uint16_t* frame, size_t, size_t, void*) {
+      size_t index = streaming.frame_index();
+      Expect(ok && SameFrame(&frames[index * kNumPixels], frame),
+             "selected frame " + std::to_string(index) + name);
+      decoded.push_back(index);
+    };
+    for (size_t pos = 0; pos < file.size(); pos += 1000) {
+      streaming.Decode(file.data() + pos,
+                       std::min<size_t>(1000, file.size() - pos), callback);
+    }
+    streaming.Flush();
+    Expect(decoded == std::vector<size_t>({1, 4, 7, 10, 13, 16, 19}),
+           "stride selection" + name);
+  }
+
+  // The previews of a set of frames, with the 8 bits in the high bits.
+  fpvc::StreamingDecoder previews(2);
+  previews.SetFrameSelector(fpvc::StreamingDecoder::IndexSet({0, 9, 19}));
+  previews.SetDecodeMode(fpvc::StreamingDecoder::DECODE_PREVIEW);
+  std::vector<size_t> decoded;
+  std::vector<uint8_t> expected(decoder.preview_xsize() *
+                                decoder.preview_ysize());
+  previews.Decode(file.data(), file.size(), [&](bool ok, uint16_t* preview,
+                                                size_t xsize, size_t ysize,
+                                                void*) {
+    size_t index = previews.frame_index();
+    bool same = ok && xsize == decoder.preview_xsize() &&
+        ysize == decoder.preview_ysize() &&
+        decoder.DecodePreview(index, expected.data());
+    for (size_t i = 0; same && i < expected.size(); i++) {
+      same = preview[i] == expected[i] << 8;
+    }
+    Expect(same, "streaming preview " + std::to_string(index));
+    decoded.push_back(index);
+  });
+  previews.Flush();
+  Expect(decoded == std::vector<size_t>({0, 9, 19}), "index set selection");
+
+  // Only the high bytes of the frames.
+  fpvc::StreamingDecoder msb;
+  msb.SetDecodeMode(fpvc::StreamingDecoder::DECODE_MSB);
+  size_t count = 0;
+  msb.Decode(file.data(), file.size(), [&](bool ok, uint16_t* frame, size_t,
+                                           size_t, void*) {
+    const uint16_t* expected_frame = &frames[count * kNumPixels];
+    bool same = ok;
+    for (size_t i = 0; same && i < kNumPixels; i++) {
+      same = frame[i] == ((expected_frame[i] << kShift) & 0xff00);
+    }
+    Expect(same, "streaming msb frame " + std::to_string(count));
+    count++;
+  });
+  Expect(count == 20, "streaming msb frames");
+}
+
+void TestDecodeRows(bool plane_sizes) {
+  std::vector<uint16_t> frames = MakeFrames(5);
+  std::vector<uint8_t> file = Encode(frames, [=](fpvc::Encoder* encoder) {
+    encoder->SetPlaneSizes(plane_sizes);
+  });
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "rows init");
+  std::vector<uint16_t> rows(kNumPixels);
+  // The first row, a band, the last rows and the whole frame.
+  const std::pair<size_t, size_t> bands[] = {
+      {0, 1}, {10, 27}, {kYsize - 3, kYsize}, {0, kYsize}};
+  for (size_t i = 0; i < 5; i++) {
+    for (const std::pair<size_t, size_t>& band : bands) {
+      size_t y0 = band.first, y1 = band.second;
+      bool same = decoder.DecodeRows(i, y0, y1, rows.data());
+      for (size_t j = 0; same && j < (y1 - y0) * kXsize; j++) {
+        same = rows[j] == frames[i * kNumPixels + y0 * kXsize + j] << kShift;
+      }
+      Expect(same, "rows " + std::to_string(y0) + " to " +
+             std::to_string(y1) + " of frame " + std::to_string(i));
+    }
+  }
+  Expect(decoder.DecodeRows(0, 40, 40, nullptr), "empty rows");
+  Expect(!decoder.DecodeRows(0, 5, 3, rows.data()) &&
+         !decoder.DecodeRows(0, 0, kYsize + 1, rows.data()) &&
+         !decoder.DecodeRows(5, 0, 1, rows.data()), "invalid rows");
+}
+
+void TestPlaneSizes() {
+  std::vector<uint16_t> frames = MakeFrames(5);
+  for (bool plane_sizes : {false, true}) {
+    std::string name = plane_sizes ? " with plane sizes" : "";
+    std::vector<uint8_t> file = Encode(frames, [=](fpvc::Encoder* encoder) {
+      encoder->SetPlaneSizes(plane_sizes);
+    });
+    fpvc::RandomAccessDecoder decoder;
+    Expect(decoder.Init(file.data(), file.size()), "plane sizes init" + name);
+    // The image flags of the first frame, after its preview.
+    size_t offset, size;
+    decoder.FrameRange(0, &offset, &size);
+    uint8_t flags = file[offset + 9 + fpvc::ReadUint32LE(&file[offset + 5])];
+    Expect(!!(flags & fpvc::PLANE_SIZES) == plane_sizes, "plane sizes flag");
+    std::vector<uint16_t> decoded(kNumPixels);
+    for (bool parallel_planes : {false, true}) {
+      decoder.SetParallelPlanes(parallel_planes);
+      std::string planes = parallel_planes ? " parallel" : "";
+      // Worker contexts decompress the planes themselves.
+      fpvc::DecodeContext context, worker;
+      worker.worker = true;
+      for (size_t i = 0; i < 5; i++) {
+        Expect(decoder.DecodeFrame(i, decoded.data(), &context) &&
+               SameFrame(&frames[i * kNumPixels], decoded.data()) &&
+               decoder.DecodeFrame(i, decoded.data(), &worker) &&
+               SameFrame(&frames[i * kNumPixels], decoded.data()),
+               "frame " + std::to_string(i) + name + planes);
+        bool same = decoder.DecodeFrameMSB(i, decoded.data(), &context);
+        for (size_t j = 0; same && j < kNumPixels; j++) {
+          same = decoded[j] ==
+              ((frames[i * kNumPixels + j] << kShift) & 0xff00);
+        }
+        Expect(same, "msb frame " + std::to_string(i) + name + planes);
+      }
+    }
+  }
+}
+
+void TestDecodeStrips(bool plane_sizes) {
+  std::vector<uint16_t> frames = MakeFrames(5);
+  std::vector<uint8_t> file = Encode(frames, [=](fpvc::Encoder* encoder) {
+    encoder->SetPlaneSizes(plane_sizes);
+  });
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "strips init");
+  std::vector<uint16_t> decoded(kNumPixels);
+  // Strips of one row, strips that don't divide the frame, and strips taller
+  // than the frame.
+  for (size_t strip_rows : {1, 7, 200}) {
+    std::string name = " in strips of " + std::to_string(strip_rows);
+    for (size_t i = 0; i < 5; i++) {
+      size_t next_row = 0;
+      Expect(decoder.DecodeStrips(i, strip_rows,
+          [&](size_t y0, size_t num_rows, const uint16_t* rows) {
+            Expect(y0 == next_row && num_rows <= strip_rows &&
+                   y0 + num_rows <= kYsize, "strip rows" + name);
+            std::copy(rows, rows + num_rows * kXsize,
+                      decoded.begin() + y0 * kXsize);
+            next_row = y0 + num_rows;
+            return true;
+          }) && next_row == kYsize &&
+          SameFrame(&frames[i * kNumPixels], decoded.data()),
+          "frame " + std::to_string(i) + name);
+    }
+  }
+  // Returning false stops after that strip.
+  size_t num_strips = 0;
+  Expect(decoder.DecodeStrips(0, 8, [&](size_t, size_t, const uint16_t*) {
+    return ++num_strips < 3;
+  }) && num_strips == 3, "stop decoding strips");
+
+  // The streaming decoder delivers the selected frames in strips.
+  fpvc::StreamingDecoder streaming;
+  streaming.SetFrameSelector(fpvc::StreamingDecoder::Stride(2));
+  std::vector<size_t> delivered;
+  streaming.SetStripCallback(16, [&](size_t y0, size_t num_rows,
+                                     const uint16_t* rows) {
+    size_t index = streaming.frame_index();
+    const uint16_t* expected = &frames[index * kNumPixels + y0 * kXsize];
+    bool same = num_rows <= 16;
+    for (size_t j = 0; same && j < num_rows * kXsize; j++) {
+      same = rows[j] == expected[j] << kShift;
+    }
+    Expect(same, "streaming strip of frame " + std::to_string(index));
+    if (y0 + num_rows == kYsize) delivered.push_back(index);
+    return true;
+  });
+  streaming.Decode(file.data(), file.size(),
+                   [&](bool, uint16_t*, size_t, size_t, void*) {
+    Expect(false, "streaming strip failure");
+  });
+  Expect(delivered == std::vector<size_t>({0, 2, 4}), "streaming strips");
+}
+
+// Returns whether the frame in the target has the values of the input frame
+// left aligned, converted to the pixel type of the target, and whether the
+// padding between its rows still has the value 0xee.
+bool SameTargetFrame(const uint16_t* expected, const fpvc::DecodeTarget& target,
+                     const std::vector<uint8_t>& buffer) {
+  size_t pitch = target.RowPitch(kXsize);
+  size_t pixel_size = target.PixelSize();
+  for (size_t y = 0; y < kYsize; y++) {
+    const uint8_t* row = buffer.data() + y * pitch;
+    for (size_t x = 0; x < kXsize; x++) {
+      uint32_t value = (expected[y * kXsize + x] << kShift) >> target.shift;
+      const uint8_t* pixel = row + x * pixel_size;
+      bool same;
+      if (target.type == fpvc::DecodeTarget::UINT8) {
+        same = *pixel == std::min<uint32_t>(value, 255);
+      } else if (target.type == fpvc::DecodeTarget::UINT16) {
+        uint16_t v;
+        memcpy(&v, pixel, 2);
+        if (target.big_endian) v = (pixel[0] << 8) | pixel[1];
+        same = v == value;
+      } else {
+        float v;
+        memcpy(&v, pixel, 4);
+        same = v == value;
+      }
+      if (!same) return false;
+    }
+    if (y + 1 == kYsize) break;
+    for (size_t i = kXsize * pixel_size; i < pitch; i++) {
+      if (row[i] != 0xee) return false;
+    }
+  }
+  return true;
+}
+
+void TestDecodeTargets() {
+  std::vector<uint16_t> frames = MakeFrames(3);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "targets init");
+
+  std::vector<fpvc::DecodeTarget> targets(6);
+  // Packed and padded 16-bit, the latter big endian and right aligned.
+  targets[1].row_pitch = (kXsize + 3) * 2;
+  targets[1].shift = kShift;
+  targets[1].big_endian = true;
+  // 8-bit with values above 255 clamped, and the high bytes.
+  targets[2].type = fpvc::DecodeTarget::UINT8;
+  targets[2].shift = kShift;
+  targets[3].type = fpvc::DecodeTarget::UINT8;
+  targets[3].shift = 8;
+  targets[3].row_pitch = kXsize + 5;
+  // Packed and padded floats.
+  targets[4].type = fpvc::DecodeTarget::FLOAT32;
+  targets[5].type = fpvc::DecodeTarget::FLOAT32;
+  targets[5].row_pitch = (kXsize + 1) * 4;
+  for (size_t t = 0; t < targets.size(); t++) {
+    std::vector<uint8_t> buffer(targets[t].Size(kXsize, kYsize), 0xee);
+    targets[t].data = buffer.data();
+    for (size_t i = 0; i < 3; i++) {
+      std::fill(buffer.begin(), buffer.end(), 0xee);
+      Expect(decoder.DecodeFrame(i, targets[t]) &&
+             SameTargetFrame(&frames[i * kNumPixels], targets[t], buffer),
+             "target " + std::to_string(t) + " frame " + std::to_string(i));
+    }
+  }
+
+  // The streaming decoder writes the same formats.
+  fpvc::StreamingDecoder streaming(2);
+  streaming.SetOutputFormat(targets[3]);
+  size_t count = 0;
+  streaming.Decode(file.data(), file.size(), [&](bool ok, uint16_t* frame,
+                                                 size_t, size_t, void*) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(frame);
+    std::vector<uint8_t> buffer(bytes, bytes + targets[3].Size(kXsize,
+                                                               kYsize));
+    // The streaming decoder owns the padding.
+    for (size_t y = 0; y + 1 < kYsize; y++) {
+      std::fill(buffer.begin() + y * (kXsize + 5) + kXsize,
+                buffer.begin() + (y + 1) * (kXsize + 5), 0xee);
+    }
+    Expect(ok && SameTargetFrame(&frames[count * kNumPixels], targets[3],
+                                 buffer),
+           "streaming target frame " + std::to_string(count));
+    count++;
+  });
+  streaming.Flush();
+  Expect(count == 3, "streaming target frames");
+}
+
+void TestPreviewPyramid() {
+  std::vector<uint16_t> frames = MakeFrames(5);
+  std::vector<uint8_t> plain = Encode(frames);
+  std::vector<uint8_t> file = Encode(frames, [](fpvc::Encoder* encoder) {
+    encoder->SetPreviewPyramid(true);
+    encoder->SetPreviewTrack(true);
+  });
+  fpvc::RandomAccessDecoder plain_decoder, decoder;
+  Expect(plain_decoder.Init(plain.data(), plain.size()) &&
+         decoder.Init(file.data(), file.size()), "pyramid init");
+  Expect(SameFrames(decoder, frames, AllFrames(5)), "frames with pyramid");
+
+  for (size_t i = 0; i < 5; i++) {
+    const uint16_t* frame = &frames[i * kNumPixels];
+    for (int level = 0; level < NUM_PREVIEW_LEVELS; level++) {
+      std::string name = " level " + std::to_string(level) + " of frame " +
+          std::to_string(i);
+      // The average of the high bytes of a block of the frame, with the
+      // lowest bit cleared.
+      size_t scale = 2 << level;
+      size_t xsize = decoder.preview_xsize(level);
+      size_t ysize = decoder.preview_ysize(level);
+      std::vector<uint8_t> expected(xsize * ysize), preview(xsize * ysize);
+      for (size_t y = 0; y < ysize; y++) {
+        for (size_t x = 0; x < xsize; x++) {
+          uint32_t sum = 0;
+          for (size_t by = 0; by < scale; by++) {
+            for (size_t bx = 0; bx < scale; bx++) {
+              sum += (frame[(y * scale + by) * kXsize + x * scale + bx] <<
+                      kShift) >> 8;
+            }
+          }
+          expected[y * xsize + x] = (sum / (scale * scale)) & 0xfe;
+        }
+      }
+      Expect(xsize == kXsize / scale && ysize == kYsize / scale &&
+             decoder.DecodePreviewLevel(i, level, preview.data()) &&
+             preview == expected, "preview" + name);
+      // Without a pyramid, only level 1 is there.
+      if (i == 0) {
+        Expect(plain_decoder.DecodePreviewLevel(i, level, preview.data()) ==
+               (level == 1), "no pyramid" + name);
+      }
+      if (level == 1) {
+        Expect(decoder.DecodePreview(i, preview.data()) &&
+               preview == expected, "preview track" + name);
+      }
+    }
+  }
+}
+
+void TestFrameStats() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()) && decoder.has_frame_stats(),
+         "frame stats init");
+  std::vector<size_t> bright;
+  for (size_t i = 0; i < 20; i++) {
+    const uint16_t* frame = &frames[i * kNumPixels];
+    uint16_t min = 65535, max = 0;
+    uint64_t sum = 0;
+    for (size_t j = 0; j < kNumPixels; j++) {
+      uint16_t v = frame[j] << kShift;
+      min = std::min(min, v);
+      max = std::max(max, v);
+      sum += v;
+    }
+    size_t offset, size;
+    decoder.FrameRange(i, &offset, &size);
+    fpvc::FrameStats stats;
+    Expect(decoder.GetFrameStats(i, &stats) && stats.min == min &&
+           stats.max == max && stats.sum == sum &&
+           stats.mean == (double)sum / kNumPixels &&
+           stats.compressed_size == size,
+           "frame stats of frame " + std::to_string(i));
+    if (min > 1000) bright.push_back(i);
+  }
+  Expect(!bright.empty() && bright.size() < 20 &&
+         decoder.FindFrames([](const fpvc::FrameStats& stats) {
+           return stats.min > 1000;
+         }) == bright, "find frames");
+}
+
+void TestTimestamps() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames, nullptr, true);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()) && decoder.has_timestamps(),
+         "timestamps init");
+  Expect(SameFrames(decoder, frames, AllFrames(20)), "frames with timestamps");
+  for (size_t i = 0; i < 20; i++) {
+    int64_t timestamp;
+    Expect(decoder.GetTimestamp(i, &timestamp) &&
+           timestamp == kStartTime + (int64_t)i * kFrameTime,
+           "timestamp of frame " + std::to_string(i));
+    size_t index;
+    // Exactly at the frame, and just before the next one.
+    Expect(decoder.FindFrameAtTime(timestamp, &index) && index == i &&
+           decoder.FindFrameAtTime(timestamp + kFrameTime - 1, &index) &&
+           index == i, "find frame at time of frame " + std::to_string(i));
+  }
+  size_t index;
+  Expect(decoder.FindFrameAtTime(0, &index) && index == 0,
+         "find frame before the first");
+  Expect(decoder.FindFrameAtTime(kStartTime * 2, &index) && index == 19,
+         "find frame after the last");
+
+  // Without timestamps, the footer has none.
+  std::vector<uint8_t> plain = Encode(frames);
+  fpvc::RandomAccessDecoder plain_decoder;
+  Expect(plain_decoder.Init(plain.data(), plain.size()) &&
+         !plain_decoder.has_timestamps(), "no timestamps");
+}
+
+void TestReduce() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "reduce init");
+  const size_t begin = 3, end = 17;
+  fpvc::ReduceOptions options;
+  options.num_threads = 3;
+
+  fpvc::PixelStatsReducer stats;
+  Expect(fpvc::ReduceFrames(decoder, begin, end, &stats, options),
+         "reduce pixel stats");
+  bool same = stats.count() == end - begin;
+  for (size_t j = 0; same && j < kNumPixels; j++) {
+    uint16_t min = 65535, max = 0;
+    for (size_t i = begin; i < end; i++) {
+      min = std::min<uint16_t>(min, frames[i * kNumPixels + j] << kShift);
+      max = std::max<uint16_t>(max, frames[i * kNumPixels + j] << kShift);
+    }
+    same = stats.min()[j] == min && stats.max()[j] == max;
+  }
+  Expect(same, "pixel stats");
+
+  // A rectangle that sticks out of the frame, which gets clipped.
+  const size_t x0 = 100, y0 = 50, width = 20, height = 10;
+  fpvc::RoiSumReducer roi(x0, y0, width, height);
+  Expect(fpvc::ReduceFrames(decoder, begin, end, &roi, options),
+         "reduce roi sums");
+  same = roi.sums().size() == end - begin;
+  for (size_t i = begin; same && i < end; i++) {
+    uint64_t sum = 0;
+    for (size_t y = y0; y < y0 + height; y++) {
+      for (size_t x = x0; x < std::min(x0 + width, kXsize); x++) {
+        sum += frames[i * kNumPixels + y * kXsize + x] << kShift;
+      }
+    }
+    same = roi.sums()[i - begin] == sum;
+  }
+  Expect(same, "roi sums");
+}
+
+void TestTimeSeriesCache() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames);
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "time series init");
+  // Tiles and blocks that don't divide the frames, to test the edges.
+  fpvc::TimeSeriesCacheOptions options;
+  options.tile_xsize = 16;
+  options.tile_ysize = 12;
+  options.block_frames = 6;
+  options.num_threads = 3;
+  std::string path = WriteTempFile({});
+  Expect(fpvc::BuildTimeSeriesCache(decoder, path, options),
+         "build time series cache");
+  fpvc::TimeSeriesCache cache;
+  Expect(cache.Open(path) && cache.xsize() == kXsize &&
+         cache.ysize() == kYsize && cache.numframes() == 20,
+         "open time series cache");
+
+  for (size_t y = 0; y < kYsize; y += 13) {
+    for (size_t x = 0; x < kXsize; x += 17) {
+      std::vector<uint16_t> series;
+      bool same = cache.GetPixel(x, y, &series) &&
+          series.size() == 20;
+      for (size_t i = 0; same && i < 20; i++) {
+        same = series[i] == frames[i * kNumPixels + y * kXsize + x] << kShift;
+      }
+      Expect(same, "time series of " + std::to_string(x) + "," +
+             std::to_string(y));
+    }
+  }
+
+  const size_t x0 = 10, y0 = 20, width = 30, height = 3, begin = 4, end = 17;
+  std::vector<uint16_t> patch(width * height * (end - begin));
+  bool same = cache.GetPatch(x0, y0, width, height, begin, end, patch.data());
+  for (size_t y = 0; same && y < height; y++) {
+    for (size_t x = 0; same && x < width; x++) {
+      for (size_t i = begin; same && i < end; i++) {
+        same = patch[(y * width + x) * (end - begin) + i - begin] ==
+            frames[i * kNumPixels + (y0 + y) * kXsize + x0 + x] << kShift;
+      }
+    }
+  }
+  Expect(same, "time series patch");
+}
+
+void TestChecksums() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::vector<uint8_t> file = Encode(frames, [](fpvc::Encoder* encoder) {
+    encoder->SetFrameChecksums(true);
+  });
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.Init(file.data(), file.size()), "checksums init");
+  Expect(SameFrames(decoder, frames, AllFrames(20)),
+         "frames with checksums");
+  for (size_t i = 0; i < 20; i++) {
+    Expect(decoder.VerifyFrame(i, true) == fpvc::RandomAccessDecoder::VERIFY_OK,
+           "verify frame " + std::to_string(i));
+  }
+
+  // Flip a byte in the middle of a frame chunk.
+  const size_t corrupt = 7;
+  size_t offset, size;
+  Expect(decoder.FrameRange(corrupt, &offset, &size), "corrupt frame range");
+  std::vector<uint8_t> corrupted = file;
+  corrupted[offset + fpvc::ReadUint32LE(file.data() + offset) / 2] ^= 0x10;
+  fpvc::RandomAccessDecoder corrupted_decoder;
+  Expect(corrupted_decoder.Init(corrupted.data(), corrupted.size()),
+         "corrupted init");
+  for (size_t i = 0; i < 20; i++) {
+    fpvc::RandomAccessDecoder::VerifyResult expected = i == corrupt ?
+        fpvc::RandomAccessDecoder::VERIFY_CORRUPT :
+        fpvc::RandomAccessDecoder::VERIFY_OK;
+    Expect(corrupted_decoder.VerifyFrame(i, false) == expected,
+           "verify corrupted file frame " + std::to_string(i));
+  }
+
+  std::vector<uint8_t> plain = Encode(frames);
+  fpvc::RandomAccessDecoder plain_decoder;
+  Expect(plain_decoder.Init(plain.data(), plain.size()) &&
+         plain_decoder.VerifyFrame(0, false) ==
+             fpvc::RandomAccessDecoder::VERIFY_NO_CHECKSUM,
+         "verify without checksums");
+}
+
+void TestRemux() {
+  std::vector<uint16_t> frames = MakeFrames(20);
+  std::string path = WriteTempFile(
+      Encode(frames, [](fpvc::Encoder* encoder) {
+        encoder->SetFrameChecksums(true);
+        encoder->SetPreviewTrack(true);
+      }, true));
+  fpvc::RandomAccessDecoder decoder;
+  Expect(decoder.OpenFile(path), "remux input");
+
+  std::string decimated = WriteTempFile({});
+  std::vector<size_t> indices;
+  fpvc::SelectFrames(1, 20, 3, &indices);
+  Expect(fpvc::Remux({{path, indices}}, decimated), "remux decimate");
+  fpvc::RandomAccessDecoder output;
+  Expect(output.OpenFile(decimated) && SameFrames(output, frames, indices),
+         "decimated frames");
+  Expect(output.has_timestamps() && output.has_frame_stats(),
+         "decimated footer sections");
+  for (size_t i = 0; i < output.numframes(); i++) {
+    int64_t timestamp;
+    Expect(output.GetTimestamp(i, &timestamp) &&
+           timestamp == kStartTime + (int64_t)indices[i] * kFrameTime,
+           "decimated timestamp");
+    Expect(output.VerifyFrame(i, true) == fpvc::RandomAccessDecoder::VERIFY_OK,
+           "decimated checksum");
+  }
+
+  std::vector<size_t> range;
+  Expect(fpvc::SelectTimeRange(decoder, kStartTime + 3 * kFrameTime,
+                               kStartTime + 8 * kFrameTime, &range) &&
+         range == std::vector<size_t>({3, 4, 5, 6, 7}), "select time range");
+
+  // The concatenation isn't increasing in time, so it loses the timestamps.
+  std::string concatenated = WriteTempFile({});
+  Expect(fpvc::Remux({{path, {}}, {decimated, {}}}, concatenated),
+         "remux concat");
+  std::vector<size_t> expected = AllFrames(20);
+  expected.insert(expected.end(), indices.begin(), indices.end());
+  fpvc::RandomAccessDecoder concat;
+  Expect(concat.OpenFile(concatenated) && SameFrames(concat, frames, expected),
+         "concatenated frames");
+  Expect(!concat.has_timestamps(), "concatenated timestamps");
+}
+
+}  // namespace
+
+int main() {
+  TestFrameRange();
+  TestPreviewTrack();
+  TestAsyncFrameReader();
+  TestRecovery();
+  TestLiveDecoder();
+  TestFrameIndex();
+  TestStreaming();
+  TestBatchDecode();
+  TestPlayback();
+  TestStreamingSelection();
+  TestDecodeRows(false);
+  TestDecodeRows(true);
+  TestPlaneSizes();
+  TestDecodeStrips(false);
+  TestDecodeStrips(true);
+  TestDecodeTargets();
+  TestPreviewPyramid();
+  TestFrameStats();
+  TestTimestamps();
+  TestReduce();
+  TestTimeSeriesCache();
+  TestChecksums();
+  TestRemux();
+
+  for (const std::string& path : temp_files) unlink(path.c_str());
+  if (failures) {
+    std::cout << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "all round trips match" << std::endl;
+  return 0;
+}
@@ -0,0 +1,577 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "simd_kernels.h"
+
+#include <string.h>  // memcpy
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+// The vector kernels are compiled with target attributes rather than global
+// compiler flags, and only called when the CPU supports them.
+#define FPV_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace fpvc {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar kernels, also used for the remainders of the vector kernels.
+
+void InterleaveBytesScalar(const uint8_t* low, const uint8_t* high, size_t n,
+                           uint16_t* out) {
+  for (size_t i = 0; i < n; i++) out[i] = low[i] | (high[i] << 8);
+}
+
+void ShiftRightScalar(const uint16_t* in, size_t n, int shift,
+                      uint16_t* out) {
+  for (size_t i = 0; i < n; i++) out[i] = in[i] >> shift;
+}
+
+void HighBytesScalar(const uint16_t* in, size_t n, uint8_t* out) {
+  for (size_t i = 0; i < n; i++) out[i] = in[i] >> 8;
+}
+
+void UnextractScalar(const uint16_t* in, size_t n, int shift, bool big_endian,
+                     uint8_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    uint16_t u = in[i] >> shift;
+    uint8_t a = u & 255;
+    uint8_t b = u >> 8;
+    if (big_endian) {
+      out[i * 2 + 0] = b;
+      out[i * 2 + 1] = a;
+    } else {
+      out[i * 2 + 0] = a;
+      out[i * 2 + 1] = b;
+    }
+  }
+}
+
+void AccumulateMomentsScalar(const uint16_t* in, size_t n, uint64_t* sum,
+                             uint64_t* sum_squares) {
+  for (size_t i = 0; i < n; i++) {
+    uint64_t v = in[i];
+    sum[i] += v;
+    sum_squares[i] += v * v;
+  }
+}
+
+void AccumulateMinMaxScalar(const uint16_t* in, size_t n, uint16_t* min,
+                            uint16_t* max) {
+  for (size_t i = 0; i < n; i++) {
+    if (in[i] < min[i]) min[i] = in[i];
+    if (in[i] > max[i]) max[i] = in[i];
+  }
+}
+
+uint64_t SumScalar(const uint16_t* in, size_t n) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < n; i++) result += in[i];
+  return result;
+}
+
+// Table of the CRC-32C of every byte value, for the reflected polynomial.
+struct Crc32cTable {
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+      values[i] = crc;
+    }
+  }
+  uint32_t values[256];
+};
+
+uint32_t Crc32cScalar(uint32_t crc, const uint8_t* data, size_t size) {
+  static const Crc32cTable table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = table.values[(crc ^ data[i]) & 255] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#ifdef FPV_SIMD_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE2
+
+__attribute__((target("sse2")))
+void InterleaveBytesSSE2(const uint8_t* low, const uint8_t* high, size_t n,
+                         uint16_t* out) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(low + i));
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(high + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_unpacklo_epi8(l, h));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8),
+                     _mm_unpackhi_epi8(l, h));
+  }
+  InterleaveBytesScalar(low + i, high + i, n - i, out + i);
+}
+
+__attribute__((target("sse2")))
+void ShiftRightSSE2(const uint16_t* in, size_t n, int shift, uint16_t* out) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_srl_epi16(v, count));
+  }
+  ShiftRightScalar(in + i, n - i, shift, out + i);
+}
+
+__attribute__((target("sse2")))
+void HighBytesSSE2(const uint16_t* in, size_t n, uint8_t* out) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                                      _mm_srli_epi16(b, 8)));
+  }
+  HighBytesScalar(in + i, n - i, out + i);
+}
+
+__attribute__((target("sse2")))
+void UnextractSSE2(const uint16_t* in, size_t n, int shift, bool big_endian,
+                   uint8_t* out) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    v = _mm_srl_epi16(v, count);
+    if (big_endian) {
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), v);
+  }
+  UnextractScalar(in + i, n - i, shift, big_endian, out + i * 2);
+}
+
+// Adds the 64-bit values x to sum, and their squares to sum_squares, x must be
+// below 2^32.
+__attribute__((target("sse2")))
+inline void AddMomentsSSE2(__m128i x, uint64_t* sum, uint64_t* sum_squares) {
+  __m128i* s = reinterpret_cast<__m128i*>(sum);
+  __m128i* q = reinterpret_cast<__m128i*>(sum_squares);
+  _mm_storeu_si128(s, _mm_add_epi64(_mm_loadu_si128(s), x));
+  _mm_storeu_si128(q, _mm_add_epi64(_mm_loadu_si128(q), _mm_mul_epu32(x, x)));
+}
+
+__attribute__((target("sse2")))
+void AccumulateMomentsSSE2(const uint16_t* in, size_t n, uint64_t* sum,
+                           uint64_t* sum_squares) {
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i lo = _mm_unpacklo_epi16(v, zero);
+    __m128i hi = _mm_unpackhi_epi16(v, zero);
+    AddMomentsSSE2(_mm_unpacklo_epi32(lo, zero), sum + i, sum_squares + i);
+    AddMomentsSSE2(_mm_unpackhi_epi32(lo, zero), sum + i + 2,
+                   sum_squares + i + 2);
+    AddMomentsSSE2(_mm_unpacklo_epi32(hi, zero), sum + i + 4,
+                   sum_squares + i + 4);
+    AddMomentsSSE2(_mm_unpackhi_epi32(hi, zero), sum + i + 6,
+                   sum_squares + i + 6);
+  }
+  AccumulateMomentsScalar(in + i, n - i, sum + i, sum_squares + i);
+}
+
+__attribute__((target("sse2")))
+void AccumulateMinMaxSSE2(const uint16_t* in, size_t n, uint16_t* min,
+                          uint16_t* max) {
+  // SSE2 only has signed 16-bit min and max, flipping the sign bit maps the
+  // unsigned order onto the signed one.
+  __m128i sign = _mm_set1_epi16(-0x8000);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), sign);
+    __m128i* pmin = reinterpret_cast<__m128i*>(min + i);
+    __m128i* pmax = reinterpret_cast<__m128i*>(max + i);
+    __m128i a = _mm_xor_si128(_mm_loadu_si128(pmin), sign);
+    __m128i b = _mm_xor_si128(_mm_loadu_si128(pmax), sign);
+    _mm_storeu_si128(pmin, _mm_xor_si128(_mm_min_epi16(a, v), sign));
+    _mm_storeu_si128(pmax, _mm_xor_si128(_mm_max_epi16(b, v), sign));
+  }
+  AccumulateMinMaxScalar(in + i, n - i, min + i, max + i);
+}
+
+// The sum kernels add the low and the high bytes of the pixels separately with
+// the sum of absolute differences to zero, which sums 8 bytes into 64 bits.
+__attribute__((target("sse2")))
+uint64_t SumSSE2(const uint16_t* in, size_t n) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i mask = _mm_set1_epi16(255);
+  __m128i low = zero;
+  __m128i high = zero;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    low = _mm_add_epi64(low, _mm_sad_epu8(_mm_and_si128(v, mask), zero));
+    high = _mm_add_epi64(high, _mm_sad_epu8(_mm_srli_epi16(v, 8), zero));
+  }
+  __m128i acc = _mm_add_epi64(low, _mm_slli_epi64(high, 8));
+  uint64_t lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+  return lanes[0] + lanes[1] + SumScalar(in + i, n - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE4.2, every CPU with AVX2 has its CRC-32C instruction
+
+__attribute__((target("sse4.2")))
+uint32_t Crc32cSSE42(uint32_t crc, const uint8_t* data, size_t size) {
+  uint64_t c = ~crc;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  uint32_t c32 = c;
+  for (; i < size; i++) c32 = _mm_crc32_u8(c32, data[i]);
+  return ~c32;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2
+
+__attribute__((target("avx2")))
+void InterleaveBytesAVX2(const uint8_t* low, const uint8_t* high, size_t n,
+                         uint16_t* out) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i l = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(low + i)));
+    __m256i h = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(high + i)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_or_si256(l, _mm256_slli_epi16(h, 8)));
+  }
+  InterleaveBytesScalar(low + i, high + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void ShiftRightAVX2(const uint16_t* in, size_t n, int shift, uint16_t* out) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_srl_epi16(v, count));
+  }
+  ShiftRightScalar(in + i, n - i, shift, out + i);
+}
+
+__attribute__((target("avx2")))
+void HighBytesAVX2(const uint16_t* in, size_t n, uint8_t* out) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    __m256i b = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(in + i + 16));
+    // The pack works per 128-bit lane, the permute restores the pixel order.
+    __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                         _mm256_srli_epi16(b, 8));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  HighBytesScalar(in + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void UnextractAVX2(const uint16_t* in, size_t n, int shift, bool big_endian,
+                   uint8_t* out) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    v = _mm256_srl_epi16(v, count);
+    if (big_endian) {
+      v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 2), v);
+  }
+  UnextractScalar(in + i, n - i, shift, big_endian, out + i * 2);
+}
+
+__attribute__((target("avx2")))
+void AccumulateMomentsAVX2(const uint16_t* in, size_t n, uint64_t* sum,
+                           uint64_t* sum_squares) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_cvtepu16_epi64(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i)));
+    __m256i* s = reinterpret_cast<__m256i*>(sum + i);
+    __m256i* q = reinterpret_cast<__m256i*>(sum_squares + i);
+    _mm256_storeu_si256(s, _mm256_add_epi64(_mm256_loadu_si256(s), x));
+    _mm256_storeu_si256(q, _mm256_add_epi64(_mm256_loadu_si256(q),
+                                            _mm256_mul_epu32(x, x)));
+  }
+  AccumulateMomentsScalar(in + i, n - i, sum + i, sum_squares + i);
+}
+
+__attribute__((target("avx2")))
+void AccumulateMinMaxAVX2(const uint16_t* in, size_t n, uint16_t* min,
+                          uint16_t* max) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    __m256i* pmin = reinterpret_cast<__m256i*>(min + i);
+    __m256i* pmax = reinterpret_cast<__m256i*>(max + i);
+    _mm256_storeu_si256(pmin, _mm256_min_epu16(_mm256_loadu_si256(pmin), v));
+    _mm256_storeu_si256(pmax, _mm256_max_epu16(_mm256_loadu_si256(pmax), v));
+  }
+  AccumulateMinMaxScalar(in + i, n - i, min + i, max + i);
+}
+
+__attribute__((target("avx2")))
+uint64_t SumAVX2(const uint16_t* in, size_t n) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i mask = _mm256_set1_epi16(255);
+  __m256i low = zero;
+  __m256i high = zero;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    low = _mm256_add_epi64(low,
+                           _mm256_sad_epu8(_mm256_and_si256(v, mask), zero));
+    high = _mm256_add_epi64(high,
+                            _mm256_sad_epu8(_mm256_srli_epi16(v, 8), zero));
+  }
+  __m256i acc = _mm256_add_epi64(low, _mm256_slli_epi64(high, 8));
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+      SumScalar(in + i, n - i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512 BW
+
+__attribute__((target("avx512f,avx512bw")))
+void InterleaveBytesAVX512(const uint8_t* low, const uint8_t* high, size_t n,
+                           uint16_t* out) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i l = _mm512_cvtepu8_epi16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(low + i)));
+    __m512i h = _mm512_cvtepu8_epi16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(high + i)));
+    _mm512_storeu_si512(out + i, _mm512_or_si512(l, _mm512_slli_epi16(h, 8)));
+  }
+  InterleaveBytesScalar(low + i, high + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void ShiftRightAVX512(const uint16_t* in, size_t n, int shift,
+                      uint16_t* out) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i v = _mm512_loadu_si512(in + i);
+    _mm512_storeu_si512(out + i, _mm512_srl_epi16(v, count));
+  }
+  ShiftRightScalar(in + i, n - i, shift, out + i);
+}
+
+// The AVX-512 kernels use the zero-masking forms of the conversions and
+// multiplication with all lanes selected, which are the same instructions. The
+// unmasked forms merge into an undefined vector, which GCC 12 reports as maybe
+// uninitialized.
+#define FPV_ALL_LANES(bits) static_cast<__mmask##bits>(-1)
+
+__attribute__((target("avx512f,avx512bw")))
+void HighBytesAVX512(const uint16_t* in, size_t n, uint8_t* out) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i v = _mm512_srli_epi16(_mm512_loadu_si512(in + i), 8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm512_maskz_cvtepi16_epi8(FPV_ALL_LANES(32), v));
+  }
+  HighBytesScalar(in + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void UnextractAVX512(const uint16_t* in, size_t n, int shift, bool big_endian,
+                     uint8_t* out) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i v = _mm512_srl_epi16(_mm512_loadu_si512(in + i), count);
+    if (big_endian) {
+      v = _mm512_or_si512(_mm512_slli_epi16(v, 8), _mm512_srli_epi16(v, 8));
+    }
+    _mm512_storeu_si512(out + i * 2, v);
+  }
+  UnextractScalar(in + i, n - i, shift, big_endian, out + i * 2);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void AccumulateMomentsAVX512(const uint16_t* in, size_t n, uint64_t* sum,
+                             uint64_t* sum_squares) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i x = _mm512_maskz_cvtepu16_epi64(FPV_ALL_LANES(8),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+    _mm512_storeu_si512(sum + i,
+                        _mm512_add_epi64(_mm512_loadu_si512(sum + i), x));
+    _mm512_storeu_si512(sum_squares + i,
+                        _mm512_add_epi64(_mm512_loadu_si512(sum_squares + i),
+                                         _mm512_maskz_mul_epu32(
+                                             FPV_ALL_LANES(8), x, x)));
+  }
+  AccumulateMomentsScalar(in + i, n - i, sum + i, sum_squares + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void AccumulateMinMaxAVX512(const uint16_t* in, size_t n, uint16_t* min,
+                            uint16_t* max) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i v = _mm512_loadu_si512(in + i);
+    _mm512_storeu_si512(min + i,
+                        _mm512_min_epu16(_mm512_loadu_si512(min + i), v));
+    _mm512_storeu_si512(max + i,
+                        _mm512_max_epu16(_mm512_loadu_si512(max + i), v));
+  }
+  AccumulateMinMaxScalar(in + i, n - i, min + i, max + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+uint64_t SumAVX512(const uint16_t* in, size_t n) {
+  __m512i zero = _mm512_setzero_si512();
+  __m512i mask = _mm512_set1_epi16(255);
+  __m512i low = zero;
+  __m512i high = zero;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i v = _mm512_loadu_si512(in + i);
+    low = _mm512_add_epi64(low,
+                           _mm512_sad_epu8(_mm512_and_si512(v, mask), zero));
+    high = _mm512_add_epi64(high,
+                            _mm512_sad_epu8(_mm512_srli_epi16(v, 8), zero));
+  }
+  uint64_t low_lanes[8], high_lanes[8];
+  _mm512_storeu_si512(low_lanes, low);
+  _mm512_storeu_si512(high_lanes, high);
+  uint64_t result = SumScalar(in + i, n - i);
+  for (size_t k = 0; k < 8; k++) result += low_lanes[k] + (high_lanes[k] << 8);
+  return result;
+}
+
+#endif  // FPV_SIMD_X86
+
+const ConversionKernels kKernels[] = {
+  {InterleaveBytesScalar, ShiftRightScalar, HighBytesScalar, UnextractScalar},
+#ifdef FPV_SIMD_X86
+  {InterleaveBytesSSE2, ShiftRightSSE2, HighBytesSSE2, UnextractSSE2},
+  {InterleaveBytesAVX2, ShiftRightAVX2, HighBytesAVX2, UnextractAVX2},
+  {InterleaveBytesAVX512, ShiftRightAVX512, HighBytesAVX512, UnextractAVX512},
+#endif
+};
+
+const ReductionKernels kReductionKernels[] = {
+  {AccumulateMomentsScalar, AccumulateMinMaxScalar, SumScalar, Crc32cScalar},
+#ifdef FPV_SIMD_X86
+  {AccumulateMomentsSSE2, AccumulateMinMaxSSE2, SumSSE2, Crc32cScalar},
+  {AccumulateMomentsAVX2, AccumulateMinMaxAVX2, SumAVX2, Crc32cSSE42},
+  {AccumulateMomentsAVX512, AccumulateMinMaxAVX512, SumAVX512, Crc32cSSE42},
+#endif
+};
+
+SimdLevel DetectSimdLevelUncached() {
+#ifdef FPV_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+  return SIMD_SCALAR;
+}
+
+const ConversionKernels& BestKernels() {
+  static const ConversionKernels& kernels =
+      GetConversionKernels(DetectSimdLevel());
+  return kernels;
+}
+
+const ReductionKernels& BestReductionKernels() {
+  static const ReductionKernels& kernels =
+      GetReductionKernels(DetectSimdLevel());
+  return kernels;
+}
+
+}  // namespace
+
+SimdLevel DetectSimdLevel() {
+  static const SimdLevel level = DetectSimdLevelUncached();
+  return level;
+}
+
+const ConversionKernels& GetConversionKernels(SimdLevel level) {
+  if (level > DetectSimdLevel()) level = DetectSimdLevel();
+  return kKernels[level];
+}
+
+const ReductionKernels& GetReductionKernels(SimdLevel level) {
+  if (level > DetectSimdLevel()) level = DetectSimdLevel();
+  return kReductionKernels[level];
+}
+
+void InterleaveBytes(const uint8_t* low, const uint8_t* high, size_t n,
+                     uint16_t* out) {
+  BestKernels().interleave_bytes(low, high, n, out);
+}
+
+void ShiftRight16(const uint16_t* in, size_t n, int shift, uint16_t* out) {
+  BestKernels().shift_right(in, n, shift, out);
+}
+
+void HighBytes16(const uint16_t* in, size_t n, uint8_t* out) {
+  BestKernels().high_bytes(in, n, out);
+}
+
+void Unextract16(const uint16_t* in, size_t n, int shift, bool big_endian,
+                 uint8_t* out) {
+  BestKernels().unextract(in, n, shift, big_endian, out);
+}
+
+void AccumulateMoments16(const uint16_t* in, size_t n, uint64_t* sum,
+                         uint64_t* sum_squares) {
+  BestReductionKernels().accumulate_moments(in, n, sum, sum_squares);
+}
+
+void AccumulateMinMax16(const uint16_t* in, size_t n, uint16_t* min,
+                        uint16_t* max) {
+  BestReductionKernels().accumulate_min_max(in, n, min, max);
+}
+
+uint64_t Sum16(const uint16_t* in, size_t n) {
+  return BestReductionKernels().sum(in, n);
+}
+
+uint32_t Crc32c(uint32_t crc, const uint8_t* data, size_t size) {
+  return BestReductionKernels().crc32c(crc, data, size);
+}
+
+}  // namespace fpvc
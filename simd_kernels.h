@@ -0,0 +1,88 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FPV_SIMD_KERNELS_H_
+#define FPV_SIMD_KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fpvc {
+
+/* Vectorized pixel conversions used when outputting decoded frames, and
+reductions used to analyze decoded frames. Every kernel has a scalar version
+and SSE2, AVX2 and AVX-512 versions on x86, of which the best one the CPU
+supports is picked at runtime, so the library does not need to be compiled for
+a specific instruction set. */
+
+enum SimdLevel {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2 = 1,
+  SIMD_AVX2 = 2,
+  SIMD_AVX512 = 3,  // AVX-512 BW
+};
+
+struct ConversionKernels {
+  // out[i] = low[i] | (high[i] << 8).
+  void (*interleave_bytes)(const uint8_t* low, const uint8_t* high, size_t n,
+                           uint16_t* out);
+  // out[i] = in[i] >> shift, in and out may be the same.
+  void (*shift_right)(const uint16_t* in, size_t n, int shift, uint16_t* out);
+  // out[i] = in[i] >> 8.
+  void (*high_bytes)(const uint16_t* in, size_t n, uint8_t* out);
+  // Stores in[i] >> shift as two bytes in little or big endian order.
+  void (*unextract)(const uint16_t* in, size_t n, int shift, bool big_endian,
+                    uint8_t* out);
+};
+
+struct ReductionKernels {
+  // sum[i] += in[i], sum_squares[i] += in[i] * in[i].
+  void (*accumulate_moments)(const uint16_t* in, size_t n, uint64_t* sum,
+                             uint64_t* sum_squares);
+  // min[i] = min(min[i], in[i]), max[i] = max(max[i], in[i]).
+  void (*accumulate_min_max)(const uint16_t* in, size_t n, uint16_t* min,
+                             uint16_t* max);
+  // Returns in[0] + ... + in[n - 1].
+  uint64_t (*sum)(const uint16_t* in, size_t n);
+  // Returns the CRC-32C (Castagnoli) of the bytes, continuing from the CRC of
+  // preceding bytes, or 0 for the first bytes.
+  uint32_t (*crc32c)(uint32_t crc, const uint8_t* data, size_t size);
+};
+
+// Returns the best instruction set supported by the CPU, detected once.
+SimdLevel DetectSimdLevel();
+
+// Returns the kernels of the given level, or of the best level supported by
+// the CPU if that is lower. Mostly for testing, the functions below use the
+// kernels of DetectSimdLevel.
+const ConversionKernels& GetConversionKernels(SimdLevel level);
+const ReductionKernels& GetReductionKernels(SimdLevel level);
+
+void InterleaveBytes(const uint8_t* low, const uint8_t* high, size_t n,
+                     uint16_t* out);
+void ShiftRight16(const uint16_t* in, size_t n, int shift, uint16_t* out);
+void HighBytes16(const uint16_t* in, size_t n, uint8_t* out);
+void Unextract16(const uint16_t* in, size_t n, int shift, bool big_endian,
+                 uint8_t* out);
+
+void AccumulateMoments16(const uint16_t* in, size_t n, uint64_t* sum,
+                         uint64_t* sum_squares);
+void AccumulateMinMax16(const uint16_t* in, size_t n, uint16_t* min,
+                        uint16_t* max);
+uint64_t Sum16(const uint16_t* in, size_t n);
+uint32_t Crc32c(uint32_t crc, const uint8_t* data, size_t size);
+
+}  // namespace fpvc
+
+#endif  // FPV_SIMD_KERNELS_H_
@@ -0,0 +1,140 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks that the vector kernels of every instruction set the CPU supports
+// give the same output as the scalar kernels.
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <vector>
+
+#include "simd_kernels.h"
+
+namespace {
+
+const char* kLevelNames[] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+
+size_t failures = 0;
+
+void Expect(bool ok, const char* kernel, int level, size_t n) {
+  if (ok) return;
+  std::cout << kernel << " mismatch for " << kLevelNames[level] << " with "
+            << n << " pixels" << std::endl;
+  failures++;
+}
+
+}  // namespace
+
+int main() {
+  const fpvc::ConversionKernels& scalar =
+      fpvc::GetConversionKernels(fpvc::SIMD_SCALAR);
+  const fpvc::ReductionKernels& scalar_reduction =
+      fpvc::GetReductionKernels(fpvc::SIMD_SCALAR);
+  int best = fpvc::DetectSimdLevel();
+  std::cout << "CPU supports " << kLevelNames[best] << std::endl;
+
+  // Check value of CRC-32C.
+  const char* check = "123456789";
+  Expect(scalar_reduction.crc32c(0, reinterpret_cast<const uint8_t*>(check),
+                                 9) == 0xE3069283, "crc32c", 0, 9);
+
+  srand(1);
+  // Sizes around the vector widths, and an offset of one pixel to test
+  // unaligned buffers.
+  for (size_t n = 0; n < 300; n++) {
+    std::vector<uint8_t> low(n + 1), high(n + 1);
+    std::vector<uint16_t> pixels(n + 1);
+    for (size_t i = 0; i <= n; i++) {
+      low[i] = rand() & 255;
+      high[i] = rand() & 255;
+      pixels[i] = rand() & 65535;
+    }
+
+    for (int level = fpvc::SIMD_SSE2; level <= best; level++) {
+      const fpvc::ConversionKernels& kernels =
+          fpvc::GetConversionKernels(static_cast<fpvc::SimdLevel>(level));
+
+      std::vector<uint16_t> expected16(n), actual16(n);
+      scalar.interleave_bytes(low.data() + 1, high.data() + 1, n,
+                              expected16.data());
+      kernels.interleave_bytes(low.data() + 1, high.data() + 1, n,
+                               actual16.data());
+      Expect(expected16 == actual16, "interleave_bytes", level, n);
+
+      for (int shift = 0; shift <= 16; shift++) {
+        scalar.shift_right(pixels.data() + 1, n, shift, expected16.data());
+        kernels.shift_right(pixels.data() + 1, n, shift, actual16.data());
+        Expect(expected16 == actual16, "shift_right", level, n);
+
+        // In place, as done by the columnar batch decoder.
+        actual16.assign(pixels.begin() + 1, pixels.end());
+        kernels.shift_right(actual16.data(), n, shift, actual16.data());
+        Expect(expected16 == actual16, "shift_right in place", level, n);
+
+        for (bool big_endian : {false, true}) {
+          std::vector<uint8_t> expected(n * 2), actual(n * 2);
+          scalar.unextract(pixels.data() + 1, n, shift, big_endian,
+                           expected.data());
+          kernels.unextract(pixels.data() + 1, n, shift, big_endian,
+                            actual.data());
+          Expect(expected == actual, "unextract", level, n);
+        }
+      }
+
+      std::vector<uint8_t> expected8(n), actual8(n);
+      scalar.high_bytes(pixels.data() + 1, n, expected8.data());
+      kernels.high_bytes(pixels.data() + 1, n, actual8.data());
+      Expect(expected8 == actual8, "high_bytes", level, n);
+
+      const fpvc::ReductionKernels& reduction =
+          fpvc::GetReductionKernels(static_cast<fpvc::SimdLevel>(level));
+      // Accumulated twice, so that the previous values matter.
+      std::vector<uint64_t> expected_sum(n, 7), expected_squares(n, 11);
+      std::vector<uint64_t> actual_sum(n, 7), actual_squares(n, 11);
+      std::vector<uint16_t> expected_min(n, 0x9000), expected_max(n, 0x7000);
+      std::vector<uint16_t> actual_min(n, 0x9000), actual_max(n, 0x7000);
+      for (int k = 0; k < 2; k++) {
+        const uint16_t* in = k ? pixels.data() : pixels.data() + 1;
+        scalar_reduction.accumulate_moments(in, n, expected_sum.data(),
+                                            expected_squares.data());
+        reduction.accumulate_moments(in, n, actual_sum.data(),
+                                     actual_squares.data());
+        scalar_reduction.accumulate_min_max(in, n, expected_min.data(),
+                                            expected_max.data());
+        reduction.accumulate_min_max(in, n, actual_min.data(),
+                                     actual_max.data());
+      }
+      Expect(expected_sum == actual_sum &&
+             expected_squares == actual_squares,
+             "accumulate_moments", level, n);
+      Expect(expected_min == actual_min && expected_max == actual_max,
+             "accumulate_min_max", level, n);
+      Expect(scalar_reduction.sum(pixels.data() + 1, n) ==
+             reduction.sum(pixels.data() + 1, n), "sum", level, n);
+      // Split in two parts to test continuing a CRC.
+      uint32_t crc = reduction.crc32c(0, low.data() + 1, n / 3);
+      crc = reduction.crc32c(crc, low.data() + 1 + n / 3, n - n / 3);
+      Expect(scalar_reduction.crc32c(0, low.data() + 1, n) == crc, "crc32c",
+             level, n);
+    }
+  }
+
+  if (failures) {
+    std::cout << failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "all kernels match" << std::endl;
+  return 0;
+}
@@ -18,7 +18,20 @@ int main() {
     // Create a streaming decoder
     fpvc::StreamingDecoder decoder;
     
-    // Frame counter and frame selection
+    // Only process every 100th frame to match original behavior. The other
+    // frames are skipped without decompressing them, and only the high bytes
+    // which are saved below get decoded.
+    decoder.SetFrameSelector([](size_t index) {
+        return index % 100 == 0 && index < 3000;
+    });
+    decoder.SetDecodeMode(fpvc::StreamingDecoder::DECODE_MSB);
+    // The frames are delivered as 8-bit images holding the high bytes.
+    fpvc::DecodeTarget format;
+    format.type = fpvc::DecodeTarget::UINT8;
+    format.shift = 8;
+    decoder.SetOutputFormat(format);
+    
+    // Frame counter
     size_t frame_count = 0;
     
     // Process the file in chunks
@@ -26,7 +39,8 @@ int main() {
     std::vector<uint8_t> buffer(chunk_size);
     
     // Define decoder callback function
-    auto decode_callback = [&frame_count](bool ok, uint16_t* frame, 
+    auto decode_callback = [&frame_count, &decoder](bool ok,
+                                        uint16_t* frame, 
                                         size_t width, size_t height, 
                                         void* /*payload*/) {
         if (!ok) {
@@ -34,22 +48,17 @@ int main() {
             return;
         }
         
-        // Only process every 100th frame to match original behavior
-        if (frame_count % 100 == 0 && frame_count < 3000) {
-            std::cout << "Processing frame " << frame_count << std::endl;
-            
-            // Convert 16-bit to 8-bit (extract high byte)
-            std::vector<uint8_t> frame_8bit(width * height);
-            for (size_t j = 0; j < width * height; j++) {
-                frame_8bit[j] = (frame[j] >> 8) & 0xFF;
-            }
-            
-            // Create OpenCV Mat and save image
-            cv::Mat frame_Mat = cv::Mat(height, width, CV_8UC1, frame_8bit.data());
-            cv::imwrite("/home/wukong/Code/fusion-power-video/output/extracted-frames/decoded_8bit_" + 
-                      std::to_string(frame_count) + ".png", frame_Mat);
-        }
+        size_t index = decoder.frame_index();
+        std::cout << "Processing frame " << index << std::endl;
+        
+        // Create OpenCV Mat over the 8-bit frame and save image
+        cv::Mat frame_Mat = cv::Mat(height, width, CV_8UC1,
+                                    reinterpret_cast<uint8_t*>(frame));
+        cv::imwrite("/home/wukong/Code/fusion-power-video/output/extracted-frames/decoded_8bit_" + 
+                  std::to_string(index) + ".png", frame_Mat);
         
+        // Hand the borrowed frame back to the decoder's frame pool
+        decoder.ReturnFrame(frame);
         frame_count++;
     };
     
@@ -60,7 +69,7 @@ int main() {
         if (bytes_read == 0) break;
         
         // Pass the chunk to the decoder
-        decoder.Decode(buffer.data(), bytes_read, decode_callback);
+        decoder.DecodeBorrowed(buffer.data(), bytes_read, decode_callback);
     }
     
     std::cout << "Total frames decoded: " << frame_count << std::endl;
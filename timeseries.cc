@@ -0,0 +1,90 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Builds a pixel time series cache of a shot, or prints the time series of a
+// pixel or patch from such a cache.
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "timeseries_cache.h"
+
+size_t ParseInt(const std::string& s) {
+  size_t result = 0;
+  std::istringstream sstream(s);
+  sstream >> result;
+  return result;
+}
+
+int Usage(const char* name) {
+  std::cerr << "Usage: " << name << " build infile cachefile [block_frames]\n"
+            << "       " << name << " query cachefile x y [width height]\n"
+            << "    build: decodes the fusion power video file infile once and"
+            << " writes the cache\n"
+            << "    query: prints per frame the values of the pixel, or of the"
+            << " patch in row-major order, one frame per line\n"
+            << std::endl;
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) return Usage(argv[0]);
+  std::string command = argv[1];
+
+  if (command == "build" && (argc == 4 || argc == 5)) {
+    fpvc::RandomAccessDecoder decoder;
+    if (!decoder.OpenFile(argv[2],
+                          fpvc::RandomAccessDecoder::SEQUENTIAL_ACCESS)) {
+      std::cerr << "couldn't open " << argv[2] << std::endl;
+      return 1;
+    }
+    fpvc::TimeSeriesCacheOptions options;
+    options.num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (argc == 5) options.block_frames = ParseInt(argv[4]);
+    if (!fpvc::BuildTimeSeriesCache(decoder, argv[3], options)) {
+      std::cerr << "couldn't build " << argv[3] << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (command == "query" && (argc == 5 || argc == 7)) {
+    fpvc::TimeSeriesCache cache;
+    if (!cache.Open(argv[2])) {
+      std::cerr << "couldn't open " << argv[2] << std::endl;
+      return 1;
+    }
+    size_t x = ParseInt(argv[3]);
+    size_t y = ParseInt(argv[4]);
+    size_t width = argc == 7 ? ParseInt(argv[5]) : 1;
+    size_t height = argc == 7 ? ParseInt(argv[6]) : 1;
+    size_t n = cache.numframes();
+    std::vector<uint16_t> values(width * height * n);
+    if (!cache.GetPatch(x, y, width, height, 0, n, values.data())) {
+      std::cerr << "invalid patch" << std::endl;
+      return 1;
+    }
+    for (size_t t = 0; t < n; t++) {
+      for (size_t i = 0; i < width * height; i++) {
+        std::cout << (i ? " " : "") << values[i * n + t];
+      }
+      std::cout << "\n";
+    }
+    return 0;
+  }
+
+  return Usage(argv[0]);
+}
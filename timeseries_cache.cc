@@ -0,0 +1,296 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "timeseries_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+
+namespace fpvc {
+
+namespace {
+
+#define TIMESERIES_HEADER_SIZE 32
+#define TIMESERIES_TRAILER_SIZE 12
+#define TIMESERIES_INDEX_ENTRY_SIZE 12
+
+// Transposes and compresses one tile of the frames of a time block, see the
+// format in the header.
+bool CompressTile(const std::vector<uint16_t>& frames, size_t num_frames,
+                  size_t xsize, size_t ysize, size_t x0, size_t y0,
+                  size_t width, size_t height, int quality,
+                  std::vector<uint8_t>* planes, std::vector<uint8_t>* out) {
+  size_t n = width * height * num_frames;
+  planes->resize(n * 2);
+  uint8_t* high = planes->data();
+  uint8_t* low = planes->data() + n;
+  size_t pos = 0;
+  for (size_t y = y0; y < y0 + height; y++) {
+    for (size_t x = x0; x < x0 + width; x++) {
+      const uint16_t* pixel = frames.data() + y * xsize + x;
+      uint16_t prev = 0;
+      for (size_t t = 0; t < num_frames; t++) {
+        uint16_t v = pixel[t * xsize * ysize];
+        uint16_t delta = v - prev;
+        prev = v;
+        high[pos] = delta >> 8;
+        low[pos] = delta & 255;
+        pos++;
+      }
+    }
+  }
+  size_t size = BrotliEncoderMaxCompressedSize(planes->size());
+  out->resize(size);
+  if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_DEFAULT_MODE, planes->size(),
+                             planes->data(), &size, out->data())) {
+    return false;
+  }
+  out->resize(size);
+  return true;
+}
+
+}  // namespace
+
+bool BuildTimeSeriesCache(const RandomAccessDecoder& decoder,
+                          const std::string& path,
+                          const TimeSeriesCacheOptions& options) {
+  size_t xsize = decoder.xsize();
+  size_t ysize = decoder.ysize();
+  size_t num_frames = decoder.numframes();
+  size_t tile_xsize = std::max<size_t>(1, options.tile_xsize);
+  size_t tile_ysize = std::max<size_t>(1, options.tile_ysize);
+  size_t frame_bytes = std::max<size_t>(1, xsize * ysize * sizeof(uint16_t));
+  size_t block_frames = std::max<size_t>(1, std::min(
+      options.block_frames, options.max_memory_bytes / frame_bytes));
+  size_t num_threads = std::max<size_t>(1, options.num_threads);
+  size_t tiles_x = (xsize + tile_xsize - 1) / tile_xsize;
+  size_t tiles_y = (ysize + tile_ysize - 1) / tile_ysize;
+  size_t num_tiles = tiles_x * tiles_y;
+
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) return false;
+  bool ok = true;
+  uint8_t header[TIMESERIES_HEADER_SIZE];
+  memcpy(header, "FPVT", 4);
+  WriteUint32LE(xsize, header + 4);
+  WriteUint32LE(ysize, header + 8);
+  WriteUint64LE(num_frames, header + 12);
+  WriteUint32LE(tile_xsize, header + 20);
+  WriteUint32LE(tile_ysize, header + 24);
+  WriteUint32LE(block_frames, header + 28);
+  ok &= fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  size_t offset = sizeof(header);
+
+  std::vector<uint8_t> index;
+  std::vector<uint16_t> frames;
+  std::vector<std::vector<uint8_t>> chunks(num_tiles);
+  BatchDecodeOptions decode_options;
+  decode_options.num_threads = num_threads;
+  decode_options.in_order = false;
+  for (size_t begin = 0; ok && begin < num_frames; begin += block_frames) {
+    size_t end = std::min(begin + block_frames, num_frames);
+    size_t frame_size = xsize * ysize;
+    frames.resize((end - begin) * frame_size);
+    ok &= decoder.DecodeFrames(begin, end, decode_options,
+        [&](bool frame_ok, size_t i, const uint16_t* frame) {
+          if (frame_ok) {
+            std::copy(frame, frame + frame_size,
+                      frames.data() + (i - begin) * frame_size);
+          }
+        });
+    if (!ok) break;
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> compress_ok{true};
+    auto run_thread = [&]() {
+      std::vector<uint8_t> planes;
+      for (;;) {
+        size_t tile = next++;
+        if (tile >= num_tiles) return;
+        size_t x0 = (tile % tiles_x) * tile_xsize;
+        size_t y0 = (tile / tiles_x) * tile_ysize;
+        if (!CompressTile(frames, end - begin, xsize, ysize, x0, y0,
+                          std::min(tile_xsize, xsize - x0),
+                          std::min(tile_ysize, ysize - y0), options.quality,
+                          &planes, &chunks[tile])) {
+          compress_ok = false;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; i++) threads.emplace_back(run_thread);
+    run_thread();
+    for (std::thread& thread : threads) thread.join();
+    ok &= compress_ok;
+
+    for (size_t tile = 0; ok && tile < num_tiles; tile++) {
+      const std::vector<uint8_t>& chunk = chunks[tile];
+      ok &= fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+      uint8_t entry[TIMESERIES_INDEX_ENTRY_SIZE];
+      WriteUint64LE(offset, entry);
+      WriteUint32LE(chunk.size(), entry + 8);
+      index.insert(index.end(), entry, entry + sizeof(entry));
+      offset += chunk.size();
+    }
+  }
+
+  uint8_t trailer[TIMESERIES_TRAILER_SIZE];
+  WriteUint64LE(offset, trailer);
+  memcpy(trailer + 8, "FPVT", 4);
+  ok &= fwrite(index.data(), 1, index.size(), file) == index.size();
+  ok &= fwrite(trailer, 1, sizeof(trailer), file) == sizeof(trailer);
+  ok &= fclose(file) == 0;
+  return ok;
+}
+
+TimeSeriesCache::~TimeSeriesCache() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool TimeSeriesCache::Open(const std::string& path) {
+  if (fd_ >= 0) close(fd_);
+  fd_ = open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) return false;
+  off_t size = lseek(fd_, 0, SEEK_END);
+  if (size < TIMESERIES_HEADER_SIZE + TIMESERIES_TRAILER_SIZE) return false;
+
+  uint8_t header[TIMESERIES_HEADER_SIZE];
+  uint8_t trailer[TIMESERIES_TRAILER_SIZE];
+  if (!ReadFully(fd_, 0, sizeof(header), header) ||
+      !ReadFully(fd_, size - sizeof(trailer), sizeof(trailer), trailer)) {
+    return false;
+  }
+  if (memcmp(header, "FPVT", 4) != 0 || memcmp(trailer + 8, "FPVT", 4) != 0) {
+    return false;
+  }
+  xsize_ = ReadUint32LE(header + 4);
+  ysize_ = ReadUint32LE(header + 8);
+  num_frames_ = ReadUint64LE(header + 12);
+  tile_xsize_ = ReadUint32LE(header + 20);
+  tile_ysize_ = ReadUint32LE(header + 24);
+  block_frames_ = ReadUint32LE(header + 28);
+  if (!tile_xsize_ || !tile_ysize_ || !block_frames_) return false;
+  tiles_x_ = (xsize_ + tile_xsize_ - 1) / tile_xsize_;
+  tiles_y_ = (ysize_ + tile_ysize_ - 1) / tile_ysize_;
+  size_t num_blocks = (num_frames_ + block_frames_ - 1) / block_frames_;
+
+  size_t index_offset = ReadUint64LE(trailer);
+  size_t index_size =
+      num_blocks * tiles_x_ * tiles_y_ * TIMESERIES_INDEX_ENTRY_SIZE;
+  if (index_offset + index_size + sizeof(trailer) !=
+      static_cast<size_t>(size)) {
+    return false;
+  }
+  index_.resize(index_size);
+  return ReadFully(fd_, index_offset, index_size, index_.data());
+}
+
+bool TimeSeriesCache::ReadChunk(size_t block, size_t tile,
+                                std::vector<uint8_t>* buffer,
+                                std::vector<uint16_t>* values) const {
+  const uint8_t* entry = index_.data() +
+      (block * tiles_x_ * tiles_y_ + tile) * TIMESERIES_INDEX_ENTRY_SIZE;
+  size_t offset = ReadUint64LE(entry);
+  size_t size = ReadUint32LE(entry + 8);
+  size_t x0 = (tile % tiles_x_) * tile_xsize_;
+  size_t y0 = (tile / tiles_x_) * tile_ysize_;
+  size_t frames = std::min(block_frames_, num_frames_ - block * block_frames_);
+  size_t n = std::min(tile_xsize_, xsize_ - x0) *
+      std::min(tile_ysize_, ysize_ - y0) * frames;
+
+  buffer->resize(size + n * 2);
+  uint8_t* compressed = buffer->data();
+  uint8_t* planes = buffer->data() + size;
+  size_t decoded_size = n * 2;
+  if (!ReadFully(fd_, offset, size, compressed) ||
+      BrotliDecoderDecompress(size, compressed, &decoded_size, planes) !=
+          BROTLI_DECODER_RESULT_SUCCESS ||
+      decoded_size != n * 2) {
+    return false;
+  }
+
+  values->resize(n);
+  for (size_t i = 0; i < n; i += frames) {
+    uint16_t v = 0;
+    for (size_t t = 0; t < frames; t++) {
+      v += (planes[i + t] << 8) | planes[n + i + t];
+      (*values)[i + t] = v;
+    }
+  }
+  return true;
+}
+
+bool TimeSeriesCache::GetPixel(size_t x, size_t y,
+                               std::vector<uint16_t>* series) const {
+  series->resize(num_frames_);
+  return GetPatch(x, y, 1, 1, 0, num_frames_, series->data());
+}
+
+bool TimeSeriesCache::GetPatch(size_t x0, size_t y0, size_t width,
+                               size_t height, size_t begin, size_t end,
+                               uint16_t* out) const {
+  if (fd_ < 0) return false;
+  if (x0 + width > xsize_ || y0 + height > ysize_ || end > num_frames_ ||
+      begin > end) {
+    return false;
+  }
+  if (width == 0 || height == 0 || begin == end) return true;
+  size_t length = end - begin;
+  std::vector<uint8_t> buffer;
+  std::vector<uint16_t> values;
+  for (size_t block = begin / block_frames_;
+       block * block_frames_ < end; block++) {
+    size_t first = block * block_frames_;
+    size_t frames = std::min(block_frames_, num_frames_ - first);
+    size_t t0 = std::max(first, begin);
+    size_t t1 = std::min(first + frames, end);
+    for (size_t ty = y0 / tile_ysize_; ty * tile_ysize_ < y0 + height; ty++) {
+      for (size_t tx = x0 / tile_xsize_; tx * tile_xsize_ < x0 + width;
+           tx++) {
+        if (!ReadChunk(block, ty * tiles_x_ + tx, &buffer, &values)) {
+          return false;
+        }
+        size_t tile_x0 = tx * tile_xsize_;
+        size_t tile_y0 = ty * tile_ysize_;
+        size_t tile_width = std::min(tile_xsize_, xsize_ - tile_x0);
+        size_t ya = std::max(y0, tile_y0);
+        size_t yb = std::min(y0 + height, tile_y0 + tile_ysize_);
+        size_t xa = std::max(x0, tile_x0);
+        size_t xb = std::min(x0 + width, tile_x0 + tile_width);
+        for (size_t y = ya; y < yb; y++) {
+          for (size_t x = xa; x < xb; x++) {
+            const uint16_t* series = values.data() +
+                ((y - tile_y0) * tile_width + (x - tile_x0)) * frames;
+            std::copy(series + (t0 - first), series + (t1 - first),
+                      out + ((y - y0) * width + (x - x0)) * length +
+                          (t0 - begin));
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace fpvc
@@ -0,0 +1,116 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FPV_TIMESERIES_CACHE_H_
+#define FPV_TIMESERIES_CACHE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "fusion_power_video.h"
+
+namespace fpvc {
+
+/* Transposed copy of a shot for reading the values of a pixel, or of a small
+patch, over time. The frames are cut into tiles of tile_xsize * tile_ysize
+pixels, and the time into blocks of block_frames frames. Each tile of each time
+block is stored as a chunk holding the time series of its pixels one after
+another, so the series of a pixel over the whole shot is found in one small
+chunk per time block, rather than in every frame.
+
+Cache file format, all integers little endian:
+-4 bytes: "FPVT"
+-4 bytes: xsize, 4 bytes: ysize, 8 bytes: amount of frames N
+-4 bytes: tile_xsize, 4 bytes: tile_ysize, 4 bytes: block_frames
+-per time block, per tile in row-major order: a chunk, which is a brotli stream
+ of the high bytes and then the low bytes of the values of the tile, pixel by
+ pixel in row-major order, each pixel with the values of the frames of the time
+ block, where each value except the first of a pixel is stored as its
+ difference to the previous value modulo 2^16
+-index, per time block, per tile: 8 bytes offset and 4 bytes size of its chunk
+-8 bytes: offset of the index
+-4 bytes: "FPVT" */
+
+struct TimeSeriesCacheOptions {
+  size_t tile_xsize = 16;
+  size_t tile_ysize = 16;
+  /* Frames per time block, at most. A query reads and fully decompresses one
+  chunk per time block and tile, of tile_xsize * tile_ysize * block_frames * 2
+  bytes, so smaller blocks make short queries cheaper. On the other hand the
+  index, which Open reads whole, has 12 bytes per tile per time block. */
+  size_t block_frames = 64;
+  // Maximum amount of memory for the decoded frames of a time block, which
+  // building holds at once. Lowers block_frames for large frames, down to 1.
+  size_t max_memory_bytes = 512 << 20;
+  // Amount of threads that decode frames and compress tiles.
+  size_t num_threads = 4;
+  // Brotli quality of the chunks, low like for the frames since the cache is
+  // a temporary copy.
+  int quality = 1;
+};
+
+// Decodes every frame of the decoder once and writes the cache to path.
+bool BuildTimeSeriesCache(const RandomAccessDecoder& decoder,
+                          const std::string& path,
+                          const TimeSeriesCacheOptions& options = {});
+
+// Reads time series from a cache file written by BuildTimeSeriesCache.
+// Queries only read the chunks of the requested tiles and time blocks, and
+// may be done from multiple threads.
+class TimeSeriesCache {
+ public:
+  TimeSeriesCache() = default;
+  ~TimeSeriesCache();
+  TimeSeriesCache(const TimeSeriesCache&) = delete;
+  TimeSeriesCache& operator=(const TimeSeriesCache&) = delete;
+
+  // Opens the cache file and reads its index.
+  bool Open(const std::string& path);
+
+  size_t xsize() const { return xsize_; }
+  size_t ysize() const { return ysize_; }
+  size_t numframes() const { return num_frames_; }
+
+  // Outputs the values of pixel (x, y) of all frames.
+  bool GetPixel(size_t x, size_t y, std::vector<uint16_t>* series) const;
+
+  /* Outputs the values of the pixels of the patch of width * height pixels at
+  (x0, y0) of the frames [begin, end). The output has, per pixel of the patch
+  in row-major order, the end - begin values of that pixel. */
+  bool GetPatch(size_t x0, size_t y0, size_t width, size_t height,
+                size_t begin, size_t end, uint16_t* out) const;
+
+ private:
+  // Reads and decompresses the chunk of the given time block and tile into
+  // the values of its pixels, pixel by pixel.
+  bool ReadChunk(size_t block, size_t tile, std::vector<uint8_t>* buffer,
+                 std::vector<uint16_t>* values) const;
+
+  int fd_ = -1;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  size_t num_frames_ = 0;
+  size_t tile_xsize_ = 0;
+  size_t tile_ysize_ = 0;
+  size_t block_frames_ = 0;
+  size_t tiles_x_ = 0;
+  size_t tiles_y_ = 0;
+  std::vector<uint8_t> index_;
+};
+
+}  // namespace fpvc
+
+#endif  // FPV_TIMESERIES_CACHE_H_
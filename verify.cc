@@ -0,0 +1,96 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the frame checksums of a file on all cores, optionally also fully
+// decoding a sample of the frames, and lists the corrupt frames.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "fusion_power_video.h"
+
+size_t ParseInt(const std::string& s) {
+  size_t result = 0;
+  std::istringstream sstream(s);
+  sstream >> result;
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " file [decode_every]\n"
+              << "    file: fusion power video file to verify\n"
+              << "    decode_every: also decode every so many frames and check"
+              << " their pixels, 1 decodes all frames, 0 (default) none\n"
+              << std::endl;
+    return 1;
+  }
+  size_t decode_every = argc == 3 ? ParseInt(argv[2]) : 0;
+
+  fpvc::RandomAccessDecoder decoder;
+  if (!decoder.OpenFile(argv[1],
+                        fpvc::RandomAccessDecoder::SEQUENTIAL_ACCESS)) {
+    std::cerr << "couldn't open " << argv[1] << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t num_frames = decoder.numframes();
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> bytes{0};
+  std::atomic<size_t> decoded{0};
+  std::atomic<size_t> unchecked{0};
+  std::mutex m;
+  std::vector<size_t> corrupt;
+  auto run_thread = [&]() {
+    fpvc::DecodeContext context;
+    context.worker = true;
+    for (;;) {
+      size_t index = next++;
+      if (index >= num_frames) return;
+      bool decode = decode_every && index % decode_every == 0;
+      fpvc::RandomAccessDecoder::VerifyResult result =
+          decoder.VerifyFrame(index, decode, &context);
+      if (result == fpvc::RandomAccessDecoder::VERIFY_CORRUPT) {
+        std::unique_lock<std::mutex> l(m);
+        corrupt.push_back(index);
+      } else if (result == fpvc::RandomAccessDecoder::VERIFY_NO_CHECKSUM) {
+        unchecked++;
+      }
+      decoded += decode;
+      size_t offset, size;
+      if (decoder.FrameRange(index, &offset, &size)) bytes += size;
+    }
+  };
+  std::vector<std::thread> threads;
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t i = 1; i < num_threads; i++) threads.emplace_back(run_thread);
+  run_thread();
+  for (std::thread& thread : threads) thread.join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::sort(corrupt.begin(), corrupt.end());
+  for (size_t index : corrupt) std::cout << "corrupt frame " << index << "\n";
+  std::cerr << num_frames << " frames, " << corrupt.size() << " corrupt, "
+            << unchecked << " without checksum, " << decoded << " decoded, "
+            << (bytes / seconds / 1e6) << " MB/s" << std::endl;
+  return corrupt.empty() ? 0 : 1;
+}